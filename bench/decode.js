@@ -0,0 +1,49 @@
+"use strict";
+
+// Time decode() over the test images, once per entry of the table below, so
+// that the speed of the options can be compared, e.g.
+//
+//     % npm run bench -- jpeg
+//
+// only runs the entries whose name contains "jpeg".
+
+const fs   = require("fs");
+const path = require("path");
+
+const quirc = require("../index.js");
+
+const benchmarks = [
+    { name: "png",                image: "big_image_with_two_qrcodes.png" },
+    { name: "jpeg accurate",      image: "big_image_with_two_qrcodes.jpeg" },
+    { name: "jpeg fast",          image: "big_image_with_two_qrcodes.jpeg", options: { jpeg: "fast" } },
+    { name: "jpeg restart",       image: "restart.jpeg" },
+    { name: "jpeg restart fast",  image: "restart.jpeg", options: { jpeg: "fast" } },
+    { name: "jpeg restart bands", image: "restart.jpeg", settings: { jpegThreads: 4 } },
+    { name: "png pipelined",      image: "big_image_with_two_qrcodes.png", settings: { pipelinePixels: 1 } },
+];
+// undo the settings of any benchmark
+const defaults = { jpegThreads: 1, pipelinePixels: 0 };
+
+const iterations = 20;
+
+async function run({ name, image, options, settings }) {
+    const img = fs.readFileSync(path.join(__dirname, "..", "test", "data", image));
+    quirc.configure({ ...defaults, ...settings });
+    await quirc.decode(img, options); // warm up
+    const start = process.hrtime.bigint();
+    for (let i = 0; i < iterations; i++) {
+        await quirc.decode(img, options);
+    }
+    const ms = Number(process.hrtime.bigint() - start) / 1e6 / iterations;
+    console.log(`${name.padEnd(20)} ${ms.toFixed(2).padStart(8)} ms/decode`);
+}
+
+(async () => {
+    const filter = process.argv[2] || "";
+    for (const benchmark of benchmarks) {
+        if (benchmark.name.includes(filter)) {
+            await run(benchmark);
+        }
+    }
+    quirc.configure(defaults);
+})();
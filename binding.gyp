@@ -3,7 +3,8 @@
         {
             "target_name": "node-quirc",
             "sources": [
-                "src/node-quirc.cc"
+                "src/node-quirc.cc",
+                "src/node_quirc_sched.cc"
             ],
             "include_dirs": [
                 "<!(node -e \"require('nan')\")",
@@ -18,6 +19,7 @@
             "product_prefix": "lib",
             "type": "static_library",
             "sources": [
+                "src/node_quirc_cache.c",
                 "src/node_quirc_decode.c"
             ],
             "cflags+":   [ "-std=c99" ],
@@ -30,6 +32,12 @@
                 "libraries": [
                     "-lpng",
                     "-ljpeg"
+                ],
+                "conditions": [
+                    # iconv(3) is not part of the libc there
+                    ["OS=='mac'", {
+                        "libraries": [ "-liconv" ]
+                    }]
                 ]
             }
         }
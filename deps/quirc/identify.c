@@ -175,19 +175,22 @@ static void flood_fill_seed(struct quirc *q, int x, int y, int from, int to,
  * Adaptive thresholding
  */
 
-static uint8_t otsu(const struct quirc *q)
+static void histogram_count(const struct quirc *q,
+			    unsigned int histogram[UINT8_MAX + 1])
 {
-	int numPixels = q->w * q->h;
-
-	// Calculate histogram
-	unsigned int histogram[UINT8_MAX + 1];
-	(void)memset(histogram, 0, sizeof(histogram));
+	(void)memset(histogram, 0, (UINT8_MAX + 1) * sizeof(*histogram));
 	uint8_t* ptr = q->image;
-	int length = numPixels;
+	int length = q->w * q->h;
 	while (length--) {
 		uint8_t value = *ptr++;
 		histogram[value]++;
 	}
+}
+
+static uint8_t otsu(const struct quirc *q,
+		    const unsigned int histogram[UINT8_MAX + 1])
+{
+	int numPixels = q->w * q->h;
 
 	// Calculate weighted sum of histogram values
 	unsigned int sum = 0;
@@ -1104,10 +1107,34 @@ uint8_t *quirc_begin(struct quirc *q, int *w, int *h)
 
 void quirc_end(struct quirc *q)
 {
-	int i;
+	unsigned int histogram[UINT8_MAX + 1];
 
-	uint8_t threshold = otsu(q);
+	histogram_count(q, histogram);
+	quirc_end_with_histogram(q, histogram);
+}
+
+void quirc_end_with_histogram(struct quirc *q,
+			      const unsigned int histogram[256])
+{
+	uint8_t threshold = otsu(q, histogram);
 	pixels_setup(q, threshold);
+	quirc_end_bilevel(q);
+}
+
+quirc_pixel_t *quirc_begin_bilevel(struct quirc *q, int *w, int *h)
+{
+	(void)quirc_begin(q, w, h);
+
+	if (QUIRC_PIXEL_ALIAS_IMAGE) {
+		q->pixels = (quirc_pixel_t *)q->image;
+	}
+
+	return q->pixels;
+}
+
+void quirc_end_bilevel(struct quirc *q)
+{
+	int i;
 
 	for (i = 0; i < q->h; i++)
 		finder_scan(q, i);
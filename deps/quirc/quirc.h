@@ -56,6 +56,13 @@ int quirc_resize(struct quirc *q, int w, int h);
 uint8_t *quirc_begin(struct quirc *q, int *w, int *h);
 void quirc_end(struct quirc *q);
 
+/* Like quirc_end(), for callers which already counted the pixels of each
+ * value (0 to 255) while filling the buffer, saving a pass over it to
+ * compute the thresholding histogram.
+ */
+void quirc_end_with_histogram(struct quirc *q,
+			      const unsigned int histogram[256]);
+
 /* This structure describes a location in the input image buffer. */
 struct quirc_point {
 	int	x;
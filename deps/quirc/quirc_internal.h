@@ -112,4 +112,19 @@ struct quirc_version_info {
 
 extern const struct quirc_version_info quirc_version_db[QUIRC_MAX_VERSION + 1];
 
+/************************************************************************
+ * Bilevel input
+ */
+
+/* Like quirc_begin(), for callers which already know which pixels are
+ * black: the returned buffer should be filled with QUIRC_PIXEL_BLACK and
+ * QUIRC_PIXEL_WHITE values, one per pixel, instead of the image.
+ */
+quirc_pixel_t *quirc_begin_bilevel(struct quirc *q, int *w, int *h);
+
+/* Like quirc_end(), for a buffer filled after quirc_begin_bilevel(). The
+ * thresholding is skipped altogether.
+ */
+void quirc_end_bilevel(struct quirc *q);
+
 #endif
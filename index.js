@@ -3,8 +3,71 @@
 // Our C++ Addon
 const addon = require('bindings')('node-quirc.node');
 
-function decodeEncoded(img, callback) {
-    return addon.decodeEncoded(img, callback);
+const BinaryResults = require("./lib/binary.js");
+const DecodeStream = require("./lib/stream.js");
+const IncrementalDecoder = require("./lib/incremental.js");
+const { Readable } = require("stream");
+
+// decode() priority classes, from the most to the least urgent.
+const priorities = ["interactive", "normal", "bulk"];
+
+// validate decode() options and convert them for the addon.
+function nativeOptions(options) {
+    if (options === undefined || options === null) {
+        options = {};
+    } else if (typeof options !== "object") {
+        throw new TypeError("options must be an object");
+    }
+    const {
+        priority = "normal",
+        output = "objects",
+        encoding = "buffer",
+        jpeg = "accurate",
+    } = options;
+    if (!priorities.includes(priority)) {
+        throw new TypeError(`unexpected priority value: ${priority}`);
+    }
+    const arena = (output instanceof Uint8Array ? output : undefined);
+    if (output !== "objects" && output !== "binary" && !arena) {
+        throw new TypeError(`unexpected output value: ${output}`);
+    }
+    if (encoding !== "buffer" && encoding !== "string") {
+        throw new TypeError(`unexpected encoding value: ${encoding}`);
+    }
+    if (encoding === "string" && output !== "objects") {
+        throw new TypeError("string encoding requires the objects output");
+    }
+    if (jpeg !== "accurate" && jpeg !== "fast") {
+        throw new TypeError(`unexpected jpeg value: ${jpeg}`);
+    }
+    return {
+        priority: priorities.indexOf(priority),
+        binary: output === "binary",
+        text: encoding === "string",
+        fast: jpeg === "fast",
+        arena,
+    };
+}
+
+// Error yielded when a job is rejected because too many are already queued,
+// see configure().
+function queueFullError() {
+    const err = new Error("decode queue is full");
+    err.code = "ERR_QUEUE_FULL";
+    return err;
+}
+
+// report to callback when the addon did not accept the job.
+function checkQueued(queued, callback) {
+    if (!queued) {
+        process.nextTick(callback, queueFullError());
+    }
+}
+
+// native is the result of nativeOptions()
+function decodeEncoded(img, native, callback) {
+    const queued = addon.decodeEncoded(img, native, callback);
+    checkQueued(queued, callback);
 }
 
 function isImageDimension(number) {
@@ -16,7 +79,8 @@ function isImageDimension(number) {
     );
 }
 
-function decodeRaw(img, callback) {
+// native is the result of nativeOptions()
+function decodeRaw(img, native, callback) {
     if (!isImageDimension(img.width)) {
         throw new Error(
             `unexpected width value for image: ${img.width}`
@@ -27,20 +91,181 @@ function decodeRaw(img, callback) {
             `unexpected height value for image: ${img.height}`
         )
     }
-    const channels = img.data.length / img.width / img.height;
-    if (channels !== 1 && channels !== 3 && channels !== 4) {
-        throw new Error(
-            `unsupported ${channels}-channel image, expected 1, 3, or 4`
-        );
+    if (img.format === "bilevel") {
+        // 1-bit pixels, each row padded to a whole byte like PBM ones.
+        const expected = Math.ceil(img.width / 8) * img.height;
+        if (img.data.length !== expected) {
+            throw new Error(
+                `unexpected bilevel image length: ${img.data.length}, expected ${expected}`
+            );
+        }
+        native = { ...native, bilevel: true };
+    } else if (img.format !== undefined) {
+        throw new Error(`unexpected format value for image: ${img.format}`);
+    } else {
+        const channels = img.data.length / img.width / img.height;
+        if (channels !== 1 && channels !== 3 && channels !== 4) {
+            throw new Error(
+                `unsupported ${channels}-channel image, expected 1, 3, or 4`
+            );
+        }
+    }
+    const queued = addon.decodeRaw(
+        img.data, img.width, img.height, native, callback
+    );
+    checkQueued(queued, callback);
+}
+
+function isUnsigned(number) {
+    return (
+        typeof number === 'number' &&
+        number >= 0 &&
+        Number.isSafeInteger(number)
+    );
+}
+
+// Call every callback of a completion batch, see configure().
+function dispatchBatch(batch) {
+    for (let i = 0; i < batch.length; i += 3) {
+        const callback = batch[i];
+        try {
+            callback(batch[i + 1], batch[i + 2]);
+        } catch (e) {
+            // report as uncaught without preventing the rest of the batch
+            // from being delivered.
+            process.nextTick(() => { throw e; });
+        }
+    }
+}
+
+function configureBatch(batch) {
+    if (batch === false || batch === null) {
+        return addon.setBatch(false);
+    }
+    if (typeof batch !== "object") {
+        throw new TypeError("batch must be an object or false");
+    }
+    const { maxDelay = 1, maxSize = 64 } = batch;
+    if (!isUnsigned(maxDelay)) {
+        throw new TypeError(`unexpected batch.maxDelay value: ${maxDelay}`);
+    }
+    if (!isUnsigned(maxSize) || maxSize === 0) {
+        throw new TypeError(`unexpected batch.maxSize value: ${maxSize}`);
+    }
+    return addon.setBatch(dispatchBatch, maxDelay, maxSize);
+}
+
+function configureCache(cache) {
+    if (cache === false || cache === null) {
+        return addon.setCache(0, 0);
+    }
+    if (typeof cache !== "object") {
+        throw new TypeError("cache must be an object or false");
+    }
+    const { maxEntries = 256, maxBytes = 64 * 1024 * 1024 } = cache;
+    if (!isUnsigned(maxEntries) || maxEntries === 0) {
+        throw new TypeError(`unexpected cache.maxEntries value: ${maxEntries}`);
+    }
+    if (!isUnsigned(maxBytes)) {
+        throw new TypeError(`unexpected cache.maxBytes value: ${maxBytes}`);
     }
-    return addon.decodeRaw(img.data, img.width, img.height, callback);
+    return addon.setCache(maxEntries, maxBytes);
 }
 
+// current memory budget settings, see configure().
+const memory = { budget: 0, wait: false };
+
+function configure(options) {
+    if (!options || typeof options !== "object") {
+        throw new TypeError("options must be an object");
+    }
+    if (options.batch !== undefined) {
+        configureBatch(options.batch);
+    }
+    if (options.cache !== undefined) {
+        configureCache(options.cache);
+    }
+    if (options.priorityAging !== undefined) {
+        if (!isUnsigned(options.priorityAging)) {
+            throw new TypeError(
+                `unexpected priorityAging value: ${options.priorityAging}`
+            );
+        }
+        addon.setPriorityAging(options.priorityAging);
+    }
+    if (options.maxQueueDepth !== undefined) {
+        if (!isUnsigned(options.maxQueueDepth)) {
+            throw new TypeError(
+                `unexpected maxQueueDepth value: ${options.maxQueueDepth}`
+            );
+        }
+        addon.setMaxQueueDepth(options.maxQueueDepth);
+    }
+    if (options.maxPixels !== undefined) {
+        if (!isUnsigned(options.maxPixels)) {
+            throw new TypeError(
+                `unexpected maxPixels value: ${options.maxPixels}`
+            );
+        }
+        addon.setMaxPixels(options.maxPixels);
+    }
+    if (options.jpegPixelBudget !== undefined) {
+        if (!isUnsigned(options.jpegPixelBudget)) {
+            throw new TypeError(
+                `unexpected jpegPixelBudget value: ${options.jpegPixelBudget}`
+            );
+        }
+        addon.setJpegPixelBudget(options.jpegPixelBudget);
+    }
+    if (options.jpegThreads !== undefined) {
+        const { jpegThreads } = options;
+        if (!isUnsigned(jpegThreads) || jpegThreads === 0 || jpegThreads > 64) {
+            throw new TypeError(`unexpected jpegThreads value: ${jpegThreads}`);
+        }
+        addon.setJpegThreads(jpegThreads);
+    }
+    if (options.pipelinePixels !== undefined) {
+        if (!isUnsigned(options.pipelinePixels)) {
+            throw new TypeError(
+                `unexpected pipelinePixels value: ${options.pipelinePixels}`
+            );
+        }
+        addon.setPipelinePixels(options.pipelinePixels);
+    }
+    if (options.memoryBudget !== undefined || options.memoryBudgetWait !== undefined) {
+        const {
+            memoryBudget = memory.budget,
+            memoryBudgetWait = memory.wait,
+        } = options;
+        if (!isUnsigned(memoryBudget)) {
+            throw new TypeError(`unexpected memoryBudget value: ${memoryBudget}`);
+        }
+        if (typeof memoryBudgetWait !== "boolean") {
+            throw new TypeError(
+                `unexpected memoryBudgetWait value: ${memoryBudgetWait}`
+            );
+        }
+        addon.setMemoryBudget(memoryBudget, memoryBudgetWait);
+        memory.budget = memoryBudget;
+        memory.wait = memoryBudgetWait;
+    }
+}
+
+// Wrap fn(arg, options, callback) so that both options and callback are
+// optional. When no callback is given, a Promise is returned.
 function maybePromisify(fn) {
-    return (...args) => {
-        if (args.length < fn.length) {
+    return (arg, ...rest) => {
+        let options, callback;
+        if (rest.length >= 2) {
+            [options, callback] = rest;
+        } else if (rest[0] !== null && typeof rest[0] === "object") {
+            options = rest[0];
+        } else {
+            callback = rest[0];
+        }
+        if (callback === undefined) {
             return new Promise((resolve, reject) => {
-                fn(...args, (err, results) => {
+                fn(arg, options, (err, results) => {
                     if (err) {
                         return reject(err);
                     } else {
@@ -49,22 +274,172 @@ function maybePromisify(fn) {
                 });
             });
         } else {
-            return fn(...args);
+            return fn(arg, options, callback);
         }
     };
 }
 
+// decode either an encoded image or ImageData
+function decodeImage(img, native, callback) {
+    if (Buffer.isBuffer(img)) {
+        return decodeEncoded(img, native, callback);
+    } else if (img && typeof img === "object") {
+        return decodeRaw(img, native, callback);
+    } else {
+        throw new TypeError("img must be a Buffer or ImageData");
+    }
+}
+
+const decode = maybePromisify((img, options, callback) => {
+    return decodeImage(img, nativeOptions(options), callback);
+});
+
+const locate = maybePromisify((img, options, callback) => {
+    const native = nativeOptions(options);
+    if (native.binary || native.arena || native.text) {
+        throw new TypeError("locate() only supports the priority and jpeg options");
+    }
+    native.locate = true;
+    return decodeImage(img, native, callback);
+});
+
+// decode the image file at path, hinting the kernel to start reading the
+// prefetch ones, see decodeFiles().
+function decodeFileWith(path, options, prefetch, callback) {
+    if (typeof path !== "string") {
+        throw new TypeError("path must be a string");
+    }
+    const queued = addon.decodeFile(path, nativeOptions(options), prefetch, callback);
+    checkQueued(queued, callback);
+}
+
+const decodeFile = maybePromisify((path, options, callback) => {
+    return decodeFileWith(path, options, [], callback);
+});
+
+// the side length in cells of a version 1 to 40 QR-code grid
+function isGridSize(number) {
+    return (
+        Number.isInteger(number) &&
+        number >= 21 && number <= 177 &&
+        (number - 17) % 4 === 0
+    );
+}
+
+const decodeGrids = maybePromisify((grids, options, callback) => {
+    if (!Array.isArray(grids)) {
+        throw new TypeError("grids must be an array");
+    }
+    const sizes = [];
+    const bitmaps = [];
+    for (const grid of grids) {
+        if (!grid || typeof grid !== "object") {
+            throw new TypeError("grids must be an array of objects");
+        }
+        const { size, cell_bitmap } = grid;
+        if (!isGridSize(size)) {
+            throw new TypeError(`unexpected grid size value: ${size}`);
+        }
+        if (!(cell_bitmap instanceof Uint8Array) ||
+            cell_bitmap.length < Math.ceil(size * size / 8)) {
+            throw new TypeError(
+                `cell_bitmap must be a Uint8Array of at least ${Math.ceil(size * size / 8)} bytes`
+            );
+        }
+        sizes.push(size);
+        bitmaps.push(cell_bitmap);
+    }
+    const native = nativeOptions(options);
+    if (native.arena) {
+        throw new TypeError("decodeGrids() does not support output buffers");
+    }
+    const queued = addon.decodeGrids(sizes, bitmaps, native, callback);
+    checkQueued(queued, callback);
+});
+
+function probe(img) {
+    if (!Buffer.isBuffer(img)) {
+        throw new TypeError("img must be a Buffer");
+    }
+    return addon.probe(img);
+}
+
+// validate createDecodeStream() options.
+function streamOptions(options) {
+    if (options === undefined || options === null) {
+        options = {};
+    } else if (typeof options !== "object") {
+        throw new TypeError("options must be an object");
+    }
+    const { concurrency = 4, ordered = true, ...decodeOptions } = options;
+    if (!isUnsigned(concurrency) || concurrency === 0) {
+        throw new TypeError(`unexpected concurrency value: ${concurrency}`);
+    }
+    if (typeof ordered !== "boolean") {
+        throw new TypeError(`unexpected ordered value: ${ordered}`);
+    }
+    // concurrent decodes would all write into the same buffer.
+    if (decodeOptions.output instanceof Uint8Array) {
+        throw new TypeError("output buffers are not supported by streams");
+    }
+    nativeOptions(decodeOptions);
+    return options;
+}
+
+function createDecodeStream(options) {
+    return new DecodeStream(decode, streamOptions(options));
+}
+
+function createIncremental(options) {
+    const native = nativeOptions(options);
+    if (native.arena) {
+        throw new TypeError("createIncremental() does not support output buffers");
+    }
+    return new IncrementalDecoder(new addon.Incremental(native), queueFullError);
+}
+
+function decodeFiles(paths, options) {
+    if (!Array.isArray(paths) || !paths.every((p) => typeof p === "string")) {
+        throw new TypeError("paths must be an array of strings");
+    }
+    if (options !== undefined && options !== null && typeof options !== "object") {
+        throw new TypeError("options must be an object");
+    }
+    const { readahead = 4, ...rest } = options || {};
+    if (!isUnsigned(readahead)) {
+        throw new TypeError(`unexpected readahead value: ${readahead}`);
+    }
+    const opts = streamOptions({ ordered: false, ...rest });
+    const { concurrency = 4 } = opts;
+    // The readahead files following the ones being decoded are hinted to
+    // the kernel, so that the disk reads ahead while the threads are busy
+    // decoding: the first job hints all of them and then each job the one
+    // that just entered the window.
+    const decodeAt = (index, options, callback) => {
+        const start = index + concurrency;
+        const first = (index === 0 ? start : Math.max(start, start + readahead - 1));
+        const prefetch = paths.slice(first, start + readahead);
+        return decodeFileWith(paths[index], options, prefetch, callback);
+    };
+    const stream = new DecodeStream(decodeAt, opts);
+    return Readable.from(paths.keys()).pipe(stream);
+}
+
 // public API
 module.exports = {
-    decode: maybePromisify((img, callback) => {
-        if (Buffer.isBuffer(img)) {
-            return decodeEncoded(img, callback);
-        } else if (img && typeof img === "object") {
-            return decodeRaw(img, callback);
-        } else {
-            throw new TypeError("img must be a Buffer or ImageData");
-        }
-    }),
+    decode,
+    locate,
+    decodeFile,
+    decodeFiles,
+    decodeGrids,
+    createDecodeStream,
+    createIncremental,
+    probe,
+    configure,
+    queueDepth: () => addon.queueDepth(),
+    cacheStats: () => addon.cacheStats(),
+    loadStats: () => addon.loadStats(),
+    BinaryResults,
     constants: {
         // QR-code versions.
         VERSION_MIN:  1,
@@ -95,5 +470,14 @@ module.exports = {
         ECI_ISO_8859_15: "ISO_8859_15",
         ECI_SHIFT_JIS:   "SHIFT_JIS",
         ECI_UTF_8:       "UTF_8",
+        // decode() priority classes.
+        PRIORITY_INTERACTIVE: "interactive",
+        PRIORITY_NORMAL:      "normal",
+        PRIORITY_BULK:        "bulk",
+        // Error codes.
+        ERR_QUEUE_FULL:       "ERR_QUEUE_FULL",
+        ERR_MEMORY_BUDGET:    "ERR_MEMORY_BUDGET",
+        ERR_OUTPUT_TOO_SMALL: "ERR_OUTPUT_TOO_SMALL",
+        ERR_IMAGE_TOO_LARGE:  "ERR_IMAGE_TOO_LARGE",
     },
 };
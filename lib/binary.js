@@ -0,0 +1,161 @@
+"use strict";
+
+// Lazy reader for decode() results produced with `output: "binary"`, see
+// src/node_quirc_decode.h for the layout.
+
+const MAGIC       = Buffer.from("NQRB").readUInt32LE(0);
+const HEADER_SIZE = 8;
+const CODE_SIZE   = 64;
+const FLAG_ERR    = 0x1;
+
+// record field offsets
+const FLAGS       =  0;
+const VERSION     =  4;
+const ECC_LEVEL   =  8;
+const MASK        = 12;
+const MODE        = 16;
+const ECI         = 20;
+const CORNERS     = 24;
+const DATA_OFFSET = 56;
+const DATA_LENGTH = 60;
+
+// same as nq_code_ecc_level_str(), nq_code_mode_str() and nq_code_eci_str()
+const ecc_levels = ["M", "L", "H", "Q"];
+const modes = {
+    1: "NUMERIC",
+    2: "ALNUM",
+    4: "BYTE",
+    8: "KANJI",
+};
+const ecis = {
+    1:  "ISO_8859_1",
+    2:  "IBM437",
+    4:  "ISO_8859_2",
+    5:  "ISO_8859_3",
+    6:  "ISO_8859_4",
+    7:  "ISO_8859_5",
+    8:  "ISO_8859_6",
+    9:  "ISO_8859_7",
+    10: "ISO_8859_8",
+    11: "ISO_8859_9",
+    13: "WINDOWS_874",
+    15: "ISO_8859_13",
+    17: "ISO_8859_15",
+    20: "SHIFT_JIS",
+    26: "UTF_8",
+};
+
+// The reader may be created once over an `output` buffer given to decode(),
+// as everything (including length) is read on access.
+class BinaryResults {
+    constructor(buffer) {
+        if (buffer instanceof Uint8Array && !Buffer.isBuffer(buffer)) {
+            buffer = Buffer.from(buffer.buffer, buffer.byteOffset, buffer.length);
+        }
+        if (!Buffer.isBuffer(buffer) || buffer.length < HEADER_SIZE) {
+            throw new TypeError("buffer is not a binary decode() result");
+        }
+        this.buffer = buffer;
+    }
+
+    // number of codes
+    get length() {
+        if (this.buffer.readUInt32LE(0) !== MAGIC) {
+            throw new TypeError("buffer is not a binary decode() result");
+        }
+        return this.buffer.readUInt32LE(4);
+    }
+
+    // offset of the record of the code at index
+    record(index) {
+        if (!Number.isInteger(index) || index < 0 || index >= this.length) {
+            throw new RangeError(`unexpected code index: ${index}`);
+        }
+        return HEADER_SIZE + index * CODE_SIZE;
+    }
+
+    // the code payload (or error message) without copying it
+    payload(index) {
+        const record = this.record(index);
+        const offset = this.buffer.readUInt32LE(record + DATA_OFFSET);
+        const length = this.buffer.readUInt32LE(record + DATA_LENGTH);
+        return this.buffer.subarray(offset, offset + length);
+    }
+
+    err(index) {
+        const flags = this.buffer.readUInt32LE(this.record(index) + FLAGS);
+        if (flags & FLAG_ERR) {
+            return this.payload(index).toString("latin1");
+        }
+        return undefined;
+    }
+
+    version(index) {
+        return this.buffer.readInt32LE(this.record(index) + VERSION);
+    }
+
+    ecc_level(index) {
+        const ecc_level = this.buffer.readInt32LE(this.record(index) + ECC_LEVEL);
+        return ecc_levels[ecc_level] || "?";
+    }
+
+    mask(index) {
+        return this.buffer.readInt32LE(this.record(index) + MASK);
+    }
+
+    mode(index) {
+        const mode = this.buffer.readInt32LE(this.record(index) + MODE);
+        return modes[mode] || "unknown";
+    }
+
+    eci(index) {
+        return ecis[this.buffer.readUInt32LE(this.record(index) + ECI)];
+    }
+
+    // the four corners of the code, from the top left clockwise
+    corners(index) {
+        const record = this.record(index);
+        const corners = [];
+        for (let i = 0; i < 4; i++) {
+            corners.push({
+                x: this.buffer.readInt32LE(record + CORNERS + i * 8),
+                y: this.buffer.readInt32LE(record + CORNERS + i * 8 + 4),
+            });
+        }
+        return corners;
+    }
+
+    data(index) {
+        return (this.err(index) === undefined ? this.payload(index) : undefined);
+    }
+
+    // the code at index, shaped like the decode() objects output plus its
+    // corners, which the binary format always holds.
+    at(index) {
+        const err = this.err(index);
+        if (err !== undefined) {
+            return { err };
+        }
+        const code = {
+            version:   this.version(index),
+            ecc_level: this.ecc_level(index),
+            mask:      this.mask(index),
+            mode:      this.mode(index),
+        };
+        const eci = this.eci(index);
+        if (eci) {
+            code.eci = eci;
+        }
+        code.corners = this.corners(index);
+        code.data = this.payload(index);
+        return code;
+    }
+
+    *[Symbol.iterator]() {
+        for (let i = 0; i < this.length; i++) {
+            yield this.at(i);
+        }
+    }
+}
+
+module.exports = BinaryResults;
@@ -0,0 +1,124 @@
+"use strict";
+
+// Image decoded as its bytes are written, see createIncremental(). handle is
+// an addon Incremental, on which at most one job is in flight at any time:
+// a chunk written while it is idle is handed over as is, the ones written
+// meanwhile are concatenated and handed over together once it is done, and
+// end() waits for the last of them.
+class IncrementalDecoder {
+    constructor(handle, queueFullError) {
+        this.handle = handle;
+        this.queueFullError = queueFullError;
+        this.chunks = [];       // written but not handed to the addon yet
+        this.callbacks = [];    // of the chunks written since the last job
+        this.writing = false;   // a write job is in flight
+        this.err = null;        // set when a write job could not be queued
+        this.ended = false;
+        this.endCallback = null; // held until every chunk was handed over
+    }
+
+    write(chunk, callback) {
+        if (!(chunk instanceof Uint8Array)) {
+            throw new TypeError("chunk must be a Buffer or Uint8Array");
+        }
+        if (callback !== undefined && typeof callback !== "function") {
+            throw new TypeError("callback must be a function");
+        }
+        if (this.ended) {
+            throw new Error("write after end");
+        }
+        if (callback !== undefined) {
+            this.callbacks.push(callback);
+        }
+        if (chunk.length > 0) {
+            this.chunks.push(chunk);
+        }
+        this.flush();
+        return this;
+    }
+
+    end(callback) {
+        if (callback !== undefined && typeof callback !== "function") {
+            throw new TypeError("callback must be a function");
+        }
+        if (this.ended) {
+            throw new Error("end after end");
+        }
+        this.ended = true;
+        if (callback === undefined) {
+            return new Promise((resolve, reject) => {
+                this.endCallback = (err, results) => {
+                    return (err ? reject(err) : resolve(results));
+                };
+                this.flush();
+            });
+        }
+        this.endCallback = callback;
+        this.flush();
+    }
+
+    // hand the pending chunks, or else the end, over to the addon unless it
+    // is still busy with the previous ones.
+    flush() {
+        if (this.writing) {
+            return;
+        }
+        if (this.err) {
+            // the image is missing a chunk, don't bother decoding it.
+            this.chunks = [];
+            this.done(this.takeCallbacks());
+            return this.fail();
+        }
+        if (this.chunks.length > 0) {
+            // the addon copies the bytes it can't decode yet anyway.
+            const chunk = (this.chunks.length === 1 ? this.chunks[0] :
+                           Buffer.concat(this.chunks));
+            const callbacks = this.takeCallbacks();
+            this.chunks = [];
+            this.writing = true;
+            const queued = this.handle.write(chunk, () => {
+                this.writing = false;
+                callbacks.forEach((callback) => callback());
+                this.flush();
+            });
+            if (!queued) {
+                this.writing = false;
+                this.err = this.queueFullError();
+                this.done(callbacks);
+                this.fail();
+            }
+            return;
+        }
+        // only empty chunks were written since the last job.
+        this.done(this.takeCallbacks());
+        if (this.endCallback) {
+            const callback = this.endCallback;
+            this.endCallback = null;
+            if (!this.handle.end(callback)) {
+                process.nextTick(callback, this.queueFullError());
+            }
+        }
+    }
+
+    takeCallbacks() {
+        const callbacks = this.callbacks;
+        this.callbacks = [];
+        return callbacks;
+    }
+
+    // call back writes whose chunk won't be handed over by a job
+    done(callbacks) {
+        callbacks.forEach((callback) => process.nextTick(callback));
+    }
+
+    // report err once end() was called
+    fail() {
+        if (this.endCallback) {
+            const callback = this.endCallback;
+            this.endCallback = null;
+            process.nextTick(callback, this.err);
+        }
+    }
+}
+
+module.exports = IncrementalDecoder;
@@ -0,0 +1,96 @@
+"use strict";
+
+const { Transform } = require("stream");
+
+// Transform stream decoding images written to it, with up to `concurrency`
+// decodes in flight. Each image yields either `{ index, codes }` or, when it
+// could not be decoded, `{ index, err }`, index being its position in the
+// input. Results are pushed in input order when `ordered` is true, and in
+// completion order otherwise.
+class DecodeStream extends Transform {
+    constructor(decode, options) {
+        const {
+            concurrency = 4,
+            ordered = true,
+            highWaterMark,
+            ...decodeOptions
+        } = options;
+        super({ objectMode: true, highWaterMark });
+        this.decode = decode;
+        this.decodeOptions = decodeOptions;
+        this.concurrency = concurrency;
+        this.ordered = ordered;
+        this.inFlight = 0;
+        this.nextIndex = 0;     // index of the next image written
+        this.nextPush = 0;      // index of the next result to push when ordered
+        this.completed = new Map(); // results waiting for their turn
+        this.pendingCallback = null; // write callback held for backpressure
+        this.flushCallback = null;
+    }
+
+    _transform(img, encoding, callback) {
+        const index = this.nextIndex++;
+        this.inFlight++;
+        try {
+            this.decode(img, this.decodeOptions, (err, codes) => {
+                this.complete(index, err ? { index, err } : { index, codes });
+            });
+        } catch (e) {
+            this.inFlight--;
+            return callback(e);
+        }
+        this.pendingCallback = callback;
+        this.release();
+    }
+
+    _flush(callback) {
+        this.flushCallback = callback;
+        this.release();
+    }
+
+    _read(size) {
+        // the consumer wants more, maybe we can accept more images too. Not
+        // checking the readable buffer here since it still holds what is
+        // being read.
+        this.release(true);
+        super._read(size);
+    }
+
+    complete(index, result) {
+        this.inFlight--;
+        if (this.destroyed) {
+            return;
+        }
+        if (this.ordered) {
+            this.completed.set(index, result);
+            while (this.completed.has(this.nextPush)) {
+                this.push(this.completed.get(this.nextPush));
+                this.completed.delete(this.nextPush++);
+            }
+        } else {
+            this.push(result);
+        }
+        this.release();
+    }
+
+    // call the held write callback when there is room for another decode
+    // (results waiting for their turn count as in flight, so that a slow
+    // image cannot make them pile up) and the consumer keeps up, and the
+    // flush callback once everything was pushed.
+    release(reading = false) {
+        const busy = this.inFlight + this.completed.size;
+        const full = !reading && this.readableLength >= this.readableHighWaterMark;
+        if (this.pendingCallback && busy < this.concurrency && !full) {
+            const callback = this.pendingCallback;
+            this.pendingCallback = null;
+            callback();
+        }
+        if (this.flushCallback && busy === 0) {
+            const callback = this.flushCallback;
+            this.flushCallback = null;
+            callback();
+        }
+    }
+}
+
+module.exports = DecodeStream;
@@ -2,14 +2,18 @@
  * node-quirc.cc - glue for Node.js
  */
 
+#include <cerrno>
+#include <string>
+#include <vector>
+
 #include <nan.h>
 
 extern "C" {
+	#include "node_quirc_cache.h"
 	#include "node_quirc_decode.h"
 }
+#include "node_quirc_sched.h"
 
-using Nan::AsyncQueueWorker;
-using Nan::AsyncWorker;
 using Nan::Callback;
 using Nan::CopyBuffer;
 using Nan::Error;
@@ -20,26 +24,84 @@ using Nan::Set;
 using Nan::ThrowError;
 using Nan::ThrowTypeError;
 
+/* decode() options, see nativeOptions() in index.js */
+struct NodeQuircOptions {
+	NodeQuircPriority	priority;
+	bool			binary; /* result as a single Buffer */
+	bool			text; /* data as UTF-8 strings */
+	bool			locate; /* only locate the codes */
+	int			flags; /* NQ_DECODE_* */
+	uint8_t			*arena; /* caller-provided output, if any */
+	size_t			 arena_len;
+};
+
 /* async worker wrapper around nq_decode() */
-class NodeQuircDecoder: public AsyncWorker
+class NodeQuircDecoder: public NodeQuircJob
 {
 	public:
 
 	/* ctor */
-	NodeQuircDecoder(Callback *callback, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height):
-	    AsyncWorker(callback),
+	NodeQuircDecoder(Callback *callback, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height,
+	    const struct NodeQuircOptions &options):
+	    NodeQuircJob(callback, "node-quirc:decode"),
+	    m_file(false),
+	    m_grids(false),
+	    m_incremental(NULL),
 	    m_img(img),
 	    m_img_len(img_len),
 	    m_img_width(img_width),
 	    m_img_height(img_height),
-	    m_code_list(NULL)
+	    m_options(options),
+	    m_code_list(NULL),
+	    m_locations(NULL),
+	    m_binary(NULL),
+	    m_binary_len(0),
+	    m_count(-1),
+	    m_err(NULL),
+	    m_err_code(NULL),
+	    m_syscall(NULL),
+	    m_errno(0)
 	{ }
 
+	/*
+	 * ctor for an image file read by the worker thread, which first hints
+	 * the kernel that the prefetch files are going to be read.
+	 */
+	NodeQuircDecoder(Callback *callback, const std::string &path,
+	    const std::vector<std::string> &prefetch,
+	    const struct NodeQuircOptions &options):
+	    NodeQuircDecoder(callback, NULL, 0, 0, 0, options)
+	{
+		m_file     = true;
+		m_path     = path;
+		m_prefetch = prefetch;
+	}
+
+	/* ctor for already sampled grids, see nq_decode_grids() */
+	NodeQuircDecoder(Callback *callback, const std::vector<int> &grid_sizes,
+	    const std::vector<uint8_t> &grid_cells, const struct NodeQuircOptions &options):
+	    NodeQuircDecoder(callback, NULL, 0, 0, 0, options)
+	{
+		m_grids      = true;
+		m_grid_sizes = grid_sizes;
+		m_grid_cells = grid_cells;
+	}
+
+	/* ctor for the end of an incremental decode, see nq_incremental_end() */
+	NodeQuircDecoder(Callback *callback, struct nq_incremental *incremental,
+	    const struct NodeQuircOptions &options):
+	    NodeQuircDecoder(callback, NULL, 0, 0, 0, options)
+	{
+		m_incremental = incremental;
+	}
+
 
 	/* dtor */
 	~NodeQuircDecoder()
 	{
 		nq_code_list_free(m_code_list);
+		free(m_locations);
+		free(m_binary);
 	}
 
 
@@ -48,21 +110,53 @@ class NodeQuircDecoder: public AsyncWorker
 	// everything we need for input and output should go on `this`.
 	void Execute()
 	{
-		m_code_list = nq_decode(m_img, m_img_len, m_img_width, m_img_height);
+		struct nq_file file;
+
+		if (!m_file)
+			return Decode();
+
+		for (const std::string &path : m_prefetch)
+			nq_file_prefetch(path.c_str());
+		if (nq_file_open(m_path.c_str(), &file, &m_syscall) == -1) {
+			m_errno = errno;
+			return;
+		}
+		m_img     = file.data;
+		m_img_len = file.len;
+		Decode();
+		nq_file_close(&file);
+		m_img = NULL;
 	}
 
 
-	// Executed when the async work is complete this function will be run
-	// inside the main event loop so it is safe to use V8 again
-	void HandleOKCallback()
+	// Build the callback arguments when the async work is complete. This
+	// function will be run inside the main event loop so it is safe to use
+	// V8 again
+	int Results(v8::Local<v8::Value> argv[2])
 	{
+		if (m_syscall != NULL) {
+			argv[0] = Nan::ErrnoException(m_errno, m_syscall, NULL, m_path.c_str());
+			return 1;
+		}
+
+		if (m_options.locate)
+			return LocateResult(argv);
+
+		if (m_options.arena != NULL)
+			return ArenaResult(argv);
+
 		/* ENOMEM check */
 		if (m_code_list == NULL)
-			return ThrowError("Could not allocate memory");
+			return ErrorResult(argv, "Could not allocate memory");
 
 		/* global error check */
-		if (nq_code_list_err(m_code_list) != NULL)
-			return CallbackError(nq_code_list_err(m_code_list));
+		if (nq_code_list_err(m_code_list) != NULL) {
+			return ErrorResult(argv, nq_code_list_err(m_code_list),
+			    nq_code_list_err_code(m_code_list));
+		}
+
+		if (m_options.binary)
+			return BinaryResult(argv);
 
 		unsigned int count = nq_code_list_size(m_code_list);
 		v8::Local<v8::Array> results = New<v8::Array>();
@@ -70,39 +164,157 @@ class NodeQuircDecoder: public AsyncWorker
 			const struct nq_code *code = nq_code_at(m_code_list, i);
 			Nan::Maybe<bool> success = Set(results, i, CodeToObject(code));
 			if (success.IsNothing() || !success.FromJust())
-				return CallbackError("Set() failed");
+				return ErrorResult(argv, "Set() failed");
 		}
 
 		// all went well
-		v8::Local<v8::Value> argv[] = {
-			Null(), /* err */
-			results,
-		};
-		Nan::Call(*callback, 2, argv);
+		argv[0] = Null(); /* err */
+		argv[1] = results;
+		return 2;
 	}
 
 
 	private:
 
+	// decode m_img, on the worker thread.
+	void Decode()
+	{
+		if (m_options.locate) {
+			m_count = nq_locate(m_img, m_img_len, m_img_width, m_img_height,
+			    m_options.flags, &m_locations, &m_err, &m_err_code);
+			return;
+		}
+
+		if (m_options.arena != NULL) {
+			m_count = nq_decode_into(m_img, m_img_len, m_img_width, m_img_height,
+			    m_options.flags, m_options.arena, m_options.arena_len, &m_err, &m_err_code);
+			return;
+		}
+
+		if (m_grids) {
+			m_code_list = nq_decode_grids((unsigned int)m_grid_sizes.size(),
+			    m_grid_sizes.data(), m_grid_cells.data());
+		} else if (m_incremental != NULL) {
+			m_code_list = nq_incremental_end(m_incremental);
+		} else {
+			m_code_list = nq_decode(m_img, m_img_len, m_img_width, m_img_height,
+			    m_options.flags);
+		}
+		if (m_code_list == NULL || nq_code_list_err(m_code_list) != NULL)
+			return;
+		if (m_options.binary)
+			m_binary = nq_code_list_binary(m_code_list, &m_binary_len);
+		else if (m_options.text)
+			(void)nq_code_list_text(m_code_list);
+	}
+
+
 	/* members */
 
+	/* image file path, when m_file is set */
+	bool		 m_file;
+	std::string	 m_path;
+	std::vector<std::string>	 m_prefetch;
+	/* nq_decode_grids() arguments, when m_grids is set */
+	bool		 m_grids;
+	std::vector<int>	 m_grid_sizes;
+	std::vector<uint8_t>	 m_grid_cells;
+	/* nq_incremental_end() argument, if any */
+	struct nq_incremental	*m_incremental;
 	/* nq_decode() arguments */
 	const uint8_t	*m_img;
 	size_t		 m_img_len;
 	size_t		 m_img_width;
 	size_t		 m_img_height;
+	struct NodeQuircOptions	 m_options;
 	/* nq_decode() return value */
 	struct nq_code_list	*m_code_list;
+	/* nq_locate() return value */
+	struct nq_location	*m_locations;
+	/* nq_code_list_binary() return value */
+	uint8_t		*m_binary;
+	size_t		 m_binary_len;
+	/* nq_decode_into() and nq_locate() return values */
+	int		 m_count;
+	const char	*m_err;
+	const char	*m_err_code;
+	/* nq_file_open() failure */
+	const char	*m_syscall;
+	int		 m_errno;
 
 	/* helpers */
 
-	// call `callback` with an Error containing msg.
-	void CallbackError(const char *msg)
+	// set argv to call `callback` with an Error containing msg, and code
+	// as its `code` property when given.
+	int ErrorResult(v8::Local<v8::Value> argv[2], const char *msg, const char *code = NULL)
+	{
+		v8::Local<v8::Value> err = Error(msg);
+		if (code != NULL) {
+			Set(err.As<v8::Object>(), New("code").ToLocalChecked(),
+			    New(code).ToLocalChecked());
+		}
+		argv[0] = err;
+		return 1;
+	}
+
+
+	// set argv to call `callback` with the binary encoded code list, handing
+	// its ownership over to the resulting Buffer.
+	int BinaryResult(v8::Local<v8::Value> argv[2])
+	{
+		if (m_binary == NULL)
+			return ErrorResult(argv, "Could not allocate memory");
+
+		v8::Local<v8::Object> buffer;
+		if (!Nan::NewBuffer((char *)m_binary, m_binary_len).ToLocal(&buffer))
+			return ErrorResult(argv, "NewBuffer() failed");
+		m_binary = NULL;
+
+		argv[0] = Null(); /* err */
+		argv[1] = buffer;
+		return 2;
+	}
+
+
+	// set argv to call `callback` with the number of codes written into the
+	// caller-provided output buffer.
+	int ArenaResult(v8::Local<v8::Value> argv[2])
+	{
+		if (m_count < 0)
+			return ErrorResult(argv, m_err, m_err_code);
+
+		argv[0] = Null(); /* err */
+		argv[1] = New((int32_t)m_count);
+		return 2;
+	}
+
+
+	// set argv to call `callback` with an array of { size, corners }
+	// objects, one per located code.
+	int LocateResult(v8::Local<v8::Value> argv[2])
 	{
-		v8::Local<v8::Value> argv[] = {
-			Error(msg),
-		};
-		Nan::Call(*callback, 1, argv);
+		if (m_count < 0)
+			return ErrorResult(argv, m_err, m_err_code);
+
+		v8::Local<v8::Array> results = New<v8::Array>(m_count);
+		for (int i = 0; i < m_count; i++) {
+			const struct nq_location *loc = m_locations + i;
+			v8::Local<v8::Array> corners = New<v8::Array>(4);
+			for (uint32_t j = 0; j < 4; j++) {
+				v8::Local<v8::Object> corner = New<v8::Object>();
+				Set(corner, New("x").ToLocalChecked(), New(loc->corners[j].x));
+				Set(corner, New("y").ToLocalChecked(), New(loc->corners[j].y));
+				Set(corners, j, corner);
+			}
+			v8::Local<v8::Object> obj = New<v8::Object>();
+			Set(obj, New("size").ToLocalChecked(), New(loc->size));
+			Set(obj, New("corners").ToLocalChecked(), corners);
+			Set(results, (uint32_t)i, obj);
+		}
+
+		argv[0] = Null(); /* err */
+		argv[1] = results;
+		return 2;
 	}
 
 
@@ -127,33 +339,183 @@ class NodeQuircDecoder: public AsyncWorker
 				Set(obj, New("eci").ToLocalChecked(),
 				    New(eci).ToLocalChecked());
 			}
-			const char *data = (const char *)nq_code_payload(code);
-			Set(obj, New("data").ToLocalChecked(),
-			   CopyBuffer(data, nq_code_payload_len(code)).ToLocalChecked());
+			if (m_options.text) {
+				Set(obj, New("data").ToLocalChecked(),
+				    New(nq_code_text(code), (int)nq_code_text_len(code)).ToLocalChecked());
+			} else {
+				const char *data = (const char *)nq_code_payload(code);
+				Set(obj, New("data").ToLocalChecked(),
+				   CopyBuffer(data, nq_code_payload_len(code)).ToLocalChecked());
+			}
 		}
 		return (obj);
 	}
 };
 
 
+/* an incremental decode, see nq_incremental_new() */
+class NodeQuircIncremental: public Nan::ObjectWrap
+{
+	public:
+
+	/* ctor, wrapped by obj */
+	NodeQuircIncremental(v8::Local<v8::Object> obj, struct nq_incremental *incremental,
+	    const struct NodeQuircOptions &options):
+	    m_incremental(incremental),
+	    m_options(options),
+	    m_ended(false)
+	{
+		Wrap(obj);
+	}
+
+
+	/* dtor */
+	~NodeQuircIncremental()
+	{
+		nq_incremental_free(m_incremental);
+	}
+
+
+	/* members */
+
+	// JS only runs one job at a time per incremental decode, see
+	// lib/incremental.js.
+	struct nq_incremental	*m_incremental;
+	struct NodeQuircOptions	 m_options;
+	bool			 m_ended; /* nq_incremental_end() was queued */
+};
+
+
+/* async worker wrapper around nq_incremental_write() */
+class NodeQuircIncrementalWriter: public NodeQuircJob
+{
+	public:
+
+	/* ctor */
+	NodeQuircIncrementalWriter(Callback *callback, struct nq_incremental *incremental,
+	    const uint8_t *chunk, size_t chunk_len):
+	    NodeQuircJob(callback, "node-quirc:write"),
+	    m_incremental(incremental),
+	    m_chunk(chunk),
+	    m_chunk_len(chunk_len)
+	{ }
+
+
+	void Execute()
+	{
+		/* errors are reported once the decode ends */
+		(void)nq_incremental_write(m_incremental, m_chunk, m_chunk_len);
+	}
+
+
+	int Results(v8::Local<v8::Value> argv[2])
+	{
+		argv[0] = Null(); /* err */
+		return 1;
+	}
+
+
+	private:
+
+	/* nq_incremental_write() arguments */
+	struct nq_incremental	*m_incremental;
+	const uint8_t		*m_chunk;
+	size_t			 m_chunk_len;
+};
+
+
+// read the unsigned integer property `name` of `options`, or return
+// `fallback` when it is not set.
+static uint32_t
+OptionUint32(v8::Local<v8::Object> options, const char *name, uint32_t fallback)
+{
+	v8::Local<v8::Value> value;
+	if (!Nan::Get(options, New(name).ToLocalChecked()).ToLocal(&value))
+		return fallback;
+	if (!value->IsNumber())
+		return fallback;
+	return Nan::To<uint32_t>(value).FromJust();
+}
+
+// read the boolean property `name` of `options`
+static bool
+OptionBool(v8::Local<v8::Object> options, const char *name)
+{
+	v8::Local<v8::Value> value;
+	if (!Nan::Get(options, New(name).ToLocalChecked()).ToLocal(&value))
+		return false;
+	return value->IsTrue();
+}
+
+// read the decode() options. When a caller-provided output buffer is given,
+// it is set to arena so that it can be kept alive until the job is done.
+static struct NodeQuircOptions
+ParseOptions(v8::Local<v8::Object> options, v8::Local<v8::Value> *arena)
+{
+	struct NodeQuircOptions opts;
+
+	uint32_t priority = OptionUint32(options, "priority", NODE_QUIRC_PRIORITY_NORMAL);
+	if (priority >= NODE_QUIRC_PRIORITY_COUNT)
+		priority = NODE_QUIRC_PRIORITY_NORMAL;
+	opts.priority = (NodeQuircPriority)priority;
+	opts.binary   = OptionBool(options, "binary");
+	opts.text     = OptionBool(options, "text");
+	opts.locate   = OptionBool(options, "locate");
+	opts.flags    = (OptionBool(options, "fast") ? NQ_DECODE_JPEG_FAST : 0);
+	if (OptionBool(options, "bilevel"))
+		opts.flags |= NQ_DECODE_BILEVEL;
+
+	opts.arena     = NULL;
+	opts.arena_len = 0;
+	if (Nan::Get(options, New("arena").ToLocalChecked()).ToLocal(arena) &&
+	    node::Buffer::HasInstance(*arena)) {
+		opts.arena     = (uint8_t *)node::Buffer::Data(*arena);
+		opts.arena_len = node::Buffer::Length(*arena);
+	}
+
+	return (opts);
+}
+
+// queue job, returning (to JS too) whether it was accepted. When the queue is
+// full the job is dropped and false is returned.
+static bool
+QueueJob(const Nan::FunctionCallbackInfo<v8::Value> &info, NodeQuircJob *job,
+    NodeQuircPriority priority)
+{
+	bool queued = NodeQuircQueueJob(job, priority);
+	if (!queued)
+		delete job;
+	info.GetReturnValue().Set(queued);
+	return (queued);
+}
+
 // async access to nq_decode()
 NAN_METHOD(NodeQuircDecodeEncodedAsync) {
-	if (info.Length() < 2)
-		return ThrowError("expected (img, callback) as arguments");
+	if (info.Length() < 3)
+		return ThrowError("expected (img, options, callback) as arguments");
 	if (!node::Buffer::HasInstance(info[0]))
 		return ThrowTypeError("img must be a Buffer");
-	if (!info[1]->IsFunction())
+	if (!info[1]->IsObject())
+		return ThrowTypeError("options must be an object");
+	if (!info[2]->IsFunction())
 		return ThrowTypeError("callback must be a function");
 
 	uint8_t *img   = (uint8_t *)node::Buffer::Data(info[0]);
 	size_t img_len = node::Buffer::Length(info[0]);
-	Callback *callback = new Callback(info[1].As<v8::Function>());
-	AsyncQueueWorker(new NodeQuircDecoder(callback, img, img_len, 0, 0));
+	v8::Local<v8::Value> arena;
+	struct NodeQuircOptions options = ParseOptions(info[1].As<v8::Object>(), &arena);
+	Callback *callback = new Callback(info[2].As<v8::Function>());
+	NodeQuircDecoder *decoder = new NodeQuircDecoder(callback, img, img_len, 0, 0, options);
+	// keep img and the output buffer alive until the job is done
+	decoder->SaveToPersistent("img", info[0]);
+	if (options.arena != NULL)
+		decoder->SaveToPersistent("arena", arena);
+	QueueJob(info, decoder, options.priority);
 }
 
 NAN_METHOD(NodeQuircDecodeRawAsync) {
-	if (info.Length() < 4)
-		return ThrowError("expected (pixels, width, height, callback) as arguments");
+	if (info.Length() < 5)
+		return ThrowError("expected (pixels, width, height, options, callback) as arguments");
 	// Uint8ClampedArray is from ImageData#data, Buffer is allowed for convenience.
 	if (!info[0]->IsUint8ClampedArray() && !node::Buffer::HasInstance(info[0]))
 		return ThrowTypeError("pixels must be a Uint8ClampedArray or Buffer");
@@ -161,7 +523,9 @@ NAN_METHOD(NodeQuircDecodeRawAsync) {
 		return ThrowTypeError("width must be a number");
 	if (!info[2]->IsNumber())
 		return ThrowTypeError("height must be a number");
-	if (!info[3]->IsFunction())
+	if (!info[3]->IsObject())
+		return ThrowTypeError("options must be an object");
+	if (!info[4]->IsFunction())
 		return ThrowTypeError("callback must be a function");
 
 	uint8_t *img;
@@ -178,8 +542,319 @@ NAN_METHOD(NodeQuircDecodeRawAsync) {
 
 	size_t img_width = (size_t)Nan::To<int>(info[1]).FromJust();
 	size_t img_height = (size_t)Nan::To<int>(info[2]).FromJust();
+	v8::Local<v8::Value> arena;
+	struct NodeQuircOptions options = ParseOptions(info[3].As<v8::Object>(), &arena);
+	Callback *callback = new Callback(info[4].As<v8::Function>());
+	NodeQuircDecoder *decoder = new NodeQuircDecoder(callback, img, img_len, img_width, img_height,
+	    options);
+	// keep pixels and the output buffer alive until the job is done
+	decoder->SaveToPersistent("pixels", info[0]);
+	if (options.arena != NULL)
+		decoder->SaveToPersistent("arena", arena);
+	QueueJob(info, decoder, options.priority);
+}
+
+// async decoding of an image file, read by the worker thread
+NAN_METHOD(NodeQuircDecodeFileAsync) {
+	if (info.Length() < 4)
+		return ThrowError("expected (path, options, prefetch, callback) as arguments");
+	if (!info[0]->IsString())
+		return ThrowTypeError("path must be a string");
+	if (!info[1]->IsObject())
+		return ThrowTypeError("options must be an object");
+	if (!info[2]->IsArray())
+		return ThrowTypeError("prefetch must be an array");
+	if (!info[3]->IsFunction())
+		return ThrowTypeError("callback must be a function");
+
+	Nan::Utf8String path(info[0]);
+	v8::Local<v8::Array> paths = info[2].As<v8::Array>();
+	std::vector<std::string> prefetch;
+	for (uint32_t i = 0; i < paths->Length(); i++) {
+		v8::Local<v8::Value> value;
+		if (Nan::Get(paths, i).ToLocal(&value) && value->IsString()) {
+			Nan::Utf8String prefetch_path(value);
+			prefetch.push_back(std::string(*prefetch_path, prefetch_path.length()));
+		}
+	}
+	v8::Local<v8::Value> arena;
+	struct NodeQuircOptions options = ParseOptions(info[1].As<v8::Object>(), &arena);
+	Callback *callback = new Callback(info[3].As<v8::Function>());
+	NodeQuircDecoder *decoder = new NodeQuircDecoder(callback,
+	    std::string(*path, path.length()), prefetch, options);
+	// keep the output buffer alive until the job is done
+	if (options.arena != NULL)
+		decoder->SaveToPersistent("arena", arena);
+	QueueJob(info, decoder, options.priority);
+}
+
+// async access to nq_decode_grids()
+NAN_METHOD(NodeQuircDecodeGridsAsync) {
+	if (info.Length() < 4)
+		return ThrowError("expected (sizes, bitmaps, options, callback) as arguments");
+	if (!info[0]->IsArray())
+		return ThrowTypeError("sizes must be an array");
+	if (!info[1]->IsArray())
+		return ThrowTypeError("bitmaps must be an array");
+	if (!info[2]->IsObject())
+		return ThrowTypeError("options must be an object");
+	if (!info[3]->IsFunction())
+		return ThrowTypeError("callback must be a function");
+
+	v8::Local<v8::Array> sizes = info[0].As<v8::Array>();
+	v8::Local<v8::Array> bitmaps = info[1].As<v8::Array>();
+	if (sizes->Length() != bitmaps->Length())
+		return ThrowTypeError("sizes and bitmaps must have the same length");
+
+	// copy the bitmaps so that they don't have to be kept alive
+	std::vector<int> grid_sizes;
+	std::vector<uint8_t> grid_cells;
+	for (uint32_t i = 0; i < sizes->Length(); i++) {
+		v8::Local<v8::Value> size, bitmap;
+		if (!Nan::Get(sizes, i).ToLocal(&size) || !size->IsNumber())
+			return ThrowTypeError("size must be a number");
+		if (!Nan::Get(bitmaps, i).ToLocal(&bitmap) || !bitmap->IsUint8Array())
+			return ThrowTypeError("bitmap must be a Uint8Array");
+		int grid_size = Nan::To<int>(size).FromJust();
+		grid_sizes.push_back(grid_size);
+		if (grid_size < NQ_GRID_MIN_SIZE || grid_size > NQ_GRID_MAX_SIZE)
+			continue; /* yields an error, see nq_decode_grids() */
+		Nan::TypedArrayContents<uint8_t> cells(bitmap);
+		size_t len = NQ_GRID_BITMAP_LEN(grid_size);
+		if (cells.length() < len)
+			return ThrowTypeError("bitmap is too small for its grid size");
+		grid_cells.insert(grid_cells.end(), *cells, *cells + len);
+	}
+
+	v8::Local<v8::Value> arena;
+	struct NodeQuircOptions options = ParseOptions(info[2].As<v8::Object>(), &arena);
+	if (options.arena != NULL)
+		return ThrowTypeError("output buffers are not supported");
 	Callback *callback = new Callback(info[3].As<v8::Function>());
-	AsyncQueueWorker(new NodeQuircDecoder(callback, img, img_len, img_width, img_height));
+	NodeQuircDecoder *decoder = new NodeQuircDecoder(callback, grid_sizes, grid_cells, options);
+	QueueJob(info, decoder, options.priority);
+}
+
+// create an incremental decode, see nq_incremental_new()
+NAN_METHOD(NodeQuircIncrementalNew) {
+	if (!info.IsConstructCall())
+		return ThrowError("Incremental must be called with new");
+	if (info.Length() < 1)
+		return ThrowError("expected (options) as arguments");
+	if (!info[0]->IsObject())
+		return ThrowTypeError("options must be an object");
+
+	v8::Local<v8::Value> arena;
+	struct NodeQuircOptions options = ParseOptions(info[0].As<v8::Object>(), &arena);
+	if (options.arena != NULL || options.locate)
+		return ThrowTypeError("output buffers and locate are not supported");
+	struct nq_incremental *incremental = nq_incremental_new(options.flags);
+	if (incremental == NULL)
+		return ThrowError("Could not allocate memory");
+	(void)new NodeQuircIncremental(info.This(), incremental, options);
+	info.GetReturnValue().Set(info.This());
+}
+
+// async access to nq_incremental_write()
+NAN_METHOD(NodeQuircIncrementalWrite) {
+	if (info.Length() < 2)
+		return ThrowError("expected (chunk, callback) as arguments");
+	if (!node::Buffer::HasInstance(info[0]))
+		return ThrowTypeError("chunk must be a Buffer");
+	if (!info[1]->IsFunction())
+		return ThrowTypeError("callback must be a function");
+
+	NodeQuircIncremental *wrapper = Nan::ObjectWrap::Unwrap<NodeQuircIncremental>(info.This());
+	if (wrapper->m_ended)
+		return ThrowError("write after end");
+	const uint8_t *chunk = (const uint8_t *)node::Buffer::Data(info[0]);
+	size_t chunk_len = node::Buffer::Length(info[0]);
+	Callback *callback = new Callback(info[1].As<v8::Function>());
+	NodeQuircIncrementalWriter *writer = new NodeQuircIncrementalWriter(callback,
+	    wrapper->m_incremental, chunk, chunk_len);
+	// keep the decode and chunk alive until the job is done
+	writer->SaveToPersistent("incremental", info.This());
+	writer->SaveToPersistent("chunk", info[0]);
+	QueueJob(info, writer, wrapper->m_options.priority);
+}
+
+// async access to nq_incremental_end()
+NAN_METHOD(NodeQuircIncrementalEnd) {
+	if (info.Length() < 1)
+		return ThrowError("expected (callback) as arguments");
+	if (!info[0]->IsFunction())
+		return ThrowTypeError("callback must be a function");
+
+	NodeQuircIncremental *wrapper = Nan::ObjectWrap::Unwrap<NodeQuircIncremental>(info.This());
+	if (wrapper->m_ended)
+		return ThrowError("end after end");
+	Callback *callback = new Callback(info[0].As<v8::Function>());
+	NodeQuircDecoder *decoder = new NodeQuircDecoder(callback, wrapper->m_incremental,
+	    wrapper->m_options);
+	// keep the decode alive until the job is done
+	decoder->SaveToPersistent("incremental", info.This());
+	wrapper->m_ended = QueueJob(info, decoder, wrapper->m_options.priority);
+}
+
+// synchronous access to nq_probe(), returning null when img is not an image
+NAN_METHOD(NodeQuircProbe) {
+	if (info.Length() < 1)
+		return ThrowError("expected (img) as arguments");
+	if (!node::Buffer::HasInstance(info[0]))
+		return ThrowTypeError("img must be a Buffer");
+
+	struct nq_image_info image;
+	const uint8_t *img = (const uint8_t *)node::Buffer::Data(info[0]);
+	if (nq_probe(img, node::Buffer::Length(info[0]), &image) == -1)
+		return info.GetReturnValue().SetNull();
+
+	v8::Local<v8::Object> obj = New<v8::Object>();
+	Set(obj, New("format").ToLocalChecked(), New(image.format).ToLocalChecked());
+	Set(obj, New("width").ToLocalChecked(), New(image.width));
+	Set(obj, New("height").ToLocalChecked(), New(image.height));
+	Set(obj, New("channels").ToLocalChecked(), New((int32_t)image.channels));
+	info.GetReturnValue().Set(obj);
+}
+
+// enable or disable completion batching
+NAN_METHOD(NodeQuircSetBatch) {
+	if (info.Length() < 1)
+		return ThrowError("expected (dispatch, maxDelay, maxSize) or (false) as arguments");
+	if (info[0]->IsFalse())
+		return NodeQuircBatchDisable();
+	if (info.Length() < 3)
+		return ThrowError("expected (dispatch, maxDelay, maxSize) or (false) as arguments");
+	if (!info[0]->IsFunction())
+		return ThrowTypeError("dispatch must be a function");
+	if (!info[1]->IsNumber())
+		return ThrowTypeError("maxDelay must be a number");
+	if (!info[2]->IsNumber())
+		return ThrowTypeError("maxSize must be a number");
+
+	uint64_t max_delay = (uint64_t)Nan::To<uint32_t>(info[1]).FromJust();
+	size_t max_size = (size_t)Nan::To<uint32_t>(info[2]).FromJust();
+	NodeQuircBatchEnable(info[0].As<v8::Function>(), max_delay, max_size);
+}
+
+// set the priority aging delay, in milliseconds
+NAN_METHOD(NodeQuircSetPriorityAging) {
+	if (info.Length() < 1)
+		return ThrowError("expected (aging) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("aging must be a number");
+
+	NodeQuircSetAging((uint64_t)Nan::To<uint32_t>(info[0]).FromJust());
+}
+
+// set the maximum queue depth, 0 meaning no limit
+NAN_METHOD(NodeQuircSetMaxQueueDepth) {
+	if (info.Length() < 1)
+		return ThrowError("expected (maxQueueDepth) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("maxQueueDepth must be a number");
+
+	NodeQuircSetQueueLimit((size_t)Nan::To<uint32_t>(info[0]).FromJust());
+}
+
+// set the process-wide memory budget, see nq_set_memory_budget()
+NAN_METHOD(NodeQuircSetMemoryBudget) {
+	if (info.Length() < 2)
+		return ThrowError("expected (limit, wait) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("limit must be a number");
+
+	int64_t limit = Nan::To<int64_t>(info[0]).FromJust();
+	bool wait = Nan::To<bool>(info[1]).FromJust();
+	nq_set_memory_budget((size_t)(limit > 0 ? limit : 0), wait ? 1 : 0);
+}
+
+// set the maximum image pixel count, see nq_set_max_pixels()
+NAN_METHOD(NodeQuircSetMaxPixels) {
+	if (info.Length() < 1)
+		return ThrowError("expected (maxPixels) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("maxPixels must be a number");
+
+	int64_t max_pixels = Nan::To<int64_t>(info[0]).FromJust();
+	nq_set_max_pixels((size_t)(max_pixels > 0 ? max_pixels : 0));
+}
+
+// set the JPEG downscaling pixel budget, see nq_set_jpeg_pixel_budget()
+NAN_METHOD(NodeQuircSetJpegPixelBudget) {
+	if (info.Length() < 1)
+		return ThrowError("expected (pixels) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("pixels must be a number");
+
+	int64_t pixels = Nan::To<int64_t>(info[0]).FromJust();
+	nq_set_jpeg_pixel_budget((size_t)(pixels > 0 ? pixels : 0));
+}
+
+// set the JPEG decoding thread count, see nq_set_jpeg_threads()
+NAN_METHOD(NodeQuircSetJpegThreads) {
+	if (info.Length() < 1)
+		return ThrowError("expected (threads) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("threads must be a number");
+
+	nq_set_jpeg_threads(Nan::To<uint32_t>(info[0]).FromJust());
+}
+
+// set the pipelined loading threshold, see nq_set_pipeline_pixels()
+NAN_METHOD(NodeQuircSetPipelinePixels) {
+	if (info.Length() < 1)
+		return ThrowError("expected (pixels) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("pixels must be a number");
+
+	int64_t pixels = Nan::To<int64_t>(info[0]).FromJust();
+	nq_set_pipeline_pixels((size_t)(pixels > 0 ? pixels : 0));
+}
+
+// set the result cache limits, see nq_cache_configure()
+NAN_METHOD(NodeQuircSetCache) {
+	if (info.Length() < 2)
+		return ThrowError("expected (maxEntries, maxBytes) as arguments");
+	if (!info[0]->IsNumber())
+		return ThrowTypeError("maxEntries must be a number");
+	if (!info[1]->IsNumber())
+		return ThrowTypeError("maxBytes must be a number");
+
+	int64_t max_entries = Nan::To<int64_t>(info[0]).FromJust();
+	int64_t max_bytes = Nan::To<int64_t>(info[1]).FromJust();
+	nq_cache_configure((size_t)(max_entries > 0 ? max_entries : 0),
+	    (size_t)(max_bytes > 0 ? max_bytes : 0));
+}
+
+// result cache counters
+NAN_METHOD(NodeQuircGetCacheStats) {
+	struct nq_cache_stats stats;
+	nq_cache_stats(&stats);
+
+	v8::Local<v8::Object> obj = New<v8::Object>();
+	Set(obj, New("hits").ToLocalChecked(), New((double)stats.hits));
+	Set(obj, New("misses").ToLocalChecked(), New((double)stats.misses));
+	Set(obj, New("entries").ToLocalChecked(), New((double)stats.entries));
+	Set(obj, New("bytes").ToLocalChecked(), New((double)stats.bytes));
+	info.GetReturnValue().Set(obj);
+}
+
+// loading path counters
+NAN_METHOD(NodeQuircGetLoadStats) {
+	struct nq_load_stats stats;
+	nq_load_stats(&stats);
+
+	v8::Local<v8::Object> obj = New<v8::Object>();
+	Set(obj, New("jpegFast").ToLocalChecked(), New((double)stats.jpeg_fast));
+	Set(obj, New("jpegBands").ToLocalChecked(), New((double)stats.jpeg_bands));
+	Set(obj, New("pipelined").ToLocalChecked(), New((double)stats.pipelined));
+	info.GetReturnValue().Set(obj);
+}
+
+// number of decode jobs queued, running or waiting for their completion to be
+// delivered
+NAN_METHOD(NodeQuircGetQueueDepth) {
+	info.GetReturnValue().Set((double)NodeQuircQueueDepth());
 }
 
 // export stuff to NodeJS
@@ -188,6 +863,43 @@ NAN_MODULE_INIT(NodeQuircInit) {
 	    GetFunction(New<v8::FunctionTemplate>(NodeQuircDecodeEncodedAsync)).ToLocalChecked());
 	Set(target, New("decodeRaw").ToLocalChecked(),
 	    GetFunction(New<v8::FunctionTemplate>(NodeQuircDecodeRawAsync)).ToLocalChecked());
+	Set(target, New("decodeFile").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircDecodeFileAsync)).ToLocalChecked());
+	Set(target, New("decodeGrids").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircDecodeGridsAsync)).ToLocalChecked());
+	v8::Local<v8::FunctionTemplate> incremental = New<v8::FunctionTemplate>(NodeQuircIncrementalNew);
+	incremental->SetClassName(New("Incremental").ToLocalChecked());
+	incremental->InstanceTemplate()->SetInternalFieldCount(1);
+	Nan::SetPrototypeMethod(incremental, "write", NodeQuircIncrementalWrite);
+	Nan::SetPrototypeMethod(incremental, "end", NodeQuircIncrementalEnd);
+	Set(target, New("Incremental").ToLocalChecked(),
+	    GetFunction(incremental).ToLocalChecked());
+	Set(target, New("probe").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircProbe)).ToLocalChecked());
+	Set(target, New("setBatch").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetBatch)).ToLocalChecked());
+	Set(target, New("setPriorityAging").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetPriorityAging)).ToLocalChecked());
+	Set(target, New("setMaxQueueDepth").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetMaxQueueDepth)).ToLocalChecked());
+	Set(target, New("setMemoryBudget").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetMemoryBudget)).ToLocalChecked());
+	Set(target, New("setMaxPixels").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetMaxPixels)).ToLocalChecked());
+	Set(target, New("setJpegPixelBudget").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetJpegPixelBudget)).ToLocalChecked());
+	Set(target, New("setJpegThreads").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetJpegThreads)).ToLocalChecked());
+	Set(target, New("setPipelinePixels").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetPipelinePixels)).ToLocalChecked());
+	Set(target, New("setCache").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircSetCache)).ToLocalChecked());
+	Set(target, New("cacheStats").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircGetCacheStats)).ToLocalChecked());
+	Set(target, New("loadStats").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircGetLoadStats)).ToLocalChecked());
+	Set(target, New("queueDepth").ToLocalChecked(),
+	    GetFunction(New<v8::FunctionTemplate>(NodeQuircGetQueueDepth)).ToLocalChecked());
 }
 
 
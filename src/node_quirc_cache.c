@@ -0,0 +1,344 @@
+/*
+ * node_quirc_cache.c - node-quirc decode result cache
+ *
+ * A LRU cache shared by every worker thread, made of a chained hash table
+ * and a doubly-linked list from the most to the least recently used entry.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "node_quirc_cache.h"
+
+
+struct nq_cache_entry {
+	struct nq_cache_key	 key;
+	void			*value;
+	size_t			 size;
+	void			(*free_value)(void *value);
+	struct nq_cache_entry	*chain; /* next in the same bucket */
+	struct nq_cache_entry	*prev, *next; /* LRU list */
+};
+
+static struct {
+	pthread_mutex_t		 mutex;
+	size_t			 max_entries; /* 0 when disabled */
+	size_t			 max_bytes; /* 0 for no limit */
+	struct nq_cache_entry	**buckets;
+	size_t			 nbuckets; /* a power of two */
+	struct nq_cache_entry	*head, *tail; /* most / least recently used */
+	size_t			 entries;
+	size_t			 bytes;
+	uint64_t		 hits;
+	uint64_t		 misses;
+} nq_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* per-process hash seed, see nq_cache_seed_init() */
+static uint64_t		nq_cache_seed[2];
+static pthread_once_t	nq_cache_seed_once = PTHREAD_ONCE_INIT;
+
+static void	nq_cache_seed_init(void);
+static uint64_t	nq_cache_rotl(uint64_t x, int r);
+static uint64_t	nq_cache_fmix(uint64_t k);
+static int	nq_cache_key_eq(const struct nq_cache_key *a, const struct nq_cache_key *b);
+static struct nq_cache_entry	**nq_cache_bucket(const struct nq_cache_key *key);
+static void	nq_cache_unlink(struct nq_cache_entry *entry);
+static void	nq_cache_push_front(struct nq_cache_entry *entry);
+static void	nq_cache_free_entries(struct nq_cache_entry *list);
+
+
+void
+nq_cache_configure(size_t max_entries, size_t max_bytes)
+{
+	struct nq_cache_entry **buckets = NULL, *dropped;
+	size_t nbuckets = 0;
+
+	if (max_entries > 0) {
+		/* at most one entry per bucket on average */
+		nbuckets = 16;
+		while (nbuckets < max_entries && nbuckets < ((size_t)1 << 24))
+			nbuckets <<= 1;
+		buckets = calloc(nbuckets, sizeof(struct nq_cache_entry *));
+		if (buckets == NULL)
+			max_entries = 0; /* can't cache */
+	}
+
+	pthread_mutex_lock(&nq_cache.mutex);
+	dropped = nq_cache.head;
+	free(nq_cache.buckets);
+	nq_cache.buckets     = buckets;
+	nq_cache.nbuckets    = nbuckets;
+	nq_cache.max_entries = max_entries;
+	nq_cache.max_bytes   = max_bytes;
+	nq_cache.head        = nq_cache.tail = NULL;
+	nq_cache.entries     = 0;
+	nq_cache.bytes       = 0;
+	pthread_mutex_unlock(&nq_cache.mutex);
+
+	nq_cache_free_entries(dropped);
+}
+
+
+void
+nq_cache_clear(void)
+{
+	struct nq_cache_entry *dropped;
+
+	pthread_mutex_lock(&nq_cache.mutex);
+	dropped = nq_cache.head;
+	if (nq_cache.buckets != NULL)
+		memset(nq_cache.buckets, 0, nq_cache.nbuckets * sizeof(struct nq_cache_entry *));
+	nq_cache.head    = nq_cache.tail = NULL;
+	nq_cache.entries = 0;
+	nq_cache.bytes   = 0;
+	pthread_mutex_unlock(&nq_cache.mutex);
+
+	nq_cache_free_entries(dropped);
+}
+
+
+int
+nq_cache_enabled(void)
+{
+	pthread_mutex_lock(&nq_cache.mutex);
+	int enabled = (nq_cache.max_entries > 0);
+	pthread_mutex_unlock(&nq_cache.mutex);
+	return (enabled);
+}
+
+
+void
+nq_cache_stats(struct nq_cache_stats *stats)
+{
+	pthread_mutex_lock(&nq_cache.mutex);
+	stats->hits    = nq_cache.hits;
+	stats->misses  = nq_cache.misses;
+	stats->entries = nq_cache.entries;
+	stats->bytes   = nq_cache.bytes;
+	pthread_mutex_unlock(&nq_cache.mutex);
+}
+
+
+#define	NQ_CACHE_PRIME1	0x9e3779b185ebca87ULL
+#define	NQ_CACHE_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+/*
+ * A 128-bit hash made of two 64-bit lanes each consuming one 8-byte word
+ * per 16-byte block, in the spirit of xxHash.
+ */
+void
+nq_cache_key_init(struct nq_cache_key *key, const uint8_t *data, size_t len, uint64_t salt)
+{
+	uint64_t h0, h1, w[2];
+	size_t i = 0;
+
+	(void)pthread_once(&nq_cache_seed_once, nq_cache_seed_init);
+	h0 = nq_cache_seed[0] ^ (uint64_t)len;
+	h1 = nq_cache_seed[1] ^ salt;
+
+	for (;;) {
+		if (len - i >= sizeof(w)) {
+			memcpy(w, data + i, sizeof(w));
+		} else {
+			/* zero-padded last block, len being hashed in */
+			memset(w, 0, sizeof(w));
+			if (len > i)
+				memcpy(w, data + i, len - i);
+		}
+		h0 = nq_cache_rotl(h0 ^ (w[0] * NQ_CACHE_PRIME2), 31) * NQ_CACHE_PRIME1;
+		h1 = nq_cache_rotl(h1 ^ (w[1] * NQ_CACHE_PRIME2), 29) * NQ_CACHE_PRIME1;
+		i += sizeof(w);
+		if (i >= len)
+			break;
+	}
+
+	key->hash[0] = nq_cache_fmix(h0 + h1);
+	key->hash[1] = nq_cache_fmix(h1 ^ nq_cache_rotl(h0, 17));
+	key->len     = len;
+	key->salt    = salt;
+}
+
+
+void *
+nq_cache_get(const struct nq_cache_key *key, void *(*copy)(const void *value))
+{
+	void *value = NULL;
+
+	pthread_mutex_lock(&nq_cache.mutex);
+	if (nq_cache.max_entries > 0) {
+		struct nq_cache_entry *entry = *nq_cache_bucket(key);
+		while (entry != NULL && !nq_cache_key_eq(&entry->key, key))
+			entry = entry->chain;
+		if (entry != NULL) {
+			nq_cache_unlink(entry);
+			nq_cache_push_front(entry);
+			value = copy(entry->value);
+		}
+		if (value != NULL)
+			nq_cache.hits++;
+		else
+			nq_cache.misses++;
+	}
+	pthread_mutex_unlock(&nq_cache.mutex);
+
+	return (value);
+}
+
+
+void
+nq_cache_put(const struct nq_cache_key *key, void *value, size_t size,
+    void (*free_value)(void *value))
+{
+	struct nq_cache_entry *entry, *evicted = NULL;
+
+	size += sizeof(struct nq_cache_entry);
+	entry = malloc(sizeof(struct nq_cache_entry));
+	if (entry == NULL) {
+		free_value(value);
+		return;
+	}
+	entry->key        = *key;
+	entry->value      = value;
+	entry->size       = size;
+	entry->free_value = free_value;
+	entry->next       = NULL;
+
+	pthread_mutex_lock(&nq_cache.mutex);
+	if (nq_cache.max_entries == 0 ||
+	    (nq_cache.max_bytes > 0 && size > nq_cache.max_bytes)) {
+		/* disabled or too big to ever fit */
+		evicted = entry;
+		goto out;
+	}
+
+	struct nq_cache_entry **bucket = nq_cache_bucket(key);
+	for (struct nq_cache_entry *e = *bucket; e != NULL; e = e->chain) {
+		if (nq_cache_key_eq(&e->key, key)) {
+			/* another thread decoded the same input meanwhile */
+			evicted = entry;
+			goto out;
+		}
+	}
+	entry->chain = *bucket;
+	*bucket = entry;
+	nq_cache_push_front(entry);
+	nq_cache.entries++;
+	nq_cache.bytes += size;
+
+	while (nq_cache.entries > nq_cache.max_entries ||
+	    (nq_cache.max_bytes > 0 && nq_cache.bytes > nq_cache.max_bytes)) {
+		struct nq_cache_entry *lru = nq_cache.tail;
+		struct nq_cache_entry **e = nq_cache_bucket(&lru->key);
+		while (*e != lru)
+			e = &(*e)->chain;
+		*e = lru->chain;
+		nq_cache_unlink(lru);
+		nq_cache.entries--;
+		nq_cache.bytes -= lru->size;
+		lru->next = evicted;
+		evicted = lru;
+	}
+
+	/* FALLTHROUGH */
+out:
+	pthread_mutex_unlock(&nq_cache.mutex);
+	nq_cache_free_entries(evicted);
+}
+
+
+/* seed the hash from the system entropy, or whatever we can find */
+static void
+nq_cache_seed_init(void)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		ssize_t n = read(fd, nq_cache_seed, sizeof(nq_cache_seed));
+		(void)close(fd);
+		if (n == (ssize_t)sizeof(nq_cache_seed))
+			return;
+	}
+
+	nq_cache_seed[0] = nq_cache_fmix((uint64_t)time(NULL) ^ (uint64_t)getpid());
+	nq_cache_seed[1] = nq_cache_fmix((uint64_t)(uintptr_t)&nq_cache_seed ^ (uint64_t)clock());
+}
+
+
+static uint64_t
+nq_cache_rotl(uint64_t x, int r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+
+/* MurmurHash3 64-bit finalizer */
+static uint64_t
+nq_cache_fmix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return (k);
+}
+
+
+static int
+nq_cache_key_eq(const struct nq_cache_key *a, const struct nq_cache_key *b)
+{
+	return (a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1] &&
+	    a->len == b->len && a->salt == b->salt);
+}
+
+
+static struct nq_cache_entry **
+nq_cache_bucket(const struct nq_cache_key *key)
+{
+	return (&nq_cache.buckets[key->hash[0] & (nq_cache.nbuckets - 1)]);
+}
+
+
+static void
+nq_cache_unlink(struct nq_cache_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		nq_cache.head = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		nq_cache.tail = entry->prev;
+}
+
+
+static void
+nq_cache_push_front(struct nq_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = nq_cache.head;
+	if (nq_cache.head != NULL)
+		nq_cache.head->prev = entry;
+	nq_cache.head = entry;
+	if (nq_cache.tail == NULL)
+		nq_cache.tail = entry;
+}
+
+
+/* free a list of entries linked through their next pointer */
+static void
+nq_cache_free_entries(struct nq_cache_entry *list)
+{
+	while (list != NULL) {
+		struct nq_cache_entry *next = list->next;
+		list->free_value(list->value);
+		free(list);
+		list = next;
+	}
+}
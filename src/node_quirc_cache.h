@@ -0,0 +1,57 @@
+#ifndef NODE_QUIRC_CACHE_H
+#define NODE_QUIRC_CACHE_H
+/*
+ * node_quirc_cache.h - node-quirc decode result cache
+ */
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint8_t */
+
+/* identify an input, see nq_cache_key_init() */
+struct nq_cache_key {
+	uint64_t	hash[2];
+	size_t		len;
+	uint64_t	salt;
+};
+
+struct nq_cache_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	size_t		entries;
+	size_t		bytes;
+};
+
+/*
+ * Set the cache limits, 0 entries disabling it. Changing the limits drops
+ * every cached value.
+ */
+void	nq_cache_configure(size_t max_entries, size_t max_bytes);
+/* drop every cached value, keeping the limits */
+void	nq_cache_clear(void);
+/* returns non-zero when the cache is enabled */
+int	nq_cache_enabled(void);
+void	nq_cache_stats(struct nq_cache_stats *stats);
+
+/*
+ * Hash the len bytes at data, salt covering whatever else the cached value
+ * depends on. The hash is seeded per process so that colliding inputs can't
+ * be crafted in advance.
+ */
+void	nq_cache_key_init(struct nq_cache_key *key, const uint8_t *data, size_t len, uint64_t salt);
+
+/*
+ * Lookup key, returning copy() of its value (copied while the cache is
+ * locked, so that a concurrent eviction can't free it first) or NULL when
+ * it is not cached.
+ */
+void	*nq_cache_get(const struct nq_cache_key *key, void *(*copy)(const void *value));
+
+/*
+ * Cache value under key, size being what it accounts for in the byte limit.
+ * The cache takes ownership of value, releasing it with free_value() once
+ * evicted (right away when it can't be cached).
+ */
+void	nq_cache_put(const struct nq_cache_key *key, void *value, size_t size,
+	    void (*free_value)(void *value));
+
+#endif /* ndef NODE_QUIRC_CACHE_H */
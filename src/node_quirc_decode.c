@@ -2,21 +2,49 @@
  * node_quirc_decode.c - node-quirc decoding stuff
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iconv.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <png.h>
 #define	PNG_BYTES_TO_CHECK	4
 #include <jpeglib.h>
 
+#include "node_quirc_cache.h"
 #include "node_quirc_decode.h"
 #include "quirc.h"
+#include "quirc_internal.h" /* for sizeof(struct quirc) and quirc_pixel_t */
+
+
+/*
+ * libpng default RGB to gray coefficients, out of 32768, used for every color
+ * image but JPEG (whose luma is decoded as is) and raw ones.
+ */
+#define	NQ_GRAY_RED	6968
+#define	NQ_GRAY_GREEN	23434
+#define	NQ_GRAY_BLUE	(32768 - NQ_GRAY_RED - NQ_GRAY_GREEN)
+#define	NQ_GRAY(r, g, b) \
+	((uint8_t)((NQ_GRAY_RED * (uint32_t)(r) + NQ_GRAY_GREEN * (uint32_t)(g) + \
+	    NQ_GRAY_BLUE * (uint32_t)(b)) >> 15))
+
+/* bytes per row of 1-bit images, see nq_bilevel_row() */
+#define	NQ_BILEVEL_STRIDE(width)	(((size_t)(width) + 7) / 8)
 
 
 /* a nq_code list */
 struct nq_code_list {
 	const char	*err; /* global error */
+	const char	*err_code; /* global error code, if any */
 	struct nq_code	*codes;
 	unsigned int	 size;
 };
@@ -25,438 +53,3450 @@ struct nq_code {
 	const char		*err;
 	struct quirc_code	 qcode;
 	struct quirc_data	 qdata;
+	char			*text; /* UTF-8 payload, see nq_code_list_text() */
+	size_t			 text_len;
+};
+
+/*
+ * The rows a loader wrote so far, counted into the image histogram as they
+ * land so that quirc doesn't make another pass over the image, see
+ * nq_rows_begin().
+ */
+struct nq_rows {
+	const uint8_t		*image; /* NULL when the rows are not counted */
+	size_t			 width;
+	size_t			 height;
+	size_t			 counted; /* rows in counts */
+	/*
+	 * interleaved histograms, so that runs of the same value (most of a
+	 * QR code image) don't wait on each other's increment.
+	 */
+	unsigned int		 counts[4][256];
+	unsigned int		 histogram[256]; /* their sum, see nq_rows_end() */
+	struct nq_pipeline	*pipeline; /* counting them, if any */
+};
+
+/* state of a nq_decode() call */
+struct nq_ctx {
+	struct quirc	*q;
+	size_t		 reserved; /* memory budget reserved, in bytes */
+	const char	*err; /* more descriptive error, if any */
+	const char	*err_code;
+	int		 flags; /* NQ_DECODE_* */
+	unsigned int	 scale; /* the image was loaded 1/scale downscaled */
+	int		 full_size; /* don't downscale, see nq_load_jpeg() */
+	struct nq_rows	 rows; /* see nq_rows_begin() */
+	int		 bilevel; /* the loader filled the quirc pixels, see nq_bilevel_row() */
+	int		 locate_only; /* the codes are not decoded, see nq_recognize() */
+	int		 incremental; /* reserved across jobs, see nq_reserve() */
+	struct nq_code	*codes; /* already decoded, see nq_recognize() */
+};
+
+/*
+ * A loader writing rows (the producer) while a second thread (the consumer)
+ * counts them into the image histogram, see nq_pipeline_start().
+ */
+struct nq_pipeline {
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 landed;
+	pthread_t	 thread;
+	struct nq_rows	*rows; /* only the consumer counts them */
+	size_t		 landed_rows; /* rows landed so far */
+	int		 done; /* no more rows are coming */
+	size_t		 reported; /* rows landed, as known by the producer only */
+};
+
+/* how the rows libpng reads are turned into grayscale, see nq_png_to_gray() */
+struct nq_png_gray {
+	int		 passes; /* needed to read the image */
+	int		 channels; /* bytes per pixel of the rows read */
+	int		 palette; /* the rows are palette indices into lut */
+	uint8_t		 lut[256];
+	int		 bilevel; /* the rows are 1-bit, see nq_bilevel_row() */
+	int		 black; /* the bit value of black pixels, when bilevel */
+};
+
+/* a PNM (PBM, PGM, PPM or PAM) image, see nq_pnm_parse() */
+struct nq_pnm {
+	const char	*format; /* "pbm", "pgm", "ppm" or "pam" */
+	size_t		 width;
+	size_t		 height;
+	int		 channels; /* samples per pixel */
+	int		 depth; /* bits per sample: 1 for PBM (1 is black), 8 or 16 */
+	unsigned int	 maxval;
+	uint8_t		 lut[256]; /* 8-bit samples scaled to 255, see nq_pnm_row() */
+	const uint8_t	*raster;
+	size_t		 stride; /* bytes per row */
+};
+
+/* an uncompressed BMP image, see nq_bmp_parse() */
+struct nq_bmp {
+	size_t		 width;
+	size_t		 height;
+	int		 top_down; /* rows are stored from the bottom up otherwise */
+	int		 bpp; /* bits per pixel: 1, 4, 8, 24 or 32 */
+	uint8_t		 lut[256]; /* gray of the palette colors when bpp <= 8 */
+	const uint8_t	*raster;
+	size_t		 stride; /* bytes per row, padded to 4 */
+};
+
+/* image formats, told apart by their first bytes, see nq_sniff() */
+enum nq_format {
+	NQ_FORMAT_UNKNOWN = 0,
+	NQ_FORMAT_PNG,
+	NQ_FORMAT_JPEG,
+	NQ_FORMAT_PNM,
+	NQ_FORMAT_BMP,
+};
+
+/* hacked from quirc/tests/dbgutil.c */
+struct nq_jpeg_error {
+	struct jpeg_error_mgr base;
+	jmp_buf env;
+};
+
+/* nq_incremental progress */
+enum nq_incremental_state {
+	NQ_INCREMENTAL_SNIFF = 0, /* waiting for the image signature */
+	NQ_INCREMENTAL_PNG,
+	NQ_INCREMENTAL_JPEG_HEADER,
+	NQ_INCREMENTAL_JPEG_START,
+	NQ_INCREMENTAL_JPEG_ROWS,
+	NQ_INCREMENTAL_JPEG_FINISH,
+	NQ_INCREMENTAL_BUFFER, /* loaded at once by nq_incremental_end() */
+	NQ_INCREMENTAL_LOADED, /* the image is fully decoded */
+	NQ_INCREMENTAL_FAILED,
+};
+
+/* an incremental decode, see nq_incremental_new() */
+struct nq_incremental {
+	struct nq_ctx			 ctx;
+	enum nq_incremental_state	 state;
+	/* the bytes received but not consumed yet, see nq_incremental_append() */
+	struct jpeg_source_mgr		 src;
+	uint8_t				*buf;
+	size_t				 cap;
+	size_t				 skip; /* bytes to skip in the next ones */
+	int				 eof; /* no more bytes are coming */
+	uint8_t				*image; /* the quirc image being filled */
+	quirc_pixel_t			*pixels; /* or its pixels, for bilevel images */
+	/* PNG progressive reader */
+	png_structp			 png_ptr;
+	png_infop			 info_ptr;
+	int				 width;
+	struct nq_png_gray		 gray;
+	/* JPEG suspending decompressor */
+	struct jpeg_decompress_struct	 dinfo;
+	struct nq_jpeg_error		 jerr;
+};
+
+/* process-wide memory budget, see nq_set_memory_budget() */
+static struct {
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 released;
+	size_t		 limit; /* 0 for no limit */
+	int		 wait;
+	size_t		 used;
+	size_t		 incremental; /* part of used held by incremental decodes */
+} nq_budget = {
+	.mutex    = PTHREAD_MUTEX_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * process-wide image size limits, see nq_set_max_pixels() and
+ * nq_set_jpeg_pixel_budget(), and JPEG decoding threads, see nq_set_jpeg_threads()
+ */
+static struct {
+	pthread_mutex_t	 mutex;
+	size_t		 max_pixels; /* 0 for no limit */
+	size_t		 jpeg_pixels; /* 0 to never downscale */
+	unsigned int	 jpeg_threads; /* 1 or less to decode serially */
+	size_t		 pipeline_pixels; /* 0 to never pipeline */
+} nq_limits = {
+	.mutex        = PTHREAD_MUTEX_INITIALIZER,
+	.jpeg_threads = 1,
+};
+
+/* see nq_load_stats() */
+static struct {
+	pthread_mutex_t		mutex;
+	struct nq_load_stats	stats;
+} nq_load_counters = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* per-thread quirc instance cache, see nq_quirc_acquire() */
+#define	NQ_QUIRC_CACHE_MAX_PIXELS	(4 * 1024 * 1024)
+static pthread_key_t	nq_quirc_key;
+static pthread_once_t	nq_quirc_once = PTHREAD_ONCE_INIT;
+static int		nq_quirc_key_ok = 0;
+
+static void	nq_png_read(png_structp png_ptr, png_bytep data, png_size_t len);
+static int	nq_probe_png(const uint8_t *img, size_t img_len, struct nq_image_info *info);
+static int	nq_probe_jpeg(const uint8_t *img, size_t img_len, struct nq_image_info *info);
+static int	nq_incremental_append(struct nq_incremental *inc, const uint8_t *data, size_t len);
+static int	nq_incremental_png(struct nq_incremental *inc);
+static void	nq_incremental_png_info(png_structp png_ptr, png_infop info_ptr);
+static void	nq_incremental_png_row(png_structp png_ptr, png_bytep row, png_uint_32 y, int pass);
+static void	nq_incremental_png_end(png_structp png_ptr, png_infop info_ptr);
+static int	nq_incremental_jpeg(struct nq_incremental *inc);
+static struct jpeg_error_mgr	*nq_error_mgr(struct nq_jpeg_error *err);
+static void	nq_incremental_jpeg_init(j_decompress_ptr dinfo);
+static boolean	nq_incremental_jpeg_fill(j_decompress_ptr dinfo);
+static void	nq_incremental_jpeg_skip(j_decompress_ptr dinfo, long len);
+static void	nq_incremental_release(struct nq_incremental *inc);
+static int	nq_load_image(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height);
+static enum nq_format	nq_sniff(const uint8_t *img, size_t img_len);
+static int	nq_load_png(struct nq_ctx *ctx, const uint8_t *img, size_t img_len);
+static int	nq_png_to_gray(png_structp png_ptr, png_infop info_ptr, struct nq_png_gray *gray);
+static int	nq_png_plain_luma(png_structp png_ptr, png_infop info_ptr);
+static void	nq_png_gray_row(const struct nq_png_gray *gray, uint8_t *dst, const uint8_t *src, size_t n);
+static void	nq_gray_row(uint8_t *dst, const uint8_t *src, size_t n, int channels, int bgr);
+static void	nq_bilevel_row(quirc_pixel_t *dst, const uint8_t *src, size_t n, int black);
+static int	nq_load_jpeg(struct nq_ctx *ctx, const uint8_t *img, size_t img_len);
+static size_t	nq_jpeg_extra(const struct jpeg_decompress_struct *dinfo, unsigned int threads);
+static void	nq_jpeg_setup(struct jpeg_decompress_struct *dinfo, int flags, unsigned int scale);
+static int	nq_jpeg_read_rows(struct jpeg_decompress_struct *dinfo, uint8_t *out, struct nq_rows *rows);
+static unsigned int	nq_jpeg_threads(const struct jpeg_decompress_struct *dinfo);
+static int	nq_load_jpeg_bands(const struct jpeg_decompress_struct *dinfo, int flags,
+		    const uint8_t *img, size_t img_len, struct nq_rows *rows, unsigned int threads);
+static int	nq_jpeg_restarts(const uint8_t *img, size_t img_len, size_t data, size_t count,
+		    size_t *rst, size_t *end);
+static void	*nq_jpeg_band_decode(void *arg);
+static int	nq_load_pnm(struct nq_ctx *ctx, const uint8_t *img, size_t img_len);
+static int	nq_pnm_parse(const uint8_t *img, size_t img_len, struct nq_pnm *pnm);
+static size_t	nq_pnm_space(const uint8_t *img, size_t img_len, size_t pos);
+static size_t	nq_pnm_uint(const uint8_t *img, size_t img_len, size_t *pos);
+static void	nq_pnm_row(const struct nq_pnm *pnm, uint8_t *dst, size_t y, uint8_t *scratch);
+static int	nq_load_bmp(struct nq_ctx *ctx, const uint8_t *img, size_t img_len);
+static int	nq_bmp_parse(const uint8_t *img, size_t img_len, struct nq_bmp *bmp);
+static void	nq_bmp_row(const struct nq_bmp *bmp, uint8_t *dst, size_t y);
+static int	nq_load_raw(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height);
+static int	nq_check_size(struct nq_ctx *ctx, size_t width, size_t height);
+static void	nq_rows_begin(struct nq_rows *rows, const uint8_t *image, size_t width, size_t height, int pipeline);
+static void	nq_rows_landed(struct nq_rows *rows, size_t landed);
+static void	nq_rows_count(struct nq_rows *rows, size_t landed);
+static const unsigned int	*nq_rows_end(struct nq_rows *rows);
+static void	nq_pipeline_start(struct nq_rows *rows);
+static void	*nq_pipeline_consume(void *arg);
+static void	nq_pipeline_finish(struct nq_rows *rows);
+static unsigned int	nq_jpeg_scale(const struct nq_ctx *ctx, size_t width, size_t height);
+static int	nq_reserve(struct nq_ctx *ctx, size_t width, size_t height, size_t extra);
+static void	nq_release(struct nq_ctx *ctx);
+static void	nq_load_count(uint64_t *counter);
+static int	nq_recognize(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height);
+static void	nq_quirc_end(struct nq_ctx *ctx, const unsigned int *histogram);
+static int	nq_code_list_fill(struct nq_code_list *list, struct nq_ctx *ctx);
+static int	nq_decode_codes(struct nq_ctx *ctx);
+static void	nq_decode_code(const struct nq_ctx *ctx, int index, struct nq_code *nqcode);
+static void	nq_decode_qcode(struct nq_code *nqcode);
+static void	nq_ctx_cleanup(struct nq_ctx *ctx);
+static void	nq_perspective_map(const double *c, double u, double v, int *x, int *y);
+static struct quirc	*nq_quirc_acquire(void);
+static void	nq_quirc_release(struct quirc *q);
+static int	nq_resize(struct quirc *q, int width, int height);
+static uint8_t	*nq_put32(uint8_t *dst, uint32_t value);
+static size_t	nq_code_binary_len(const struct nq_code *code);
+static size_t	nq_code_binary(const struct nq_code *code, uint8_t *rec, uint8_t *buf, size_t offset);
+static size_t	nq_code_list_binary_len(const struct nq_code_list *list);
+static void	nq_code_list_binary_write(const struct nq_code_list *list, uint8_t *buf);
+static struct nq_code_list	*nq_decode_uncached(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height, int flags);
+static int	nq_decode_into_cached(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height,
+		    int flags, uint8_t *out, size_t out_len, const char **err, const char **err_code);
+static uint64_t	nq_cache_salt(size_t img_width, size_t img_height, int flags);
+static void	*nq_code_list_copy(const void *list);
+static void	nq_code_list_free_value(void *list);
+/* an iconv(3) descriptor shared by the codes of a list */
+struct nq_iconv {
+	const char	*charset; /* NULL when nothing was opened yet */
+	iconv_t		 cd; /* (iconv_t)-1 when charset is not supported */
 };
 
-static int	nq_load_image(struct quirc *q, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height);
-static int	nq_load_png(struct quirc *q, const uint8_t *img, size_t img_len);
-static int	nq_load_jpeg(struct quirc *q, const uint8_t *img, size_t img_len);
-static int	nq_load_raw(struct quirc *q, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height);
+static int	nq_code_text_init(struct nq_code *code, struct nq_iconv *conv);
+static const char	*nq_charset(const struct quirc_data *qdata);
+static int	nq_utf8_valid(const uint8_t *s, size_t len);
+static size_t	nq_latin1_to_utf8(const uint8_t *in, size_t len, char *out);
+static int	nq_iconv_to_utf8(struct nq_iconv *conv, const char *charset,
+		    const uint8_t *in, size_t len, char *out, size_t *out_len);
 
 
+/*
+ * When the cache is enabled, successful results are cached keyed by the
+ * input bytes and dimensions, so that decoding the same input again skips
+ * both the image loading and the recognition.
+ */
 struct nq_code_list *
-nq_decode(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
+nq_decode(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height, int flags)
+{
+	struct nq_code_list *list, *copy;
+	struct nq_cache_key key;
+
+	if (!nq_cache_enabled())
+		return nq_decode_uncached(img, img_len, img_width, img_height, flags);
+
+	nq_cache_key_init(&key, img, img_len, nq_cache_salt(img_width, img_height, flags));
+	list = nq_cache_get(&key, nq_code_list_copy);
+	if (list != NULL)
+		return (list);
+
+	list = nq_decode_uncached(img, img_len, img_width, img_height, flags);
+	/* errors may be transient, e.g. the memory budget */
+	if (list != NULL && list->err == NULL) {
+		copy = nq_code_list_copy(list);
+		if (copy != NULL) {
+			size_t size = sizeof(struct nq_code_list) +
+			    copy->size * sizeof(struct nq_code);
+			nq_cache_put(&key, copy, size, nq_code_list_free_value);
+		}
+	}
+
+	return (list);
+}
+
+
+static struct nq_code_list *
+nq_decode_uncached(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height, int flags)
 {
 	struct nq_code_list *list = NULL;
-	struct quirc *q = NULL;
+	struct nq_ctx ctx = { .flags = flags };
 
 	list = calloc(1, sizeof(struct nq_code_list));
 	if (list == NULL)
 		goto out;
 
-	q = quirc_new();
-	if (q == NULL) {
-		list->err = "quirc_new()";
+	if (nq_recognize(&ctx, img, img_len, img_width, img_height) == -1) {
+		list->err      = ctx.err;
+		list->err_code = ctx.err_code;
 		goto out;
 	}
 
-	if (nq_load_image(q, img, img_len, img_width, img_height) == -1) {
-		// FIXME: more descriptive error here?
-		list->err = "failed to load image";
-		goto out;
+	if (nq_code_list_fill(list, &ctx) == -1) {
+		nq_code_list_free(list);
+		list = NULL;
 	}
 
-	quirc_end(q);
+	/* FALLTHROUGH */
+out:
+	/* cleanup */
+	nq_ctx_cleanup(&ctx);
+
+	return (list);
+}
 
-	int count = quirc_count(q);
-	if (count < 0) {
-		list->err = "quirc_count()";
-		goto out;
-	}
 
-	list->size  = (unsigned int)count;
-	list->codes = calloc((size_t)list->size, sizeof(struct nq_code));
+struct nq_code_list *
+nq_decode_grids(unsigned int count, const int *sizes, const uint8_t *cells)
+{
+	struct nq_code_list *list;
+
+	list = calloc(1, sizeof(struct nq_code_list));
+	if (list == NULL)
+		return (NULL);
+
+	list->codes = calloc((size_t)count + 1, sizeof(struct nq_code));
 	if (list->codes == NULL) {
-		nq_code_list_free(list);
-		list = NULL;
-		goto out;
+		free(list);
+		return (NULL);
 	}
+	list->size = count;
 
-	for (int i = 0; i < count; i++) {
+	for (unsigned int i = 0; i < count; i++) {
 		struct nq_code *nqcode = list->codes + i;
-		quirc_decode_error_t err;
+		size_t len = NQ_GRID_BITMAP_LEN(sizes[i]);
 
-		quirc_extract(q, i, &nqcode->qcode);
-		err = quirc_decode(&nqcode->qcode, &nqcode->qdata);
-		if (err == QUIRC_ERROR_DATA_ECC) {
-			quirc_flip(&nqcode->qcode);
-			err = quirc_decode(&nqcode->qcode, &nqcode->qdata);
+		if (sizes[i] < NQ_GRID_MIN_SIZE || sizes[i] > NQ_GRID_MAX_SIZE) {
+			/* would not fit in cell_bitmap, and has no bitmap */
+			nqcode->err = quirc_strerror(QUIRC_ERROR_INVALID_GRID_SIZE);
+			continue;
 		}
+		nqcode->qcode.size = sizes[i];
+		memcpy(nqcode->qcode.cell_bitmap, cells, len);
+		cells += len;
+		nq_decode_qcode(nqcode);
+	}
+
+	return (list);
+}
+
+
+int
+nq_decode_into(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height, int flags,
+    uint8_t *out, size_t out_len, const char **err, const char **err_code)
+{
+	struct nq_ctx ctx = { .flags = flags };
+	struct nq_code nqcode;
+	int count = -1;
+
+	if (nq_cache_enabled()) {
+		return nq_decode_into_cached(img, img_len, img_width, img_height,
+		    flags, out, out_len, err, err_code);
+	}
+
+	if (nq_recognize(&ctx, img, img_len, img_width, img_height) == -1)
+		goto out;
+
+	count = quirc_count(ctx.q);
+	if (count < 0) {
+		ctx.err = "quirc_count()";
+		goto out;
+	}
+
+	size_t offset = NQ_BINARY_HEADER_SIZE + (size_t)count * NQ_BINARY_CODE_SIZE;
+	if (offset > out_len)
+		goto too_small;
 
-		if (err)
-			nqcode->err = quirc_strerror(err);
+	memcpy(out, NQ_BINARY_MAGIC, 4);
+	(void)nq_put32(out + 4, (uint32_t)count);
+
+	for (int i = 0; i < count; i++) {
+		uint8_t *rec = out + NQ_BINARY_HEADER_SIZE + i * NQ_BINARY_CODE_SIZE;
+		const struct nq_code *code = &nqcode;
+
+		if (ctx.codes != NULL)
+			code = ctx.codes + i;
+		else
+			nq_decode_code(&ctx, i, &nqcode);
+		if (offset + nq_code_binary_len(code) > out_len)
+			goto too_small;
+		offset += nq_code_binary(code, rec, out, offset);
 	}
 
+	goto out;
+too_small:
+	ctx.err      = "output buffer is too small";
+	ctx.err_code = "ERR_OUTPUT_TOO_SMALL";
+	count = -1;
 	/* FALLTHROUGH */
 out:
 	/* cleanup */
-	if (q != NULL)
-		quirc_destroy(q);
+	nq_ctx_cleanup(&ctx);
 
-	return (list);
+	*err      = ctx.err;
+	*err_code = ctx.err_code;
+	return (count);
 }
 
 
-const char *
-nq_code_list_err(const struct nq_code_list *list)
+int
+nq_locate(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height, int flags,
+    struct nq_location **locations, const char **err, const char **err_code)
 {
-	return (list->err);
+	struct nq_ctx ctx = { .flags = flags, .locate_only = 1 };
+	int count = -1;
+
+	*locations = NULL;
+	if (nq_recognize(&ctx, img, img_len, img_width, img_height) == -1)
+		goto out;
+
+	count = quirc_count(ctx.q);
+	if (count < 0) {
+		ctx.err = "quirc_count()";
+		goto out;
+	}
+
+	/* one more so that no code doesn't mean a NULL array */
+	*locations = calloc((size_t)count + 1, sizeof(struct nq_location));
+	if (*locations == NULL) {
+		ctx.err = "Could not allocate memory";
+		count = -1;
+		goto out;
+	}
+
+	/* the corners computation of quirc_extract(), without its sampling */
+	for (int i = 0; i < count; i++) {
+		const struct quirc_grid *qr = &ctx.q->grids[i];
+		const double size = qr->grid_size;
+		struct nq_location *loc = *locations + i;
+
+		nq_perspective_map(qr->c, 0.0, 0.0, &loc->corners[0].x, &loc->corners[0].y);
+		nq_perspective_map(qr->c, size, 0.0, &loc->corners[1].x, &loc->corners[1].y);
+		nq_perspective_map(qr->c, size, size, &loc->corners[2].x, &loc->corners[2].y);
+		nq_perspective_map(qr->c, 0.0, size, &loc->corners[3].x, &loc->corners[3].y);
+		for (int j = 0; j < 4; j++) {
+			loc->corners[j].x *= (int)ctx.scale;
+			loc->corners[j].y *= (int)ctx.scale;
+		}
+		loc->size = qr->grid_size;
+	}
+
+	/* FALLTHROUGH */
+out:
+	/* cleanup */
+	nq_ctx_cleanup(&ctx);
+
+	*err      = ctx.err;
+	*err_code = ctx.err_code;
+	return (count);
 }
 
 
-unsigned int
-nq_code_list_size(const struct nq_code_list *list)
+/* from quirc/identify.c where it is static */
+static void
+nq_perspective_map(const double *c, double u, double v, int *x, int *y)
 {
-	return (list->size);
+	double den = c[6] * u + c[7] * v + 1.0;
+
+	*x = (int)rint((c[0] * u + c[1] * v + c[2]) / den);
+	*y = (int)rint((c[3] * u + c[4] * v + c[5]) / den);
 }
 
 
-const struct nq_code *
-nq_code_at(const struct nq_code_list *list, unsigned int index)
+/* what a cached result depends on besides the input bytes */
+static uint64_t
+nq_cache_salt(size_t img_width, size_t img_height, int flags)
 {
-	const struct nq_code *target = NULL;
+	/* raw image dimensions fit in 31 bits, leaving the top one of each half for flags */
+	return (((uint64_t)img_width << 32) | (uint64_t)img_height |
+	    ((uint64_t)(flags & NQ_DECODE_JPEG_FAST) << 63) |
+	    ((uint64_t)(flags & NQ_DECODE_BILEVEL) << 30));
+}
 
-	if (index < nq_code_list_size(list))
-		target = list->codes + index;
 
-	return (target);
+/* nq_decode_into() going through the nq_decode() cache */
+static int
+nq_decode_into_cached(const uint8_t *img, size_t img_len, size_t img_width, size_t img_height,
+    int flags, uint8_t *out, size_t out_len, const char **err, const char **err_code)
+{
+	struct nq_code_list *list;
+	int count = -1;
+
+	*err      = NULL;
+	*err_code = NULL;
+
+	list = nq_decode(img, img_len, img_width, img_height, flags);
+	if (list == NULL) {
+		*err = "Could not allocate memory";
+	} else if (list->err != NULL) {
+		*err      = list->err;
+		*err_code = list->err_code;
+	} else if (nq_code_list_binary_len(list) > out_len) {
+		*err      = "output buffer is too small";
+		*err_code = "ERR_OUTPUT_TOO_SMALL";
+	} else {
+		nq_code_list_binary_write(list, out);
+		count = (int)list->size;
+	}
 
+	nq_code_list_free(list);
+	return (count);
 }
 
 
-void
-nq_code_list_free(struct nq_code_list *list)
+/*
+ * Get a quirc instance into ctx, load the image in it and run the
+ * recognition. When the image was downscaled, the codes found are decoded
+ * into ctx->codes to tell whether to fall back to the full size.
+ *
+ * returns 0 on success, -1 on error setting ctx->err.
+ */
+static int
+nq_recognize(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
 {
-	if (list != NULL)
-		free(list->codes);
-	free(list);
+	ctx->q = nq_quirc_acquire();
+	if (ctx->q == NULL) {
+		ctx->err = "quirc_new()";
+		return (-1);
+	}
+
+	for (;;) {
+		int ret = nq_load_image(ctx, img, img_len, img_width, img_height);
+		const unsigned int *histogram = nq_rows_end(&ctx->rows);
+		if (ret == -1) {
+			/* malformed or unsupported, the loader found nothing more specific */
+			if (ctx->err == NULL)
+				ctx->err = "failed to load image";
+			return (-1);
+		}
+
+		nq_quirc_end(ctx, histogram);
+		if (ctx->scale == 1)
+			break;
+		if (ctx->locate_only) {
+			if (quirc_count(ctx->q) > 0)
+				break;
+		} else {
+			int decodable = nq_decode_codes(ctx);
+			if (decodable == -1) {
+				ctx->err = "Could not allocate memory";
+				return (-1);
+			}
+			if (decodable > 0)
+				break;
+			free(ctx->codes);
+			ctx->codes = NULL;
+		}
+
+		/*
+		 * nothing readable in the downscaled image (the codes may be
+		 * too small to be sampled there), try the full size. Locating
+		 * codes doesn't read them, so only finding none at all counts.
+		 */
+		nq_release(ctx);
+		ctx->full_size = 1;
+	}
+
+	return (0);
 }
 
 
-const char *
-nq_code_err(const struct nq_code *code)
+/*
+ * Run the quirc recognition on the image loaded into ctx, thresholding it
+ * with histogram when the loader counted it (see nq_rows_end()) unless it
+ * wrote bilevel pixels.
+ */
+static void
+nq_quirc_end(struct nq_ctx *ctx, const unsigned int *histogram)
 {
-	return (code->err);
+	if (ctx->bilevel)
+		quirc_end_bilevel(ctx->q);
+	else if (histogram != NULL)
+		quirc_end_with_histogram(ctx->q, histogram);
+	else
+		quirc_end(ctx->q);
 }
 
 
-int
-nq_code_version(const struct nq_code *code)
+/*
+ * Decode every code recognized by ctx into list, setting the list error when
+ * they can't be counted. Codes nq_recognize() already decoded are moved from
+ * ctx to list.
+ *
+ * returns 0 on success, -1 when out of memory.
+ */
+static int
+nq_code_list_fill(struct nq_code_list *list, struct nq_ctx *ctx)
 {
-	return (code->qdata.version);
+	int count = quirc_count(ctx->q);
+	if (count < 0) {
+		list->err = "quirc_count()";
+		return (0);
+	}
+
+	list->size = (unsigned int)count;
+	if (ctx->codes != NULL) {
+		list->codes = ctx->codes;
+		ctx->codes  = NULL;
+		return (0);
+	}
+	list->codes = calloc((size_t)list->size, sizeof(struct nq_code));
+	if (list->codes == NULL)
+		return (-1);
+
+	for (int i = 0; i < count; i++)
+		nq_decode_code(ctx, i, list->codes + i);
+	return (0);
 }
 
 
-const char *
-nq_code_ecc_level_str(const struct nq_code *code)
+/*
+ * Decode every code recognized by ctx into ctx->codes.
+ *
+ * returns how many were decoded without error, -1 when out of memory.
+ */
+static int
+nq_decode_codes(struct nq_ctx *ctx)
 {
-	switch (code->qdata.ecc_level) {
-	case  QUIRC_ECC_LEVEL_M: return "M";
-	case  QUIRC_ECC_LEVEL_L: return "L";
-	case  QUIRC_ECC_LEVEL_H: return "H";
-	case  QUIRC_ECC_LEVEL_Q: return "Q";
-	}
+	int count = quirc_count(ctx->q), decodable = 0;
 
-	return "?";
+	/* one more so that no code doesn't mean a NULL array */
+	ctx->codes = calloc((size_t)(count > 0 ? count : 0) + 1, sizeof(struct nq_code));
+	if (ctx->codes == NULL)
+		return (-1);
+
+	for (int i = 0; i < count; i++) {
+		nq_decode_code(ctx, i, ctx->codes + i);
+		if (ctx->codes[i].err == NULL)
+			decodable++;
+	}
+	return (decodable);
 }
 
 
-int
-nq_code_mask(const struct nq_code *code)
+/* extract and decode the code at index */
+static void
+nq_decode_code(const struct nq_ctx *ctx, int index, struct nq_code *nqcode)
 {
-	return (code->qdata.mask);
+	quirc_extract(ctx->q, index, &nqcode->qcode);
+	/* report the corners in the original image coordinates */
+	for (int i = 0; i < 4; i++) {
+		nqcode->qcode.corners[i].x *= (int)ctx->scale;
+		nqcode->qcode.corners[i].y *= (int)ctx->scale;
+	}
+	nq_decode_qcode(nqcode);
 }
 
 
-const char *
-nq_code_mode_str(const struct nq_code *code)
+/* decode nqcode->qcode, trying its mirror image on failure */
+static void
+nq_decode_qcode(struct nq_code *nqcode)
 {
-	switch (code->qdata.data_type) {
-	case QUIRC_DATA_TYPE_NUMERIC: return "NUMERIC";
-	case QUIRC_DATA_TYPE_ALPHA:   return "ALNUM";
-	case QUIRC_DATA_TYPE_BYTE:    return "BYTE";
-	case QUIRC_DATA_TYPE_KANJI:   return "KANJI";
+	quirc_decode_error_t err;
+
+	nqcode->err = NULL;
+	err = quirc_decode(&nqcode->qcode, &nqcode->qdata);
+	if (err == QUIRC_ERROR_DATA_ECC) {
+		quirc_flip(&nqcode->qcode);
+		err = quirc_decode(&nqcode->qcode, &nqcode->qdata);
 	}
 
-	return "unknown";
+	if (err)
+		nqcode->err = quirc_strerror(err);
 }
 
 
-const char *
-nq_code_eci_str(const struct nq_code *code)
+/* release everything held by ctx */
+static void
+nq_ctx_cleanup(struct nq_ctx *ctx)
 {
-	switch (code->qdata.eci) {
-		case QUIRC_ECI_ISO_8859_1:  return "ISO_8859_1";
-		case QUIRC_ECI_IBM437:      return "IBM437";
-		case QUIRC_ECI_ISO_8859_2:  return "ISO_8859_2";
-		case QUIRC_ECI_ISO_8859_3:  return "ISO_8859_3";
-		case QUIRC_ECI_ISO_8859_4:  return "ISO_8859_4";
-		case QUIRC_ECI_ISO_8859_5:  return "ISO_8859_5";
-		case QUIRC_ECI_ISO_8859_6:  return "ISO_8859_6";
-		case QUIRC_ECI_ISO_8859_7:  return "ISO_8859_7";
-		case QUIRC_ECI_ISO_8859_8:  return "ISO_8859_8";
-		case QUIRC_ECI_ISO_8859_9:  return "ISO_8859_9";
-		case QUIRC_ECI_WINDOWS_874: return "WINDOWS_874";
-		case QUIRC_ECI_ISO_8859_13: return "ISO_8859_13";
-		case QUIRC_ECI_ISO_8859_15: return "ISO_8859_15";
-		case QUIRC_ECI_SHIFT_JIS:   return "SHIFT_JIS";
-		case QUIRC_ECI_UTF_8:       return "UTF_8";
-	}
-	return NULL;
+	if (ctx->q != NULL)
+		nq_quirc_release(ctx->q);
+	ctx->q = NULL;
+	free(ctx->codes);
+	ctx->codes = NULL;
+	nq_release(ctx);
 }
 
 
-const uint8_t *
-nq_code_payload(const struct nq_code *code)
+/*
+ * Every thread keeps the quirc instance of its last decode, so that decoding
+ * a stream of images of the same size does not allocate (and zero) the quirc
+ * struct nor its image buffers each time. Instances for big images are not
+ * kept, see NQ_QUIRC_CACHE_MAX_PIXELS. Neither are any instances while a
+ * memory budget is set: a kept instance would outlive the reservation of its
+ * decode, so the budget would not account for it.
+ */
+static void
+nq_quirc_key_destroy(void *q)
 {
-	return (code->qdata.payload);
+	quirc_destroy(q);
 }
 
 
-size_t
-nq_code_payload_len(const struct nq_code *code)
+static void
+nq_quirc_key_init(void)
 {
-	return (code->qdata.payload_len);
+	if (pthread_key_create(&nq_quirc_key, nq_quirc_key_destroy) == 0)
+		nq_quirc_key_ok = 1;
 }
 
 
-/* returns 0 on success, -1 on error */
-static int
-nq_load_image(struct quirc *q, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
+static struct quirc *
+nq_quirc_acquire(void)
 {
-	if (img_width > 0 && img_height > 0) {
-		return nq_load_raw(q, img, img_len, img_width, img_height);
+	struct quirc *q = NULL;
+
+	(void)pthread_once(&nq_quirc_once, nq_quirc_key_init);
+	if (nq_quirc_key_ok) {
+		q = pthread_getspecific(nq_quirc_key);
+		(void)pthread_setspecific(nq_quirc_key, NULL);
 	}
 
-	int ret = -1; /* error */
+	return (q != NULL ? q : quirc_new());
+}
 
-	if (img_len >= PNG_BYTES_TO_CHECK) {
-		if (png_sig_cmp((uint8_t *)img, (png_size_t)0, PNG_BYTES_TO_CHECK) == 0)
-			ret = nq_load_png(q, img, img_len);
-	}
 
-	if (ret != 0) {
-			ret = nq_load_jpeg(q, img, img_len);
-	}
+static void
+nq_quirc_release(struct quirc *q)
+{
+	pthread_mutex_lock(&nq_budget.mutex);
+	const int budget = (nq_budget.limit > 0);
+	pthread_mutex_unlock(&nq_budget.mutex);
 
-	return (ret);
+	if (!nq_quirc_key_ok || budget || (size_t)q->w * (size_t)q->h > NQ_QUIRC_CACHE_MAX_PIXELS ||
+	    pthread_setspecific(nq_quirc_key, q) != 0) {
+		quirc_destroy(q);
+	}
 }
 
 
-/* hacked from quirc/tests/dbgutil.c */
+/* resize q for a width x height image, unless it already has that size */
 static int
-nq_load_png(struct quirc *q, const uint8_t *img, size_t img_len)
+nq_resize(struct quirc *q, int width, int height)
 {
-	int width, height, rowbytes, interlace_type, number_passes = 1;
-	png_uint_32 trns;
-	png_byte color_type, bit_depth;
+	if (q->w == width && q->h == height)
+		return (0);
+	return quirc_resize(q, width, height);
+}
+
+
+int
+nq_file_open(const char *path, struct nq_file *file, const char **syscall)
+{
+	struct stat st;
+	int fd, saved_errno;
+
+	memset(file, 0, sizeof(*file));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		*syscall = "open";
+		return (-1);
+	}
+	if (fstat(fd, &st) == -1) {
+		*syscall = "fstat";
+		goto fail;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		errno = (S_ISDIR(st.st_mode) ? EISDIR : EINVAL);
+		*syscall = "open";
+		goto fail;
+	}
+	file->len = (size_t)st.st_size;
+	if (file->len == 0)
+		goto out;
+
+	void *data = mmap(NULL, file->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data != MAP_FAILED) {
+		file->data   = data;
+		file->mapped = 1;
+		goto out;
+	}
+
+	/* e.g. on file systems without mmap(2) support */
+	file->data = malloc(file->len);
+	if (file->data == NULL) {
+		*syscall = "malloc";
+		goto fail;
+	}
+	for (size_t done = 0; done < file->len; ) {
+		ssize_t n = pread(fd, file->data + done, file->len - done, (off_t)done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			/* the file was truncated under our feet */
+			if (n == 0)
+				errno = EIO;
+			*syscall = "pread";
+			goto fail;
+		}
+		done += (size_t)n;
+	}
+
+	/* FALLTHROUGH */
+out:
+	(void)close(fd);
+	return (0);
+
+fail:
+	saved_errno = errno;
+	nq_file_close(file);
+	(void)close(fd);
+	errno = saved_errno;
+	return (-1);
+}
+
+
+void
+nq_file_close(struct nq_file *file)
+{
+	if (file->mapped)
+		(void)munmap(file->data, file->len);
+	else
+		free(file->data);
+	memset(file, 0, sizeof(*file));
+}
+
+
+void
+nq_file_prefetch(const char *path)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	(void)close(fd);
+#else
+	(void)path;
+#endif
+}
+
+
+struct nq_incremental *
+nq_incremental_new(int flags)
+{
+	struct nq_incremental *inc = calloc(1, sizeof(struct nq_incremental));
+	if (inc == NULL)
+		return (NULL);
+
+	inc->ctx.flags = flags;
+	inc->ctx.incremental = 1;
+	/* there is no way back to downscale, see nq_recognize() */
+	inc->ctx.full_size = 1;
+	inc->ctx.scale     = 1;
+	inc->ctx.q = quirc_new();
+	if (inc->ctx.q == NULL) {
+		free(inc);
+		return (NULL);
+	}
+	inc->src.init_source       = nq_incremental_jpeg_init;
+	inc->src.fill_input_buffer = nq_incremental_jpeg_fill;
+	inc->src.skip_input_data   = nq_incremental_jpeg_skip;
+	inc->src.resync_to_restart = jpeg_resync_to_restart;
+	inc->src.term_source       = nq_incremental_jpeg_init;
+	return (inc);
+}
+
+
+int
+nq_incremental_write(struct nq_incremental *inc, const uint8_t *data, size_t len)
+{
+	switch (inc->state) {
+	case NQ_INCREMENTAL_SNIFF:
+		if (nq_incremental_append(inc, data, len) == -1)
+			goto fail;
+		if (inc->src.bytes_in_buffer < PNG_BYTES_TO_CHECK)
+			return (0);
+		switch (nq_sniff(inc->src.next_input_byte, inc->src.bytes_in_buffer)) {
+		case NQ_FORMAT_PNG:
+			inc->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+			if (inc->png_ptr == NULL)
+				goto fail;
+			inc->info_ptr = png_create_info_struct(inc->png_ptr);
+			if (inc->info_ptr == NULL)
+				goto fail;
+			png_set_progressive_read_fn(inc->png_ptr, inc, nq_incremental_png_info,
+			    nq_incremental_png_row, nq_incremental_png_end);
+			inc->state = NQ_INCREMENTAL_PNG;
+			return nq_incremental_png(inc);
+		case NQ_FORMAT_JPEG:
+			inc->dinfo.err = nq_error_mgr(&inc->jerr);
+			if (setjmp(inc->jerr.env))
+				goto fail;
+			jpeg_create_decompress(&inc->dinfo);
+			inc->dinfo.src = &inc->src;
+			inc->state = NQ_INCREMENTAL_JPEG_HEADER;
+			return nq_incremental_jpeg(inc);
+		case NQ_FORMAT_PNM:
+		case NQ_FORMAT_BMP:
+			/* cheap enough to convert once every byte is there */
+			inc->state = NQ_INCREMENTAL_BUFFER;
+			return (0);
+		default:
+			goto fail;
+		}
+	case NQ_INCREMENTAL_PNG:
+		if (nq_incremental_append(inc, data, len) == -1)
+			goto fail;
+		return nq_incremental_png(inc);
+	case NQ_INCREMENTAL_BUFFER:
+		if (nq_incremental_append(inc, data, len) == -1)
+			goto fail;
+		return (0);
+	case NQ_INCREMENTAL_LOADED:
+		return (0); /* trailing garbage, as nq_load_image() ignores */
+	case NQ_INCREMENTAL_FAILED:
+		return (-1);
+	default: /* JPEG */
+		if (nq_incremental_append(inc, data, len) == -1)
+			goto fail;
+		return nq_incremental_jpeg(inc);
+	}
+
+fail:
+	inc->state = NQ_INCREMENTAL_FAILED;
+	return (-1);
+}
+
+
+struct nq_code_list *
+nq_incremental_end(struct nq_incremental *inc)
+{
+	struct nq_code_list *list = calloc(1, sizeof(struct nq_code_list));
+	if (list == NULL) {
+		inc->state = NQ_INCREMENTAL_FAILED;
+		nq_incremental_release(inc);
+		return (NULL);
+	}
+
+	/* like jpeg_mem_src(), end a truncated JPEG image with a fake EOI */
+	inc->eof = 1;
+	if (inc->state >= NQ_INCREMENTAL_JPEG_HEADER && inc->state <= NQ_INCREMENTAL_JPEG_FINISH)
+		(void)nq_incremental_jpeg(inc);
+	if (inc->state == NQ_INCREMENTAL_BUFFER) {
+		if (nq_load_image(&inc->ctx, inc->src.next_input_byte, inc->src.bytes_in_buffer, 0, 0) == 0)
+			inc->state = NQ_INCREMENTAL_LOADED;
+	}
+
+	const unsigned int *histogram = nq_rows_end(&inc->ctx.rows);
+	if (inc->state != NQ_INCREMENTAL_LOADED) {
+		// FIXME: more descriptive error here?
+		list->err      = (inc->ctx.err != NULL ? inc->ctx.err : "failed to load image");
+		list->err_code = inc->ctx.err_code;
+		goto out;
+	}
+
+	nq_quirc_end(&inc->ctx, histogram);
+	if (nq_code_list_fill(list, &inc->ctx) == -1) {
+		nq_code_list_free(list);
+		list = NULL;
+	}
+
+out:
+	/* don't wait for nq_incremental_free() to give the memory back */
+	inc->state = NQ_INCREMENTAL_FAILED;
+	nq_incremental_release(inc);
+	return (list);
+}
+
+
+void
+nq_incremental_free(struct nq_incremental *inc)
+{
+	if (inc == NULL)
+		return;
+
+	nq_incremental_release(inc);
+	free(inc);
+}
+
+
+void
+nq_set_memory_budget(size_t limit, int wait)
+{
+	pthread_mutex_lock(&nq_budget.mutex);
+	nq_budget.limit = limit;
+	nq_budget.wait  = wait;
+	pthread_mutex_unlock(&nq_budget.mutex);
+	/* waiters may now fit or have to give up */
+	pthread_cond_broadcast(&nq_budget.released);
+}
+
+
+void
+nq_set_max_pixels(size_t max_pixels)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	int changed = (nq_limits.max_pixels != max_pixels);
+	nq_limits.max_pixels = max_pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	/* the cached results may be of images now too large */
+	if (changed)
+		nq_cache_clear();
+}
+
+
+void
+nq_set_jpeg_pixel_budget(size_t pixels)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	int changed = (nq_limits.jpeg_pixels != pixels);
+	nq_limits.jpeg_pixels = pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	/* the cached results were decoded at the previous scale */
+	if (changed)
+		nq_cache_clear();
+}
+
+
+void
+nq_set_jpeg_threads(unsigned int threads)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	nq_limits.jpeg_threads = threads;
+	pthread_mutex_unlock(&nq_limits.mutex);
+}
+
+
+void
+nq_set_pipeline_pixels(size_t pixels)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	nq_limits.pipeline_pixels = pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+}
+
+
+void
+nq_load_stats(struct nq_load_stats *stats)
+{
+	pthread_mutex_lock(&nq_load_counters.mutex);
+	*stats = nq_load_counters.stats;
+	pthread_mutex_unlock(&nq_load_counters.mutex);
+}
+
+
+/* increment one of the nq_load_counters stats */
+static void
+nq_load_count(uint64_t *counter)
+{
+	pthread_mutex_lock(&nq_load_counters.mutex);
+	(*counter)++;
+	pthread_mutex_unlock(&nq_load_counters.mutex);
+}
+
+
+const char *
+nq_code_list_err(const struct nq_code_list *list)
+{
+	return (list->err);
+}
+
+
+const char *
+nq_code_list_err_code(const struct nq_code_list *list)
+{
+	return (list->err_code);
+}
+
+
+unsigned int
+nq_code_list_size(const struct nq_code_list *list)
+{
+	return (list->size);
+}
+
+
+const struct nq_code *
+nq_code_at(const struct nq_code_list *list, unsigned int index)
+{
+	const struct nq_code *target = NULL;
+
+	if (index < nq_code_list_size(list))
+		target = list->codes + index;
+
+	return (target);
+
+}
+
+
+/* write the little-endian representation of `value` at `dst` */
+static uint8_t *
+nq_put32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = (uint8_t)(value);
+	dst[1] = (uint8_t)(value >> 8);
+	dst[2] = (uint8_t)(value >> 16);
+	dst[3] = (uint8_t)(value >> 24);
+	return (dst + 4);
+}
+
+
+/* number of payload bytes of code in the binary format */
+static size_t
+nq_code_binary_len(const struct nq_code *code)
+{
+	if (code->err != NULL)
+		return strlen(code->err);
+	return (size_t)code->qdata.payload_len;
+}
+
+
+/*
+ * write the record of code at rec, and its payload at offset in buf.
+ *
+ * returns the payload length.
+ */
+static size_t
+nq_code_binary(const struct nq_code *code, uint8_t *rec, uint8_t *buf, size_t offset)
+{
+	const struct quirc_data *qdata = &code->qdata;
+	const uint8_t *payload = qdata->payload;
+	size_t payload_len = nq_code_binary_len(code);
+	uint32_t fields[6] = {
+		0, /* flags */
+		(uint32_t)qdata->version,
+		(uint32_t)qdata->ecc_level,
+		(uint32_t)qdata->mask,
+		(uint32_t)qdata->data_type,
+		qdata->eci,
+	};
+
+	if (code->err != NULL) {
+		/* don't expose partially decoded data */
+		memset(fields, 0, sizeof(fields));
+		fields[0] = NQ_BINARY_FLAG_ERR;
+		payload = (const uint8_t *)code->err;
+	}
+
+	for (int j = 0; j < 6; j++)
+		rec = nq_put32(rec, fields[j]);
+	for (int j = 0; j < 4; j++) {
+		rec = nq_put32(rec, (uint32_t)code->qcode.corners[j].x);
+		rec = nq_put32(rec, (uint32_t)code->qcode.corners[j].y);
+	}
+	rec = nq_put32(rec, (uint32_t)offset);
+	rec = nq_put32(rec, (uint32_t)payload_len);
+
+	memcpy(buf + offset, payload, payload_len);
+	return (payload_len);
+}
+
+
+/* see node_quirc_decode.h for the format */
+uint8_t *
+nq_code_list_binary(const struct nq_code_list *list, size_t *len)
+{
+	size_t size = nq_code_list_binary_len(list);
+
+	uint8_t *buf = malloc(size);
+	if (buf == NULL)
+		return (NULL);
+
+	nq_code_list_binary_write(list, buf);
+	*len = size;
+	return (buf);
+}
+
+
+/* size of list in the binary format */
+static size_t
+nq_code_list_binary_len(const struct nq_code_list *list)
+{
+	size_t size = NQ_BINARY_HEADER_SIZE + list->size * NQ_BINARY_CODE_SIZE;
+
+	for (unsigned int i = 0; i < list->size; i++)
+		size += nq_code_binary_len(list->codes + i);
+
+	return (size);
+}
+
+
+/* write list in the binary format at buf, see nq_code_list_binary_len() */
+static void
+nq_code_list_binary_write(const struct nq_code_list *list, uint8_t *buf)
+{
+	memcpy(buf, NQ_BINARY_MAGIC, 4);
+	(void)nq_put32(buf + 4, list->size);
+
+	size_t offset = NQ_BINARY_HEADER_SIZE + list->size * NQ_BINARY_CODE_SIZE;
+	for (unsigned int i = 0; i < list->size; i++) {
+		uint8_t *rec = buf + NQ_BINARY_HEADER_SIZE + i * NQ_BINARY_CODE_SIZE;
+		offset += nq_code_binary(list->codes + i, rec, buf, offset);
+	}
+}
+
+
+/* deep copy of a successful nq_code_list (without text), NULL on ENOMEM */
+static void *
+nq_code_list_copy(const void *value)
+{
+	const struct nq_code_list *list = value;
+	struct nq_code_list *copy;
+
+	copy = calloc(1, sizeof(struct nq_code_list));
+	if (copy == NULL)
+		return (NULL);
+	if (list->size > 0) {
+		copy->codes = malloc(list->size * sizeof(struct nq_code));
+		if (copy->codes == NULL) {
+			free(copy);
+			return (NULL);
+		}
+		memcpy(copy->codes, list->codes, list->size * sizeof(struct nq_code));
+		for (unsigned int i = 0; i < list->size; i++) {
+			copy->codes[i].text     = NULL;
+			copy->codes[i].text_len = 0;
+		}
+	}
+	copy->size = list->size;
+
+	return (copy);
+}
+
+
+static void
+nq_code_list_free_value(void *list)
+{
+	nq_code_list_free(list);
+}
+
+
+void
+nq_code_list_free(struct nq_code_list *list)
+{
+	if (list != NULL) {
+		for (unsigned int i = 0; i < list->size; i++)
+			free(list->codes[i].text);
+		free(list->codes);
+	}
+	free(list);
+}
+
+
+int
+nq_code_list_text(struct nq_code_list *list)
+{
+	struct nq_iconv conv = { .charset = NULL, .cd = (iconv_t)-1 };
+	int ret = 0;
+
+	for (unsigned int i = 0; i < list->size; i++) {
+		if (nq_code_text_init(list->codes + i, &conv) == -1) {
+			list->err = "Could not allocate memory";
+			ret = -1;
+			break;
+		}
+	}
+	if (conv.cd != (iconv_t)-1)
+		iconv_close(conv.cd);
+
+	return (ret);
+}
+
+
+/*
+ * Every code point of the supported charsets is at most three UTF-8 bytes
+ * long, as is U+FFFD, while taking at least one input byte.
+ */
+#define	NQ_UTF8_MAX_RATIO	3
+
+/* set the UTF-8 text of code, returns 0 on success, -1 on ENOMEM */
+static int
+nq_code_text_init(struct nq_code *code, struct nq_iconv *conv)
+{
+	const uint8_t *payload = code->qdata.payload;
+	size_t len = (size_t)code->qdata.payload_len;
+
+	if (code->err != NULL)
+		return (0);
+
+	code->text = malloc(len * NQ_UTF8_MAX_RATIO + 1);
+	if (code->text == NULL)
+		return (-1);
+
+	const char *charset = nq_charset(&code->qdata);
+	if (strcmp(charset, "UTF-8") == 0) {
+		memcpy(code->text, payload, len);
+		code->text_len = len;
+	} else if (strcmp(charset, "ISO-8859-1") == 0 ||
+	    nq_iconv_to_utf8(conv, charset, payload, len, code->text, &code->text_len) == -1) {
+		/* iconv failing means the charset is unsupported, latin1 is lossless */
+		code->text_len = nq_latin1_to_utf8(payload, len, code->text);
+	}
+	code->text[code->text_len] = '\0';
+
+	return (0);
+}
+
+
+/* iconv(3) name of the charset of the payload */
+static const char *
+nq_charset(const struct quirc_data *qdata)
+{
+	switch (qdata->eci) {
+		case QUIRC_ECI_ISO_8859_1:  return "ISO-8859-1";
+		case QUIRC_ECI_IBM437:      return "CP437";
+		case QUIRC_ECI_ISO_8859_2:  return "ISO-8859-2";
+		case QUIRC_ECI_ISO_8859_3:  return "ISO-8859-3";
+		case QUIRC_ECI_ISO_8859_4:  return "ISO-8859-4";
+		case QUIRC_ECI_ISO_8859_5:  return "ISO-8859-5";
+		case QUIRC_ECI_ISO_8859_6:  return "ISO-8859-6";
+		case QUIRC_ECI_ISO_8859_7:  return "ISO-8859-7";
+		case QUIRC_ECI_ISO_8859_8:  return "ISO-8859-8";
+		case QUIRC_ECI_ISO_8859_9:  return "ISO-8859-9";
+		case QUIRC_ECI_WINDOWS_874: return "CP874";
+		case QUIRC_ECI_ISO_8859_13: return "ISO-8859-13";
+		case QUIRC_ECI_ISO_8859_15: return "ISO-8859-15";
+		case QUIRC_ECI_SHIFT_JIS:   return "SHIFT_JIS";
+		case QUIRC_ECI_UTF_8:       return "UTF-8";
+	}
+
+	/* no (or an unknown) ECI */
+	if (qdata->data_type == QUIRC_DATA_TYPE_KANJI)
+		return "SHIFT_JIS";
+	if (nq_utf8_valid(qdata->payload, (size_t)qdata->payload_len))
+		return "UTF-8";
+	return "ISO-8859-1";
+}
+
+
+/* returns 1 when the len bytes at s are valid UTF-8, 0 otherwise */
+static int
+nq_utf8_valid(const uint8_t *s, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		uint8_t c = s[i];
+		size_t n;
+		uint32_t cp;
+
+		if (c < 0x80) {
+			i++;
+			continue;
+		} else if (c >= 0xc2 && c <= 0xdf) {
+			n = 1; cp = c & 0x1f;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2; cp = c & 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3; cp = c & 0x07;
+		} else {
+			return (0);
+		}
+		if (len - i <= n)
+			return (0);
+		for (size_t j = 1; j <= n; j++) {
+			if ((s[i + j] & 0xc0) != 0x80)
+				return (0);
+			cp = (cp << 6) | (s[i + j] & 0x3f);
+		}
+		/* overlong, surrogate or out of range */
+		if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+		    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+			return (0);
+		i += n + 1;
+	}
+
+	return (1);
+}
+
+
+/* returns the number of bytes written at out, at most 2 * len */
+static size_t
+nq_latin1_to_utf8(const uint8_t *in, size_t len, char *out)
+{
+	size_t o = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (in[i] < 0x80) {
+			out[o++] = (char)in[i];
+		} else {
+			out[o++] = (char)(0xc0 | (in[i] >> 6));
+			out[o++] = (char)(0x80 | (in[i] & 0x3f));
+		}
+	}
+
+	return (o);
+}
+
+
+/*
+ * Convert the len bytes at in from charset to UTF-8 into out, which must hold
+ * at least NQ_UTF8_MAX_RATIO * len bytes. The descriptor cached in conv is
+ * reused when it was opened for the same charset, and replaced otherwise.
+ *
+ * returns 0 on success setting out_len, -1 when charset is not supported.
+ */
+static int
+nq_iconv_to_utf8(struct nq_iconv *conv, const char *charset,
+    const uint8_t *in, size_t len, char *out, size_t *out_len)
+{
+	if (conv->charset == NULL || strcmp(conv->charset, charset) != 0) {
+		if (conv->cd != (iconv_t)-1)
+			iconv_close(conv->cd);
+		conv->cd = iconv_open("UTF-8", charset);
+		conv->charset = charset;
+	}
+	iconv_t cd = conv->cd;
+	if (cd == (iconv_t)-1)
+		return (-1);
+
+	char *inbuf = (char *)in, *outbuf = out;
+	size_t inleft = len, outleft = len * NQ_UTF8_MAX_RATIO;
+	while (inleft > 0) {
+		if (iconv(cd, &inbuf, &inleft, &outbuf, &outleft) != (size_t)-1)
+			break;
+		if (errno != EILSEQ && errno != EINVAL)
+			break;
+		/* invalid or truncated sequence, replace a byte by U+FFFD */
+		if (outleft < 3)
+			break;
+		memcpy(outbuf, "\xef\xbf\xbd", 3);
+		outbuf += 3; outleft -= 3;
+		inbuf++; inleft--;
+	}
+	/* flush, also resetting the shift state for the next code */
+	(void)iconv(cd, NULL, NULL, &outbuf, &outleft);
+
+	*out_len = (size_t)(outbuf - out);
+	return (0);
+}
+
+
+const char *
+nq_code_err(const struct nq_code *code)
+{
+	return (code->err);
+}
+
+
+int
+nq_code_version(const struct nq_code *code)
+{
+	return (code->qdata.version);
+}
+
+
+const char *
+nq_code_ecc_level_str(const struct nq_code *code)
+{
+	switch (code->qdata.ecc_level) {
+	case  QUIRC_ECC_LEVEL_M: return "M";
+	case  QUIRC_ECC_LEVEL_L: return "L";
+	case  QUIRC_ECC_LEVEL_H: return "H";
+	case  QUIRC_ECC_LEVEL_Q: return "Q";
+	}
+
+	return "?";
+}
+
+
+int
+nq_code_mask(const struct nq_code *code)
+{
+	return (code->qdata.mask);
+}
+
+
+const char *
+nq_code_mode_str(const struct nq_code *code)
+{
+	switch (code->qdata.data_type) {
+	case QUIRC_DATA_TYPE_NUMERIC: return "NUMERIC";
+	case QUIRC_DATA_TYPE_ALPHA:   return "ALNUM";
+	case QUIRC_DATA_TYPE_BYTE:    return "BYTE";
+	case QUIRC_DATA_TYPE_KANJI:   return "KANJI";
+	}
+
+	return "unknown";
+}
+
+
+const char *
+nq_code_eci_str(const struct nq_code *code)
+{
+	switch (code->qdata.eci) {
+		case QUIRC_ECI_ISO_8859_1:  return "ISO_8859_1";
+		case QUIRC_ECI_IBM437:      return "IBM437";
+		case QUIRC_ECI_ISO_8859_2:  return "ISO_8859_2";
+		case QUIRC_ECI_ISO_8859_3:  return "ISO_8859_3";
+		case QUIRC_ECI_ISO_8859_4:  return "ISO_8859_4";
+		case QUIRC_ECI_ISO_8859_5:  return "ISO_8859_5";
+		case QUIRC_ECI_ISO_8859_6:  return "ISO_8859_6";
+		case QUIRC_ECI_ISO_8859_7:  return "ISO_8859_7";
+		case QUIRC_ECI_ISO_8859_8:  return "ISO_8859_8";
+		case QUIRC_ECI_ISO_8859_9:  return "ISO_8859_9";
+		case QUIRC_ECI_WINDOWS_874: return "WINDOWS_874";
+		case QUIRC_ECI_ISO_8859_13: return "ISO_8859_13";
+		case QUIRC_ECI_ISO_8859_15: return "ISO_8859_15";
+		case QUIRC_ECI_SHIFT_JIS:   return "SHIFT_JIS";
+		case QUIRC_ECI_UTF_8:       return "UTF_8";
+	}
+	return NULL;
+}
+
+
+const uint8_t *
+nq_code_payload(const struct nq_code *code)
+{
+	return (code->qdata.payload);
+}
+
+
+size_t
+nq_code_payload_len(const struct nq_code *code)
+{
+	return (code->qdata.payload_len);
+}
+
+
+const char *
+nq_code_text(const struct nq_code *code)
+{
+	return (code->text);
+}
+
+
+size_t
+nq_code_text_len(const struct nq_code *code)
+{
+	return (code->text_len);
+}
+
+
+/* returns 0 on success, -1 on error */
+static int
+nq_load_image(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
+{
+	ctx->scale = 1;
+	ctx->rows.image = NULL; /* until the loader counts them */
+	ctx->bilevel = 0;
+	if (img_width > 0 && img_height > 0) {
+		return nq_load_raw(ctx, img, img_len, img_width, img_height);
+	}
+
+	switch (nq_sniff(img, img_len)) {
+	case NQ_FORMAT_PNG:
+		return nq_load_png(ctx, img, img_len);
+	case NQ_FORMAT_JPEG:
+		return nq_load_jpeg(ctx, img, img_len);
+	case NQ_FORMAT_PNM:
+		return nq_load_pnm(ctx, img, img_len);
+	case NQ_FORMAT_BMP:
+		return nq_load_bmp(ctx, img, img_len);
+	default:
+		return (-1);
+	}
+}
+
+
+/* tell the format of img from its signature */
+static enum nq_format
+nq_sniff(const uint8_t *img, size_t img_len)
+{
+	if (img_len >= PNG_BYTES_TO_CHECK &&
+	    png_sig_cmp((uint8_t *)img, (png_size_t)0, PNG_BYTES_TO_CHECK) == 0)
+		return (NQ_FORMAT_PNG);
+	/* SOI, which libjpeg expects first */
+	if (img_len >= 2 && img[0] == 0xFF && img[1] == 0xD8)
+		return (NQ_FORMAT_JPEG);
+	/* binary PBM, PGM, PPM and PAM (the plain text ones are not supported) */
+	if (img_len >= 2 && img[0] == 'P' && img[1] >= '4' && img[1] <= '7')
+		return (NQ_FORMAT_PNM);
+	if (img_len >= 2 && img[0] == 'B' && img[1] == 'M')
+		return (NQ_FORMAT_BMP);
+	return (NQ_FORMAT_UNKNOWN);
+}
+
+
+int
+nq_probe(const uint8_t *img, size_t img_len, struct nq_image_info *info)
+{
+	struct nq_pnm pnm;
+	struct nq_bmp bmp;
+
+	memset(info, 0, sizeof(*info));
+
+	switch (nq_sniff(img, img_len)) {
+	case NQ_FORMAT_PNG:
+		return nq_probe_png(img, img_len, info);
+	case NQ_FORMAT_JPEG:
+		return nq_probe_jpeg(img, img_len, info);
+	case NQ_FORMAT_PNM:
+		if (nq_pnm_parse(img, img_len, &pnm) < 0)
+			return (-1);
+		info->format   = pnm.format;
+		info->width    = pnm.width;
+		info->height   = pnm.height;
+		info->channels = pnm.channels;
+		return (0);
+	case NQ_FORMAT_BMP:
+		if (nq_bmp_parse(img, img_len, &bmp) < 0)
+			return (-1);
+		info->format   = "bmp";
+		info->width    = bmp.width;
+		info->height   = bmp.height;
+		/* palette images have one, like PNG ones */
+		info->channels = (bmp.bpp <= 8 ? 1 : bmp.bpp / 8);
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+
+/* where libpng is at in the image, see nq_png_read() */
+struct nq_png_src {
+	const uint8_t	*data;
+	size_t		 len;
+	size_t		 pos;
+};
+
+
+/*
+ * libpng read callback serving the image straight from memory, without the
+ * stdio locking and buffering a fmemopen(3) stream would cost.
+ */
+static void
+nq_png_read(png_structp png_ptr, png_bytep data, png_size_t len)
+{
+	struct nq_png_src *src = png_get_io_ptr(png_ptr);
+
+	if (len > src->len - src->pos)
+		png_error(png_ptr, "unexpected end of image");
+	memcpy(data, src->data + src->pos, len);
+	src->pos += len;
+}
+
+
+/* the png_read_info() part of nq_load_png() */
+static int
+nq_probe_png(const uint8_t *img, size_t img_len, struct nq_image_info *info)
+{
+	struct nq_png_src src = { .data = img, .len = img_len };
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	volatile int success = 0;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL)
+		goto out;
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL)
+		goto out;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+		goto out;
+
+	png_set_read_fn(png_ptr, &src, nq_png_read);
+	png_read_info(png_ptr, info_ptr);
+
+	info->format   = "png";
+	info->width    = png_get_image_width(png_ptr, info_ptr);
+	info->height   = png_get_image_height(png_ptr, info_ptr);
+	info->channels = png_get_channels(png_ptr, info_ptr);
+
+	success = 1;
+	/* FALLTHROUGH */
+out:
+	/* cleanup */
+	if (png_ptr != NULL) {
+		if (info_ptr != NULL)
+			png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+		else
+			png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+	}
+	return (success ? 0 : -1);
+}
+
+
+/*
+ * Set the transformations reading any color type as 8-bit grayscale, see
+ * http://www.libpng.org/pub/png/libpng-manual.txt
+ *
+ * Palette images are read as indices and 8-bit RGB(A) images as they are,
+ * nq_png_gray_row() computing the gray libpng would when it has no gamma to
+ * correct. Otherwise libpng converts the rows itself, one pass over them per
+ * transformation (palette to RGB, tRNS to alpha, strip alpha, RGB to gray).
+ *
+ * Non-interlaced 1-bit images are left packed instead, nq_bilevel_row()
+ * turning them into quirc pixels without any thresholding.
+ *
+ * returns the number of passes needed to read the image.
+ */
+static int
+nq_png_to_gray(png_structp png_ptr, png_infop info_ptr, struct nq_png_gray *gray)
+{
+	png_uint_32 trns;
+	png_byte color_type     = png_get_color_type(png_ptr, info_ptr);
+	png_byte bit_depth      = png_get_bit_depth(png_ptr, info_ptr);
+	int      interlace_type = png_get_interlace_type(png_ptr, info_ptr);
+
+	gray->passes   = 1;
+	gray->channels = 1;
+	gray->palette  = 0;
+	gray->bilevel  = 0;
+	if (interlace_type != PNG_INTERLACE_NONE)
+		gray->passes = png_set_interlace_handling(png_ptr);
+
+	if (color_type == PNG_COLOR_TYPE_PALETTE && nq_png_plain_luma(png_ptr, info_ptr)) {
+		png_colorp plte;
+		int nplte = 0;
+		/* libpng maps indices past the palette to black, so do we */
+		memset(gray->lut, 0, sizeof(gray->lut));
+		if (png_get_PLTE(png_ptr, info_ptr, &plte, &nplte) == 0)
+			nplte = 0;
+		for (int i = 0; i < nplte && i < 256; i++) {
+			png_color c = plte[i];
+			/* the coefficients sum to 1, leaving gray colors as they are */
+			gray->lut[i] = NQ_GRAY(c.red, c.green, c.blue);
+		}
+		/* Otsu would make the darker of two grays black, the other white */
+		if (bit_depth == 1 && gray->passes == 1 && gray->lut[0] != gray->lut[1]) {
+			gray->bilevel = 1;
+			gray->black   = (gray->lut[1] < gray->lut[0]);
+			return (1);
+		}
+		/* the tRNS alpha would be stripped anyway */
+		if (bit_depth < 8)
+			png_set_packing(png_ptr);
+		gray->palette = 1;
+		return (gray->passes);
+	}
+
+	/* interlaced rows would need a whole RGB image to be combined into */
+	if ((color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA) &&
+	    bit_depth == 8 && gray->passes == 1 && nq_png_plain_luma(png_ptr, info_ptr)) {
+		gray->channels = (color_type == PNG_COLOR_TYPE_RGB ? 3 : 4);
+		return (1);
+	}
+
+	/* 0 is black, and the tRNS alpha would be stripped anyway */
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth == 1 && gray->passes == 1) {
+		gray->bilevel = 1;
+		gray->black   = 0;
+		return (1);
+	}
+
+	// PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+	if ((trns = png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)))
+		png_set_tRNS_to_alpha(png_ptr);
+
+	if (bit_depth == 16)
+#if PNG_LIBPNG_VER >= 10504
+		png_set_scale_16(png_ptr);
+#else
+		png_set_strip_16(png_ptr);
+#endif
+
+	if ((trns) || color_type & PNG_COLOR_MASK_ALPHA)
+		png_set_strip_alpha(png_ptr);
+
+	if (color_type == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png_ptr);
+
+	if (color_type == PNG_COLOR_TYPE_PALETTE ||
+	    color_type == PNG_COLOR_TYPE_RGB ||
+	    color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
+		png_set_rgb_to_gray_fixed(png_ptr, 1, -1, -1);
+	}
+
+	return (gray->passes);
+}
+
+
+/*
+ * returns non-zero when libpng would convert the colors of info_ptr to gray
+ * with its default coefficients and no gamma correction.
+ */
+static int
+nq_png_plain_luma(png_structp png_ptr, png_infop info_ptr)
+{
+	png_fixed_point gamma;
+
+	/* the coefficients would be derived from the chromaticities */
+	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_cHRM))
+		return (0);
+	/* as png_gamma_significant() */
+	if (png_get_gAMA_fixed(png_ptr, info_ptr, &gamma) &&
+	    (gamma < PNG_FP_1 - 5000 || gamma > PNG_FP_1 + 5000))
+		return (0);
+	return (1);
+}
+
+
+/*
+ * Turn the n pixels at src, read as set up by nq_png_to_gray(), into
+ * grayscale at dst. src and dst may be the same row for palette images only.
+ */
+static void
+nq_png_gray_row(const struct nq_png_gray *gray, uint8_t *dst, const uint8_t *src, size_t n)
+{
+	if (gray->palette) {
+		for (size_t i = 0; i < n; i++)
+			dst[i] = gray->lut[src[i]];
+	} else if (dst != src) {
+		nq_gray_row(dst, src, n, gray->channels, 0);
+	}
+}
+
+
+/*
+ * Queue the len bytes at data after the ones not consumed yet, skipping what
+ * libjpeg asked to.
+ *
+ * returns 0 on success, -1 when out of memory.
+ */
+static int
+nq_incremental_append(struct nq_incremental *inc, const uint8_t *data, size_t len)
+{
+	size_t skip = (inc->skip < len ? inc->skip : len);
+	data     += skip;
+	len      -= skip;
+	inc->skip -= skip;
+
+	size_t keep = inc->src.bytes_in_buffer;
+	size_t from = (keep > 0 ? (size_t)(inc->src.next_input_byte - inc->buf) : 0);
+	if (keep + len > inc->cap) {
+		size_t cap = (keep + len > 2 * inc->cap ? keep + len : 2 * inc->cap);
+		uint8_t *buf = realloc(inc->buf, cap);
+		if (buf == NULL)
+			return (-1);
+		inc->buf = buf;
+		inc->cap = cap;
+	}
+	memmove(inc->buf, inc->buf + from, keep);
+	if (len > 0)
+		memcpy(inc->buf + keep, data, len);
+	inc->src.next_input_byte = inc->buf;
+	inc->src.bytes_in_buffer = keep + len;
+	return (0);
+}
+
+
+/* release everything held by inc, which may be called again afterwards */
+static void
+nq_incremental_release(struct nq_incremental *inc)
+{
+	if (inc->png_ptr != NULL) {
+		if (inc->info_ptr != NULL)
+			png_destroy_read_struct(&inc->png_ptr, &inc->info_ptr, (png_infopp)NULL);
+		else
+			png_destroy_read_struct(&inc->png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+	}
+	jpeg_destroy_decompress(&inc->dinfo);
+	if (inc->ctx.q != NULL)
+		quirc_destroy(inc->ctx.q);
+	inc->ctx.q = NULL;
+	nq_release(&inc->ctx);
+	free(inc->buf);
+	inc->buf = NULL;
+	inc->cap = 0;
+	inc->src.next_input_byte = NULL;
+	inc->src.bytes_in_buffer = 0;
+}
+
+
+/*
+ * Feed libpng with every byte received. libpng buffers what it can't use
+ * yet itself.
+ *
+ * returns 0 on success, -1 on error.
+ */
+static int
+nq_incremental_png(struct nq_incremental *inc)
+{
+	if (setjmp(png_jmpbuf(inc->png_ptr))) {
+		inc->state = NQ_INCREMENTAL_FAILED;
+		return (-1);
+	}
+
+	size_t len = inc->src.bytes_in_buffer;
+	inc->src.bytes_in_buffer = 0;
+	png_process_data(inc->png_ptr, inc->info_ptr, (png_bytep)inc->src.next_input_byte, len);
+	return (0);
+}
+
+
+/* the png_read_info() part of nq_load_png(), as a libpng callback */
+static void
+nq_incremental_png_info(png_structp png_ptr, png_infop info_ptr)
+{
+	struct nq_incremental *inc = png_get_progressive_ptr(png_ptr);
+	struct nq_ctx *ctx = &inc->ctx;
+
+	if (nq_check_size(ctx, png_get_image_width(png_ptr, info_ptr),
+	    png_get_image_height(png_ptr, info_ptr)) < 0)
+		png_error(png_ptr, ctx->err);
+
+	(void)nq_png_to_gray(png_ptr, info_ptr, &inc->gray);
+	png_read_update_info(png_ptr, info_ptr);
+
+	int width  = png_get_image_width(png_ptr, info_ptr);
+	int height = png_get_image_height(png_ptr, info_ptr);
+	if (png_get_rowbytes(png_ptr, info_ptr) != (inc->gray.bilevel ?
+	    NQ_BILEVEL_STRIDE(width) : (size_t)width * inc->gray.channels))
+		png_error(png_ptr, "unexpected row size");
+
+	/* libpng keeps about two rows of up to 8 bytes per source pixel */
+	if (nq_reserve(ctx, width, height, 2 * (size_t)width * 8) < 0)
+		png_error(png_ptr, ctx->err);
+	if (nq_resize(ctx->q, width, height) < 0)
+		png_error(png_ptr, "quirc_resize()");
+	inc->width = width;
+	if (inc->gray.bilevel) {
+		inc->pixels  = quirc_begin_bilevel(ctx->q, NULL, NULL);
+		ctx->bilevel = 1;
+		return;
+	}
+	inc->image = quirc_begin(ctx->q, NULL, NULL);
+	/* the rows of interlaced images land several times */
+	if (png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE)
+		nq_rows_begin(&ctx->rows, inc->image, width, height, 0);
+}
+
+
+/* store a decoded row, combining it with its previous passes if any */
+static void
+nq_incremental_png_row(png_structp png_ptr, png_bytep row, png_uint_32 y, int pass)
+{
+	struct nq_incremental *inc = png_get_progressive_ptr(png_ptr);
+
+	(void)pass;
+	if (row == NULL)
+		return;
+	if (inc->gray.bilevel) {
+		nq_bilevel_row(inc->pixels + (size_t)y * inc->width, row, inc->width, inc->gray.black);
+		return;
+	}
+	uint8_t *out = inc->image + (size_t)y * inc->width;
+	if (inc->gray.passes == 1)
+		nq_png_gray_row(&inc->gray, out, row, inc->width);
+	else
+		png_progressive_combine_row(png_ptr, out, row);
+	nq_rows_landed(&inc->ctx.rows, y + 1);
+}
+
+
+static void
+nq_incremental_png_end(png_structp png_ptr, png_infop info_ptr)
+{
+	struct nq_incremental *inc = png_get_progressive_ptr(png_ptr);
+
+	(void)info_ptr;
+	/* the indices of interlaced images are final once every pass is read */
+	if (inc->gray.passes > 1 && inc->gray.palette) {
+		nq_png_gray_row(&inc->gray, inc->image, inc->image,
+		    (size_t)inc->width * png_get_image_height(png_ptr, inc->info_ptr));
+	}
+	inc->state = NQ_INCREMENTAL_LOADED;
+}
+
+
+/*
+ * Run the nq_load_jpeg() steps that the bytes received allow, libjpeg
+ * suspending (and backtracking to the last step it completed) whenever it
+ * runs out of bytes.
+ *
+ * returns 0 on success, -1 on error.
+ */
+static int
+nq_incremental_jpeg(struct nq_incremental *inc)
+{
+	struct jpeg_decompress_struct *dinfo = &inc->dinfo;
+	struct nq_ctx *ctx = &inc->ctx;
+
+	if (setjmp(inc->jerr.env))
+		goto fail;
+
+	switch (inc->state) {
+	case NQ_INCREMENTAL_JPEG_HEADER:
+		if (jpeg_read_header(dinfo, TRUE) == JPEG_SUSPENDED)
+			return (0);
+		if (nq_check_size(ctx, dinfo->image_width, dinfo->image_height) < 0)
+			goto fail;
+		nq_jpeg_setup(dinfo, ctx->flags, 1);
+		if (nq_reserve(ctx, dinfo->output_width, dinfo->output_height, nq_jpeg_extra(dinfo, 1)) < 0)
+			goto fail;
+		if (nq_resize(ctx->q, dinfo->output_width, dinfo->output_height) < 0)
+			goto fail;
+		inc->image = quirc_begin(ctx->q, NULL, NULL);
+		nq_rows_begin(&ctx->rows, inc->image, dinfo->output_width, dinfo->output_height, 0);
+		inc->state = NQ_INCREMENTAL_JPEG_START;
+		/* FALLTHROUGH */
+	case NQ_INCREMENTAL_JPEG_START:
+		if (!jpeg_start_decompress(dinfo))
+			return (0);
+		if (dinfo->output_components != 1)
+			goto fail;
+		inc->state = NQ_INCREMENTAL_JPEG_ROWS;
+		/* FALLTHROUGH */
+	case NQ_INCREMENTAL_JPEG_ROWS:
+		if (nq_jpeg_read_rows(dinfo, inc->image, &ctx->rows) == -1)
+			return (0);
+		inc->state = NQ_INCREMENTAL_JPEG_FINISH;
+		/* FALLTHROUGH */
+	case NQ_INCREMENTAL_JPEG_FINISH:
+		if (!jpeg_finish_decompress(dinfo))
+			return (0);
+		inc->state = NQ_INCREMENTAL_LOADED;
+		/* FALLTHROUGH */
+	default:
+		return (0);
+	}
+
+fail:
+	inc->state = NQ_INCREMENTAL_FAILED;
+	return (-1);
+}
+
+
+static void
+nq_incremental_jpeg_init(j_decompress_ptr dinfo)
+{
+	(void)dinfo;
+}
+
+
+/*
+ * Suspend libjpeg until more bytes are received or, once they all were,
+ * insert a fake EOI marker like jpeg_mem_src() does.
+ */
+static boolean
+nq_incremental_jpeg_fill(j_decompress_ptr dinfo)
+{
+	static const JOCTET eoi[] = { 0xFF, JPEG_EOI };
+	struct nq_incremental *inc = (struct nq_incremental *)
+	    ((uint8_t *)dinfo - offsetof(struct nq_incremental, dinfo));
+
+	if (!inc->eof)
+		return (FALSE);
+	dinfo->src->next_input_byte = eoi;
+	dinfo->src->bytes_in_buffer = sizeof(eoi);
+	return (TRUE);
+}
+
+
+static void
+nq_incremental_jpeg_skip(j_decompress_ptr dinfo, long len)
+{
+	struct jpeg_source_mgr *src = dinfo->src;
+	struct nq_incremental *inc = (struct nq_incremental *)
+	    ((uint8_t *)dinfo - offsetof(struct nq_incremental, dinfo));
+
+	if (len <= 0)
+		return;
+	if ((size_t)len > src->bytes_in_buffer) {
+		inc->skip += (size_t)len - src->bytes_in_buffer;
+		src->next_input_byte += src->bytes_in_buffer;
+		src->bytes_in_buffer = 0;
+	} else {
+		src->next_input_byte += len;
+		src->bytes_in_buffer -= (size_t)len;
+	}
+}
+
+
+/* how many rows nq_load_png() asks libpng for at once */
+#define	NQ_PNG_ROWS_PER_READ	16
+
+/* hacked from quirc/tests/dbgutil.c */
+static int
+nq_load_png(struct nq_ctx *ctx, const uint8_t *img, size_t img_len)
+{
+	int width, height, rowbytes;
 	png_structp png_ptr = NULL;
 	png_infop info_ptr = NULL;
+	png_bytep rows[NQ_PNG_ROWS_PER_READ];
+	struct nq_png_src src = { .data = img, .len = img_len };
+	struct nq_png_gray gray;
 	uint8_t *image;
-	FILE *infile = NULL;
+	quirc_pixel_t *pixels; /* instead of image for bilevel ones */
+	uint8_t * volatile color = NULL; /* RGB(A) or 1-bit rows being converted */
 	volatile int success = 0;
 
-	infile = fmemopen((uint8_t *)img, img_len, "r");
-	if (infile == NULL)
-		goto out;
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL)
+		goto out;
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL)
+		goto out;
+
+	if (setjmp(png_jmpbuf(png_ptr)))
+		goto out;
+
+	png_set_read_fn(png_ptr, &src, nq_png_read);
+
+	png_read_info(png_ptr, info_ptr);
+
+	/* before libpng allocates anything for the image rows */
+	if (nq_check_size(ctx, png_get_image_width(png_ptr, info_ptr),
+	    png_get_image_height(png_ptr, info_ptr)) < 0)
+		goto out;
+
+	(void)nq_png_to_gray(png_ptr, info_ptr, &gray);
+	png_read_update_info(png_ptr, info_ptr);
+
+	width    = png_get_image_width(png_ptr, info_ptr);
+	height   = png_get_image_height(png_ptr, info_ptr);
+	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+	if ((size_t)rowbytes != (gray.bilevel ? NQ_BILEVEL_STRIDE(width) :
+	    (size_t)width * gray.channels)) {
+		goto out;
+	}
+
+	/* libpng keeps about two rows of up to 8 bytes per source pixel */
+	size_t extra = 2 * (size_t)width * 8;
+	if (gray.channels > 1 || gray.bilevel)
+		extra += (size_t)rowbytes * NQ_PNG_ROWS_PER_READ;
+	if (nq_reserve(ctx, width, height, extra) < 0)
+		goto out;
+
+	if (nq_resize(ctx->q, width, height) < 0)
+		goto out;
+
+	if (gray.channels > 1 || gray.bilevel) {
+		color = malloc((size_t)rowbytes * NQ_PNG_ROWS_PER_READ);
+		if (color == NULL)
+			goto out;
+	}
+
+	image  = quirc_begin(ctx->q, NULL, NULL);
+	pixels = (gray.bilevel ? quirc_begin_bilevel(ctx->q, NULL, NULL) : NULL);
+	ctx->bilevel = gray.bilevel;
+	/* the rows of interlaced images land several times */
+	if (gray.passes == 1 && !gray.bilevel)
+		nq_rows_begin(&ctx->rows, image, width, height, 1);
+
+	for (int pass = 0; pass < gray.passes; pass++) {
+		for (int y = 0; y < height; y += NQ_PNG_ROWS_PER_READ) {
+			int n = height - y;
+			if (n > NQ_PNG_ROWS_PER_READ)
+				n = NQ_PNG_ROWS_PER_READ;
+			for (int i = 0; i < n; i++) {
+				rows[i] = (color != NULL ? color + (size_t)i * rowbytes :
+				    image + (size_t)(y + i) * width);
+			}
+			png_read_rows(png_ptr, rows, NULL, n);
+			if (gray.bilevel) {
+				for (int i = 0; i < n; i++)
+					nq_bilevel_row(pixels + (size_t)(y + i) * width, rows[i], width, gray.black);
+			} else if (gray.passes == 1 && (gray.palette || color != NULL)) {
+				for (int i = 0; i < n; i++)
+					nq_png_gray_row(&gray, image + (size_t)(y + i) * width, rows[i], width);
+			}
+			nq_rows_landed(&ctx->rows, y + n);
+		}
+	}
+	/* the indices of interlaced images are final once every pass is read */
+	if (gray.passes > 1 && gray.palette)
+		nq_png_gray_row(&gray, image, image, (size_t)width * height);
+
+	png_read_end(png_ptr, info_ptr);
+
+	success = 1;
+	/* FALLTHROUGH */
+out:
+	/* cleanup */
+	free(color);
+	if (png_ptr != NULL) {
+		if (info_ptr != NULL)
+			png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+		else
+			png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+	}
+	return (success ? 0 : -1);
+}
+
+
+static void
+nq_error_exit(struct jpeg_common_struct *com)
+{
+	struct nq_jpeg_error *err = (struct nq_jpeg_error *)com->err;
+
+	longjmp(err->env, 0);
+}
+
+
+static struct jpeg_error_mgr *
+nq_error_mgr(struct nq_jpeg_error *err)
+{
+	jpeg_std_error(&err->base);
+	err->base.error_exit = nq_error_exit;
+	return &err->base;
+}
+
+
+/* the jpeg_read_header() part of nq_load_jpeg() */
+static int
+nq_probe_jpeg(const uint8_t *img, size_t img_len, struct nq_image_info *info)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct nq_jpeg_error err;
+
+	memset(&dinfo, 0, sizeof(dinfo));
+	dinfo.err = nq_error_mgr(&err);
+
+	if (setjmp(err.env))
+		goto fail;
+
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, img, img_len);
+	jpeg_read_header(&dinfo, TRUE);
+
+	info->format   = "jpeg";
+	info->width    = dinfo.image_width;
+	info->height   = dinfo.image_height;
+	info->channels = dinfo.num_components;
+
+	jpeg_destroy_decompress(&dinfo);
+	return 0;
+
+fail:
+	jpeg_destroy_decompress(&dinfo);
+	return -1;
+}
+
+
+/*
+ * rows asked per jpeg_read_scanlines() call. libjpeg returns as many as its
+ * upsampler has ready, that is max_v_samp_factor (up to 4) rows for color
+ * images, more than their rec_outbuf_height of 1.
+ */
+#define	NQ_JPEG_MAX_ROWS	16
+/* the smallest band worth its own thread, in MCU rows */
+#define	NQ_JPEG_BAND_MIN_ROWS	16
+/* markers not defined by jpeglib.h */
+#define	NQ_JPEG_SOF0	0xC0 /* baseline */
+#define	NQ_JPEG_SOF1	0xC1 /* extended sequential */
+#define	NQ_JPEG_SOI	0xD8
+#define	NQ_JPEG_SOS	0xDA
+
+/* a horizontal band of a JPEG image, see nq_load_jpeg_bands() */
+struct nq_jpeg_band {
+	uint8_t		*data; /* standalone JPEG stream of the band */
+	size_t		 len;
+	int		 flags; /* NQ_DECODE_* */
+	unsigned int	 scale;
+	uint8_t		*out; /* where its first row goes in the image */
+	JDIMENSION	 width; /* expected output dimensions */
+	JDIMENSION	 height;
+	struct nq_rows	 rows; /* its own histogram */
+	pthread_t	 thread;
+	int		 started;
+	int		 ok;
+};
+
+
+static int
+nq_load_jpeg(struct nq_ctx *ctx, const uint8_t *img, size_t img_len)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct nq_jpeg_error err;
+	uint8_t *image;
+
+	memset(&dinfo, 0, sizeof(dinfo));
+	dinfo.err = nq_error_mgr(&err);
+
+	if (setjmp(err.env))
+		goto fail;
+
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, img, img_len);
+
+	jpeg_read_header(&dinfo, TRUE);
+	if (nq_check_size(ctx, dinfo.image_width, dinfo.image_height) < 0)
+		goto fail;
+
+	/* let the IDCT downscale big images, see nq_recognize() */
+	ctx->scale = nq_jpeg_scale(ctx, dinfo.image_width, dinfo.image_height);
+	nq_jpeg_setup(&dinfo, ctx->flags, ctx->scale);
+
+	/* decoding in bands also needs a copy of the image */
+	unsigned int threads = nq_jpeg_threads(&dinfo);
+	size_t extra = nq_jpeg_extra(&dinfo, threads);
+	if (threads > 1)
+		extra += img_len;
+	if (nq_reserve(ctx, dinfo.output_width, dinfo.output_height, extra) < 0)
+		goto fail;
+
+	if (nq_resize(ctx->q, dinfo.output_width, dinfo.output_height) < 0)
+		goto fail;
+
+	image = quirc_begin(ctx->q, NULL, NULL);
+
+	if (threads > 1) {
+		nq_rows_begin(&ctx->rows, image, dinfo.output_width, dinfo.output_height, 0);
+		if (nq_load_jpeg_bands(&dinfo, ctx->flags, img, img_len, &ctx->rows, threads) == 0) {
+			nq_load_count(&nq_load_counters.stats.jpeg_bands);
+			goto done;
+		}
+	}
+
+	jpeg_start_decompress(&dinfo);
+
+	if (dinfo.output_components != 1)
+		goto fail;
+
+	nq_rows_begin(&ctx->rows, image, dinfo.output_width, dinfo.output_height, 1);
+	if (nq_jpeg_read_rows(&dinfo, image, &ctx->rows) < 0)
+		goto fail;
+
+	jpeg_finish_decompress(&dinfo);
+done:
+	if (ctx->flags & NQ_DECODE_JPEG_FAST)
+		nq_load_count(&nq_load_counters.stats.jpeg_fast);
+	jpeg_destroy_decompress(&dinfo);
+	return 0;
+
+fail:
+	jpeg_destroy_decompress(&dinfo);
+	return -1;
+}
+
+
+/*
+ * What libjpeg needs besides the output image when threads decode dinfo: it
+ * buffers a few MCU rows of every component, or all of their coefficients
+ * for progressive images.
+ */
+static size_t
+nq_jpeg_extra(const struct jpeg_decompress_struct *dinfo, unsigned int threads)
+{
+	size_t components = (size_t)dinfo->num_components;
+
+	if (jpeg_has_multiple_scans((j_decompress_ptr)dinfo))
+		return ((size_t)dinfo->image_width * dinfo->image_height * components * sizeof(JCOEF));
+	return ((size_t)dinfo->image_width * components * DCTSIZE * 4 * threads);
+}
+
+
+/* set the decompression parameters of dinfo, once its header is read */
+static void
+nq_jpeg_setup(struct jpeg_decompress_struct *dinfo, int flags, unsigned int scale)
+{
+	dinfo->output_components = 1;
+	dinfo->out_color_space = JCS_GRAYSCALE;
+
+	if (flags & NQ_DECODE_JPEG_FAST) {
+		dinfo->dct_method          = JDCT_IFAST;
+		dinfo->do_fancy_upsampling = FALSE;
+		dinfo->do_block_smoothing  = FALSE;
+	}
+
+	dinfo->scale_num   = 1;
+	dinfo->scale_denom = scale;
+	jpeg_calc_output_dimensions(dinfo);
+}
+
+
+/*
+ * Read every row of the started dinfo into out, in batches of up to
+ * NQ_JPEG_MAX_ROWS rows, counting them into rows (if any) as they land.
+ *
+ * returns 0 on success, -1 on error.
+ */
+static int
+nq_jpeg_read_rows(struct jpeg_decompress_struct *dinfo, uint8_t *out, struct nq_rows *rows)
+{
+	while (dinfo->output_scanline < dinfo->output_height) {
+		JSAMPROW scanlines[NQ_JPEG_MAX_ROWS];
+		JDIMENSION n = dinfo->output_height - dinfo->output_scanline;
+
+		if (n > NQ_JPEG_MAX_ROWS)
+			n = NQ_JPEG_MAX_ROWS;
+		for (JDIMENSION i = 0; i < n; i++)
+			scanlines[i] = out + (size_t)(dinfo->output_scanline + i) * dinfo->output_width;
+		if (jpeg_read_scanlines(dinfo, scanlines, n) == 0)
+			return (-1);
+		if (rows != NULL)
+			nq_rows_landed(rows, dinfo->output_scanline);
+	}
+	return (0);
+}
+
+
+/*
+ * How many threads should decode the image of dinfo, 1 unless it is made of
+ * a single sequential scan with restart markers, see nq_load_jpeg_bands().
+ */
+static unsigned int
+nq_jpeg_threads(const struct jpeg_decompress_struct *dinfo)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	unsigned int threads = nq_limits.jpeg_threads;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	if (threads <= 1 || dinfo->restart_interval == 0 ||
+	    jpeg_has_multiple_scans((j_decompress_ptr)dinfo) ||
+	    dinfo->comps_in_scan != dinfo->num_components)
+		return (1);
+	/* only the luma of color images is decoded, see nq_jpeg_setup() */
+	if (dinfo->num_components != 1 && dinfo->jpeg_color_space != JCS_YCbCr)
+		return (1);
+	return (threads);
+}
+
+
+/*
+ * Decode the image of dinfo (whose header was read from img, and set up
+ * according to flags) into the counted rows, in horizontal bands on up to
+ * threads threads. Each band counts its own histogram.
+ *
+ * Restart markers reset the entropy decoder state, so that each band can be
+ * decoded on its own as a JPEG stream made of the image header (with the
+ * band height) followed by a run of restart intervals. Bands start at
+ * multiples of 8 intervals, so that their restart markers are numbered from
+ * RST0 as libjpeg expects. Only the luma is decoded, so there is no chroma
+ * upsampling across band edges and the result is the same as decoding the
+ * whole image at once.
+ *
+ * returns 0 on success, -1 when the image can't be split or a band could not
+ * be decoded.
+ */
+static int
+nq_load_jpeg_bands(const struct jpeg_decompress_struct *dinfo, int flags,
+    const uint8_t *img, size_t img_len, struct nq_rows *rows, unsigned int threads)
+{
+	struct nq_jpeg_band *bands = NULL;
+	uint8_t *image = (uint8_t *)rows->image;
+	size_t *rst = NULL, *splits = NULL;
+	size_t pos, sof = 0, data = 0, end, nbands = 0;
+	int ret = -1;
+
+	/* find the frame header and the entropy-coded data start */
+	if (img_len < 4 || img[0] != 0xFF || img[1] != NQ_JPEG_SOI)
+		return (-1);
+	for (pos = 2; data == 0; ) {
+		if (pos + 4 > img_len || img[pos] != 0xFF)
+			return (-1);
+		if (img[pos + 1] == 0xFF) {
+			pos++; /* fill byte */
+			continue;
+		}
+		int marker = img[pos + 1];
+		size_t len = ((size_t)img[pos + 2] << 8) | img[pos + 3];
+		if (len < 2 || pos + 2 + len > img_len)
+			return (-1);
+		if (marker == NQ_JPEG_SOF0 || marker == NQ_JPEG_SOF1)
+			sof = pos;
+		else if (marker == NQ_JPEG_SOS)
+			data = pos + 2 + len;
+		pos += 2 + len;
+	}
+	if (sof == 0 || sof + 9 > data)
+		return (-1);
+
+	/* the MCU grid, see jdinput.c */
+	size_t mcu_w = DCTSIZE, mcu_h = DCTSIZE;
+	if (dinfo->num_components > 1) {
+		mcu_w *= (size_t)dinfo->max_h_samp_factor;
+		mcu_h *= (size_t)dinfo->max_v_samp_factor;
+	}
+	size_t mcus_per_row = (dinfo->image_width + mcu_w - 1) / mcu_w;
+	size_t mcu_rows = (dinfo->image_height + mcu_h - 1) / mcu_h;
+	size_t interval = dinfo->restart_interval;
+	size_t nsegs = (mcus_per_row * mcu_rows + interval - 1) / interval;
+
+	/*
+	 * check that every restart marker is there before allocating their
+	 * offsets, nsegs being only what the header claims.
+	 */
+	if (nq_jpeg_restarts(img, img_len, data, nsegs - 1, NULL, &end) < 0)
+		goto out;
+	rst = malloc(nsegs * sizeof(size_t));
+	if (rst == NULL)
+		goto out;
+	(void)nq_jpeg_restarts(img, img_len, data, nsegs - 1, rst, &end);
+
+	/* split at MCU rows where a run of 8 restart intervals starts */
+	splits = malloc((threads + 1) * sizeof(size_t));
+	if (splits == NULL)
+		goto out;
+	splits[0] = 0;
+	for (unsigned int i = 1; i < threads; i++) {
+		size_t row = i * mcu_rows / threads;
+		if (row < splits[nbands] + NQ_JPEG_BAND_MIN_ROWS)
+			row = splits[nbands] + NQ_JPEG_BAND_MIN_ROWS;
+		while (row + NQ_JPEG_BAND_MIN_ROWS <= mcu_rows &&
+		    (row * mcus_per_row % interval != 0 || row * mcus_per_row / interval % 8 != 0))
+			row++;
+		if (row + NQ_JPEG_BAND_MIN_ROWS > mcu_rows)
+			break;
+		splits[++nbands] = row;
+	}
+	splits[++nbands] = mcu_rows;
+	if (nbands < 2)
+		goto out;
+
+	bands = calloc(nbands, sizeof(struct nq_jpeg_band));
+	if (bands == NULL)
+		goto out;
+	for (size_t i = 0; i < nbands; i++) {
+		struct nq_jpeg_band *band = bands + i;
+		size_t s0 = splits[i] * mcus_per_row / interval;
+		size_t s1 = (i + 1 == nbands ? nsegs : splits[i + 1] * mcus_per_row / interval);
+		size_t from = (s0 == 0 ? data : rst[s0 - 1] + 2);
+		size_t to   = (s1 == nsegs ? end : rst[s1 - 1]);
+		size_t y0 = splits[i] * mcu_h;
+		size_t y1 = (i + 1 == nbands ? dinfo->image_height : splits[i + 1] * mcu_h);
+
+		band->len = data + (to - from) + 2;
+		band->data = malloc(band->len);
+		if (band->data == NULL)
+			goto out;
+		memcpy(band->data, img, data);
+		band->data[sof + 5] = (uint8_t)((y1 - y0) >> 8);
+		band->data[sof + 6] = (uint8_t)(y1 - y0);
+		memcpy(band->data + data, img + from, to - from);
+		band->data[band->len - 2] = 0xFF;
+		band->data[band->len - 1] = JPEG_EOI;
+
+		band->flags  = flags;
+		band->scale  = dinfo->scale_denom;
+		band->width  = dinfo->output_width;
+		band->height = (JDIMENSION)((y1 - y0 + band->scale - 1) / band->scale);
+		band->out    = image + y0 / band->scale * dinfo->output_width;
+	}
+
+	/* the first band is decoded by this thread */
+	for (size_t i = 1; i < nbands; i++) {
+		bands[i].started = (pthread_create(&bands[i].thread, NULL,
+		    nq_jpeg_band_decode, bands + i) == 0);
+	}
+	(void)nq_jpeg_band_decode(bands);
+	ret = 0;
+	for (size_t i = 0; i < nbands; i++) {
+		if (i > 0 && bands[i].started)
+			(void)pthread_join(bands[i].thread, NULL);
+		else if (i > 0)
+			(void)nq_jpeg_band_decode(bands + i);
+		if (!bands[i].ok)
+			ret = -1;
+	}
+	if (ret == 0) {
+		for (size_t i = 0; i < nbands; i++) {
+			for (int v = 0; v < 256; v++)
+				rows->counts[0][v] += bands[i].rows.histogram[v];
+		}
+		rows->counted = rows->height;
+	}
+
+	/* FALLTHROUGH */
+out:
+	/* cleanup */
+	if (bands != NULL) {
+		for (size_t i = 0; i < nbands; i++)
+			free(bands[i].data);
+		free(bands);
+	}
+	free(splits);
+	free(rst);
+	return (ret);
+}
+
+
+/*
+ * Walk the entropy-coded data of img starting at data, expecting exactly
+ * count restart markers numbered in sequence, and store their offsets into
+ * rst (unless NULL) and the scan end offset into *end.
+ *
+ * returns 0 on success, -1 when the markers don't match or the scan is
+ * truncated.
+ */
+static int
+nq_jpeg_restarts(const uint8_t *img, size_t img_len, size_t data, size_t count,
+    size_t *rst, size_t *end)
+{
+	size_t pos, nrst = 0;
+
+	for (pos = data; ; pos++) {
+		const uint8_t *ff = memchr(img + pos, 0xFF, img_len - pos);
+		if (ff == NULL || (size_t)(ff - img) + 1 >= img_len)
+			return (-1);
+		pos = (size_t)(ff - img);
+		uint8_t marker = img[pos + 1];
+		if (marker == 0x00) {
+			pos++; /* stuffed byte */
+		} else if (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7) {
+			if (nrst == count || marker != JPEG_RST0 + nrst % 8)
+				return (-1);
+			if (rst != NULL)
+				rst[nrst] = pos;
+			nrst++;
+			pos++;
+		} else if (marker != 0xFF) {
+			break; /* end of the scan */
+		}
+	}
+	*end = pos;
+	return (nrst == count ? 0 : -1);
+}
+
 
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (png_ptr == NULL)
+/* decode a nq_jpeg_band, as a pthread start routine */
+static void *
+nq_jpeg_band_decode(void *arg)
+{
+	struct nq_jpeg_band *band = arg;
+	struct jpeg_decompress_struct dinfo;
+	struct nq_jpeg_error err;
+
+	memset(&dinfo, 0, sizeof(dinfo));
+	dinfo.err = nq_error_mgr(&err);
+
+	if (setjmp(err.env))
 		goto out;
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL)
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, band->data, band->len);
+
+	jpeg_read_header(&dinfo, TRUE);
+	nq_jpeg_setup(&dinfo, band->flags, band->scale);
+	jpeg_start_decompress(&dinfo);
+
+	if (dinfo.output_components != 1 || dinfo.output_width != band->width ||
+	    dinfo.output_height != band->height)
 		goto out;
 
-	if (setjmp(png_jmpbuf(png_ptr)))
+	nq_rows_begin(&band->rows, band->out, band->width, band->height, 0);
+	if (nq_jpeg_read_rows(&dinfo, band->out, &band->rows) < 0 ||
+	    nq_rows_end(&band->rows) == NULL)
 		goto out;
 
-	png_init_io(png_ptr, infile);
+	jpeg_finish_decompress(&dinfo);
+	band->ok = 1;
+	/* FALLTHROUGH */
+out:
+	jpeg_destroy_decompress(&dinfo);
+	return (NULL);
+}
+
+/* the largest PNM or BMP image width and height, as JPEG ones */
+#define	NQ_MAX_DIMENSION	65535
 
-	png_read_info(png_ptr, info_ptr);
+static int
+nq_load_pnm(struct nq_ctx *ctx, const uint8_t *img, size_t img_len)
+{
+	struct nq_pnm pnm;
+
+	if (nq_pnm_parse(img, img_len, &pnm) < 0)
+		return (-1);
+	if (nq_check_size(ctx, pnm.width, pnm.height) < 0)
+		return (-1);
+
+	/* 8-bit samples up to 255 and PBM bits are converted as they are */
+	size_t extra = 0;
+	if (pnm.depth == 16 || (pnm.depth == 8 && pnm.maxval != 255))
+		extra = pnm.width * pnm.channels;
+	if (nq_reserve(ctx, pnm.width, pnm.height, extra) < 0)
+		return (-1);
+	if (nq_resize(ctx->q, pnm.width, pnm.height) < 0)
+		return (-1);
+
+	if (pnm.depth == 1) {
+		quirc_pixel_t *pixels = quirc_begin_bilevel(ctx->q, NULL, NULL);
+		for (size_t y = 0; y < pnm.height; y++)
+			nq_bilevel_row(pixels + y * pnm.width, pnm.raster + y * pnm.stride, pnm.width, 1);
+		ctx->bilevel = 1;
+		return (0);
+	}
 
-	color_type     = png_get_color_type(png_ptr, info_ptr);
-	bit_depth      = png_get_bit_depth(png_ptr, info_ptr);
-	interlace_type = png_get_interlace_type(png_ptr, info_ptr);
+	uint8_t *scratch = NULL;
+	if (extra > 0 && (scratch = malloc(extra)) == NULL)
+		return (-1);
 
-	// Read any color_type into 8bit depth, Grayscale format.
-	// See http://www.libpng.org/pub/png/libpng-manual.txt
+	uint8_t *image = quirc_begin(ctx->q, NULL, NULL);
+	nq_rows_begin(&ctx->rows, image, pnm.width, pnm.height, 0);
+	for (size_t y = 0; y < pnm.height; y++) {
+		nq_pnm_row(&pnm, image + y * pnm.width, y, scratch);
+		nq_rows_landed(&ctx->rows, y + 1);
+	}
 
-	// PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-	if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-		png_set_expand_gray_1_2_4_to_8(png_ptr);
+	free(scratch);
+	return (0);
+}
 
-	if ((trns = png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)))
-		png_set_tRNS_to_alpha(png_ptr);
 
-	if (bit_depth == 16)
-#if PNG_LIBPNG_VER >= 10504
-		png_set_scale_16(png_ptr);
-#else
-		png_set_strip_16(png_ptr);
-#endif
+/*
+ * Parse the header of the binary PNM image img, see
+ * https://netpbm.sourceforge.net/doc/pbm.html (and pgm.html, ppm.html,
+ * pam.html).
+ *
+ * returns 0 on success, -1 when img is not a valid PNM image.
+ */
+static int
+nq_pnm_parse(const uint8_t *img, size_t img_len, struct nq_pnm *pnm)
+{
+	size_t pos = 2;
+
+	memset(pnm, 0, sizeof(*pnm));
+	if (img_len < 3 || img[0] != 'P')
+		return (-1);
+
+	switch (img[1]) {
+	case '4':
+		pnm->format   = "pbm";
+		pnm->channels = 1;
+		pnm->maxval   = 1;
+		break;
+	case '5':
+		pnm->format   = "pgm";
+		pnm->channels = 1;
+		break;
+	case '6':
+		pnm->format   = "ppm";
+		pnm->channels = 3;
+		break;
+	case '7':
+		pnm->format = "pam";
+		break;
+	default:
+		return (-1);
+	}
 
-	if ((trns) || color_type & PNG_COLOR_MASK_ALPHA)
-		png_set_strip_alpha(png_ptr);
+	if (img[1] != '7') {
+		pnm->width  = nq_pnm_uint(img, img_len, &pos);
+		pnm->height = nq_pnm_uint(img, img_len, &pos);
+		if (pnm->maxval == 0)
+			pnm->maxval = nq_pnm_uint(img, img_len, &pos);
+		/* a single whitespace before the raster */
+		if (pos >= img_len || !isspace(img[pos]))
+			return (-1);
+		pos++;
+	} else {
+		/* PAM header lines, until ENDHDR */
+		for (;;) {
+			size_t key;
+			pos = nq_pnm_space(img, img_len, pos);
+			for (key = pos; pos < img_len && isupper(img[pos]); pos++)
+				continue;
+			size_t key_len = pos - key;
+			if (key_len == 6 && memcmp(img + key, "ENDHDR", 6) == 0) {
+				while (pos < img_len && img[pos] != '\n')
+					pos++;
+				pos++;
+				break;
+			} else if (key_len == 5 && memcmp(img + key, "WIDTH", 5) == 0) {
+				pnm->width = nq_pnm_uint(img, img_len, &pos);
+			} else if (key_len == 6 && memcmp(img + key, "HEIGHT", 6) == 0) {
+				pnm->height = nq_pnm_uint(img, img_len, &pos);
+			} else if (key_len == 5 && memcmp(img + key, "DEPTH", 5) == 0) {
+				pnm->channels = (int)nq_pnm_uint(img, img_len, &pos);
+			} else if (key_len == 6 && memcmp(img + key, "MAXVAL", 6) == 0) {
+				pnm->maxval = nq_pnm_uint(img, img_len, &pos);
+			} else if (key_len == 8 && memcmp(img + key, "TUPLTYPE", 8) == 0) {
+				/* the depth and maxval are all we need */
+				while (pos < img_len && img[pos] != '\n')
+					pos++;
+			} else {
+				return (-1);
+			}
+		}
+		/* gray, gray and alpha, RGB or RGB and alpha */
+		if (pnm->channels < 1 || pnm->channels > 4)
+			return (-1);
+	}
 
-	if (color_type == PNG_COLOR_TYPE_PALETTE)
-		png_set_palette_to_rgb(png_ptr);
+	if (pnm->width < 1 || pnm->width > NQ_MAX_DIMENSION ||
+	    pnm->height < 1 || pnm->height > NQ_MAX_DIMENSION ||
+	    pnm->maxval < 1 || pnm->maxval > 65535)
+		return (-1);
 
-	if (color_type == PNG_COLOR_TYPE_PALETTE ||
-	    color_type == PNG_COLOR_TYPE_RGB ||
-	    color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
-		png_set_rgb_to_gray_fixed(png_ptr, 1, -1, -1);
+	if (img[1] == '4') {
+		pnm->depth  = 1;
+		pnm->stride = (pnm->width + 7) / 8;
+	} else {
+		pnm->depth  = (pnm->maxval > 255 ? 16 : 8);
+		pnm->stride = pnm->width * pnm->channels * (pnm->depth / 8);
+		for (unsigned int v = 0; v < 256; v++) {
+			pnm->lut[v] = (v >= pnm->maxval ? 255 :
+			    (uint8_t)((v * 255 + pnm->maxval / 2) / pnm->maxval));
+		}
 	}
 
-	if (interlace_type != PNG_INTERLACE_NONE)
-		number_passes = png_set_interlace_handling(png_ptr);
+	if (pos > img_len || pnm->height > (img_len - pos) / pnm->stride)
+		return (-1);
+	pnm->raster = img + pos;
+	return (0);
+}
 
-	png_read_update_info(png_ptr, info_ptr);
 
-	width    = png_get_image_width(png_ptr, info_ptr);
-	height   = png_get_image_height(png_ptr, info_ptr);
-	rowbytes = png_get_rowbytes(png_ptr, info_ptr);
-	if (rowbytes != width) {
-		goto out;
+/* returns the position of the next PNM header token after pos */
+static size_t
+nq_pnm_space(const uint8_t *img, size_t img_len, size_t pos)
+{
+	while (pos < img_len) {
+		if (img[pos] == '#') {
+			while (pos < img_len && img[pos] != '\n')
+				pos++;
+		} else if (isspace(img[pos])) {
+			pos++;
+		} else {
+			break;
+		}
 	}
+	return (pos);
+}
 
-	if (quirc_resize(q, width, height) < 0)
-		goto out;
 
-	image = quirc_begin(q, NULL, NULL);
+/*
+ * Read the PNM header decimal number at *pos, moving *pos past it.
+ *
+ * returns the number, or 0 when there is none (every field is positive).
+ */
+static size_t
+nq_pnm_uint(const uint8_t *img, size_t img_len, size_t *pos)
+{
+	size_t p = nq_pnm_space(img, img_len, *pos);
+	size_t start = p, value = 0;
+
+	for (; p < img_len && isdigit(img[p]); p++) {
+		/* larger than any valid field anyway */
+		if (value > 1000000)
+			return (0);
+		value = value * 10 + (img[p] - '0');
+	}
+	if (p == start)
+		return (0);
+	*pos = p;
+	return (value);
+}
 
-	for (int pass = 0; pass < number_passes; pass++) {
-		int y;
 
-		for (y = 0; y < height; y++) {
-			png_bytep row_pointer = image + y * width;
-			png_read_rows(png_ptr, &row_pointer, NULL, 1);
+/*
+ * Turn the row y of the PGM, PPM or PAM image pnm into grayscale at dst, its
+ * samples being scaled to 8-bit in scratch (holding a row of samples) first
+ * unless their maxval is 255 already.
+ */
+static void
+nq_pnm_row(const struct nq_pnm *pnm, uint8_t *dst, size_t y, uint8_t *scratch)
+{
+	const uint8_t *src = pnm->raster + y * pnm->stride;
+	const size_t n = pnm->width * pnm->channels;
+
+	switch (pnm->depth) {
+	case 16:
+		for (size_t i = 0; i < n; i++) {
+			unsigned int v = (unsigned int)src[2 * i] << 8 | src[2 * i + 1];
+			scratch[i] = (v >= pnm->maxval ? 255 :
+			    (uint8_t)((v * 255 + pnm->maxval / 2) / pnm->maxval));
 		}
+		src = scratch;
+		break;
+	default:
+		if (pnm->maxval != 255) {
+			for (size_t i = 0; i < n; i++)
+				scratch[i] = pnm->lut[src[i]];
+			src = scratch;
+		}
+		break;
 	}
+	nq_gray_row(dst, src, pnm->width, pnm->channels, 0);
+}
 
-	png_read_end(png_ptr, info_ptr);
 
-	success = 1;
-	/* FALLTHROUGH */
-out:
-	/* cleanup */
-	if (png_ptr != NULL) {
-		if (info_ptr != NULL)
-			png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-		else
-			png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+/* little-endian BMP header fields */
+#define	NQ_LE16(p)	((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8)
+#define	NQ_LE32(p)	(NQ_LE16(p) | NQ_LE16((p) + 2) << 16)
+/* BMP compression methods */
+#define	NQ_BMP_RGB		0
+#define	NQ_BMP_BITFIELDS	3
+
+static int
+nq_load_bmp(struct nq_ctx *ctx, const uint8_t *img, size_t img_len)
+{
+	struct nq_bmp bmp;
+
+	if (nq_bmp_parse(img, img_len, &bmp) < 0)
+		return (-1);
+	if (nq_check_size(ctx, bmp.width, bmp.height) < 0)
+		return (-1);
+	if (nq_reserve(ctx, bmp.width, bmp.height, 0) < 0)
+		return (-1);
+	if (nq_resize(ctx->q, bmp.width, bmp.height) < 0)
+		return (-1);
+
+	uint8_t *image = quirc_begin(ctx->q, NULL, NULL);
+	/* from the top down whatever the order of the rows in the file */
+	nq_rows_begin(&ctx->rows, image, bmp.width, bmp.height, 0);
+	for (size_t y = 0; y < bmp.height; y++) {
+		nq_bmp_row(&bmp, image + y * bmp.width, y);
+		nq_rows_landed(&ctx->rows, y + 1);
 	}
-	if (infile != NULL)
-		fclose(infile);
-	return (success ? 0 : -1);
+
+	return (0);
 }
 
 
-/* hacked from quirc/tests/dbgutil.c */
-struct nq_jpeg_error {
-	struct jpeg_error_mgr base;
-	jmp_buf env;
-};
+/*
+ * Parse the headers of the uncompressed BMP image img, see
+ * https://learn.microsoft.com/en-us/windows/win32/gdi/bitmap-storage
+ *
+ * returns 0 on success, -1 when img is not a valid (or a compressed) BMP
+ * image.
+ */
+static int
+nq_bmp_parse(const uint8_t *img, size_t img_len, struct nq_bmp *bmp)
+{
+	uint32_t offset, header, compression = NQ_BMP_RGB, colors = 0;
+	int32_t width, height;
+	size_t entry; /* bytes per palette color */
+
+	memset(bmp, 0, sizeof(*bmp));
+	if (img_len < 26 || img[0] != 'B' || img[1] != 'M')
+		return (-1);
+	offset = NQ_LE32(img + 10);
+	header = NQ_LE32(img + 14);
+	if (header > img_len - 14)
+		return (-1);
+
+	if (header == 12) {
+		/* BITMAPCOREHEADER */
+		width    = (int32_t)NQ_LE16(img + 18);
+		height   = (int32_t)NQ_LE16(img + 20);
+		bmp->bpp = NQ_LE16(img + 24);
+		entry    = 3;
+	} else if (header >= 40) {
+		/* BITMAPINFOHEADER, or one of its extensions */
+		width       = (int32_t)NQ_LE32(img + 18);
+		height      = (int32_t)NQ_LE32(img + 22);
+		bmp->bpp    = NQ_LE16(img + 28);
+		compression = NQ_LE32(img + 30);
+		colors      = NQ_LE32(img + 46);
+		entry       = 4;
+	} else {
+		return (-1);
+	}
 
+	if (compression == NQ_BMP_BITFIELDS) {
+		/* only the BGRX layout, whose masks follow BITMAPINFOHEADER */
+		if (bmp->bpp != 32 || 14 + 40 + 12 > img_len ||
+		    NQ_LE32(img + 54) != 0x00FF0000 || NQ_LE32(img + 58) != 0x0000FF00 ||
+		    NQ_LE32(img + 62) != 0x000000FF)
+			return (-1);
+	} else if (compression != NQ_BMP_RGB) {
+		return (-1);
+	}
+	if (bmp->bpp != 1 && bmp->bpp != 4 && bmp->bpp != 8 && bmp->bpp != 24 && bmp->bpp != 32)
+		return (-1);
+
+	/* a negative height for rows stored from the top down */
+	if (height < 0 && height != INT32_MIN) {
+		bmp->top_down = 1;
+		height = -height;
+	}
+	if (width < 1 || width > NQ_MAX_DIMENSION || height < 1 || height > NQ_MAX_DIMENSION)
+		return (-1);
+	bmp->width  = (size_t)width;
+	bmp->height = (size_t)height;
+	bmp->stride = (bmp->width * bmp->bpp + 31) / 32 * 4;
+	if (offset > img_len || bmp->height > (img_len - offset) / bmp->stride)
+		return (-1);
+	bmp->raster = img + offset;
+
+	if (bmp->bpp <= 8) {
+		/* pixels past the palette are black */
+		size_t n = (colors > 0 && colors < (1U << bmp->bpp) ? colors : (1U << bmp->bpp));
+		const uint8_t *palette = img + 14 + header;
+		if (n > (img_len - 14 - header) / entry)
+			return (-1);
+		for (size_t i = 0; i < n; i++) {
+			const uint8_t *bgr = palette + i * entry;
+			bmp->lut[i] = NQ_GRAY(bgr[2], bgr[1], bgr[0]);
+		}
+	}
+	return (0);
+}
 
+
+/* turn the row y (from the top) of bmp into grayscale at dst */
 static void
-nq_error_exit(struct jpeg_common_struct *com)
+nq_bmp_row(const struct nq_bmp *bmp, uint8_t *dst, size_t y)
 {
-	struct nq_jpeg_error *err = (struct nq_jpeg_error *)com->err;
+	size_t row = (bmp->top_down ? y : bmp->height - 1 - y);
+	const uint8_t *src = bmp->raster + row * bmp->stride;
+
+	switch (bmp->bpp) {
+	case 1:
+		for (size_t x = 0; x < bmp->width; x++)
+			dst[x] = bmp->lut[(src[x >> 3] >> (7 - (x & 7))) & 1];
+		break;
+	case 4:
+		for (size_t x = 0; x < bmp->width; x++)
+			dst[x] = bmp->lut[(src[x >> 1] >> (x & 1 ? 0 : 4)) & 0xF];
+		break;
+	case 8:
+		for (size_t x = 0; x < bmp->width; x++)
+			dst[x] = bmp->lut[src[x]];
+		break;
+	default:
+		nq_gray_row(dst, src, bmp->width, bmp->bpp / 8, 1);
+		break;
+	}
+}
 
-	longjmp(err->env, 0);
+
+/*
+ * Turn the n pixels at src made of channels 8-bit samples into grayscale at
+ * dst: gray (and alpha), or red, green, blue (and alpha), in that order unless
+ * bgr is set. The alpha is ignored.
+ */
+static void
+nq_gray_row(uint8_t *dst, const uint8_t *src, size_t n, int channels, int bgr)
+{
+	/* loop invariants, so that both orders share the same loops */
+	const uint32_t first = (bgr ? NQ_GRAY_BLUE : NQ_GRAY_RED);
+	const uint32_t last  = (bgr ? NQ_GRAY_RED : NQ_GRAY_BLUE);
+
+	switch (channels) {
+	case 1:
+		memcpy(dst, src, n);
+		break;
+	case 2:
+		for (size_t i = 0; i < n; i++)
+			dst[i] = src[2 * i];
+		break;
+	case 3:
+		/* constant strides, which compilers can vectorize */
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = (uint8_t)((first * src[3 * i] +
+			    NQ_GRAY_GREEN * src[3 * i + 1] + last * src[3 * i + 2]) >> 15);
+		}
+		break;
+	case 4:
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = (uint8_t)((first * src[4 * i] +
+			    NQ_GRAY_GREEN * src[4 * i + 1] + last * src[4 * i + 2]) >> 15);
+		}
+		break;
+	}
 }
 
 
-static struct jpeg_error_mgr *
-nq_error_mgr(struct nq_jpeg_error *err)
+/*
+ * Unpack the n 1-bit pixels at src, the first one in the most significant
+ * bit, into quirc pixels at dst: black where the bit is `black`, white
+ * elsewhere.
+ */
+static void
+nq_bilevel_row(quirc_pixel_t *dst, const uint8_t *src, size_t n, int black)
 {
-	jpeg_std_error(&err->base);
-	err->base.error_exit = nq_error_exit;
-	return &err->base;
+	/* flip the bits so that black ones are set */
+	const uint8_t flip = (black ? 0x00 : 0xFF);
+	size_t x = 0;
+
+	for (; n - x >= 8; x += 8) {
+		const unsigned int bits = *src++ ^ flip;
+		for (int i = 0; i < 8; i++)
+			dst[x + i] = ((bits >> (7 - i)) & 1 ? QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE);
+	}
+	if (x < n) {
+		const unsigned int bits = *src ^ flip;
+		for (int i = 0; x < n; i++, x++)
+			dst[x] = ((bits >> (7 - i)) & 1 ? QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE);
+	}
 }
 
 
+/*
+ * Load the raw image img, made of 1 (gray), 3 (RGB) or 4 (RGBA) bytes per
+ * pixel. With the NQ_DECODE_BILEVEL flag, it is made of 1-bit pixels instead,
+ * packed like PBM ones: the first pixel of each byte in its most significant
+ * bit, 1 being black, and every row starting on a byte boundary.
+ */
 static int
-nq_load_jpeg(struct quirc *q, const uint8_t *img, size_t img_len)
+nq_load_raw(struct nq_ctx *ctx, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
 {
-	struct jpeg_decompress_struct dinfo;
-	struct nq_jpeg_error err;
-	uint8_t *image;
-	JDIMENSION y;
-
-	memset(&dinfo, 0, sizeof(dinfo));
-	dinfo.err = nq_error_mgr(&err);
+	if (nq_check_size(ctx, img_width, img_height) < 0)
+		goto fail;
+	if (nq_reserve(ctx, img_width, img_height, 0) < 0)
+		goto fail;
 
-	if (setjmp(err.env))
+	if (nq_resize(ctx->q, img_width, img_height) < 0)
 		goto fail;
 
-	jpeg_create_decompress(&dinfo);
-	jpeg_mem_src(&dinfo, img, img_len);
+	if (ctx->flags & NQ_DECODE_BILEVEL) {
+		const size_t stride = NQ_BILEVEL_STRIDE(img_width);
+		if (stride * img_height != img_len)
+			goto fail;
+		quirc_pixel_t *pixels = quirc_begin_bilevel(ctx->q, NULL, NULL);
+		for (size_t y = 0; y < img_height; y++)
+			nq_bilevel_row(pixels + y * img_width, img + y * stride, img_width, 1);
+		ctx->bilevel = 1;
+		return 0;
+	}
 
-	jpeg_read_header(&dinfo, TRUE);
-	dinfo.output_components = 1;
-	dinfo.out_color_space = JCS_GRAYSCALE;
-	jpeg_start_decompress(&dinfo);
+	uint8_t *image = quirc_begin(ctx->q, NULL, NULL);
 
-	if (dinfo.output_components != 1)
-		goto fail;
+	const size_t len = img_width * img_height;
+	const int channels = len == img_len ? 1 : /* grayscale */
+			3 * len == img_len ? 3 : /* rgb */
+			4 * len == img_len ? 4 : /* rgba */
+			/* default */ -1;
 
-	if (quirc_resize(q, dinfo.output_width, dinfo.output_height) < 0)
+	if (channels == -1)
 		goto fail;
 
-	image = quirc_begin(q, NULL, NULL);
-
-	for (y = 0; y < dinfo.output_height; y++)
-	{
-		JSAMPROW row_pointer = image + y * dinfo.output_width;
-
-		jpeg_read_scanlines(&dinfo, &row_pointer, 1);
+	nq_rows_begin(&ctx->rows, image, img_width, img_height, 0);
+	for (size_t y = 0; y < img_height; y++) {
+		uint8_t *dst = image + y * img_width;
+		const uint8_t *src = img + y * img_width * channels;
+		if (channels == 1) {
+			memcpy(dst, src, img_width);
+		} else {
+			for (size_t x = 0; x < img_width; x++, src += channels) {
+				uint8_t r = src[0];
+				uint8_t g = src[1];
+				uint8_t b = src[2];
+				// convert RGB to grayscale, ignoring alpha channel if present, using this:
+				// https://en.wikipedia.org/wiki/Grayscale#Colorimetric_(perceptual_luminance-preserving)_conversion_to_grayscale
+				dst[x] = (uint8_t)(0.2126 * (float)r + 0.7152 * (float)g + 0.0722 * (float)b);
+			}
+		}
+		/* count the row while it is still in the cache */
+		nq_rows_landed(&ctx->rows, y + 1);
 	}
 
-	jpeg_finish_decompress(&dinfo);
-	jpeg_destroy_decompress(&dinfo);
 	return 0;
 
 fail:
-	jpeg_destroy_decompress(&dinfo);
 	return -1;
 }
 
+
+/*
+ * Reject images of more than the maximum pixel count, before anything is
+ * allocated for them.
+ *
+ * returns 0 on success, -1 on error.
+ */
 static int
-nq_load_raw(struct quirc *q, const uint8_t *img, size_t img_len, size_t img_width, size_t img_height)
+nq_check_size(struct nq_ctx *ctx, size_t width, size_t height)
 {
-	if (quirc_resize(q, img_width, img_height) < 0)
-		goto fail;
+	pthread_mutex_lock(&nq_limits.mutex);
+	size_t max_pixels = nq_limits.max_pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	/* width and height come from 32-bit header fields */
+	if (max_pixels > 0 && (uint64_t)width * (uint64_t)height > (uint64_t)max_pixels) {
+		ctx->err      = "image is too large";
+		ctx->err_code = "ERR_IMAGE_TOO_LARGE";
+		return (-1);
+	}
+	return (0);
+}
 
-	uint8_t *image = quirc_begin(q, NULL, NULL);
 
-	const size_t len = img_width * img_height;
-	const int channels = len == img_len ? 1 : /* grayscale */
-			3 * len == img_len ? 3 : /* rgb */
-			4 * len == img_len ? 4 : /* rgba */
-			/* default */ -1;
+/*
+ * Count the width x height image at `image` into rows as the loader writes
+ * it, each row exactly once and from the top down, reporting its progress
+ * through nq_rows_landed(). With pipeline set, large enough images are
+ * counted on a second thread, see nq_set_pipeline_pixels().
+ *
+ * Images whose rows are not counted (when they don't land in order) get
+ * their histogram from quirc_end(), in a pass of its own.
+ */
+static void
+nq_rows_begin(struct nq_rows *rows, const uint8_t *image, size_t width, size_t height, int pipeline)
+{
+	rows->image    = image;
+	rows->width    = width;
+	rows->height   = height;
+	rows->counted  = 0;
+	rows->pipeline = NULL;
+	memset(rows->counts, 0, sizeof(rows->counts));
+
+	if (pipeline)
+		nq_pipeline_start(rows);
+}
+
+
+/* how many rows the consumer is woken up for at least, see nq_rows_landed() */
+#define	NQ_PIPELINE_ROWS	32
+
+/*
+ * Count the rows above `landed`, right away while they are still in the
+ * cache or by waking up the pipeline consumer (every NQ_PIPELINE_ROWS rows,
+ * and for the last one).
+ */
+static void
+nq_rows_landed(struct nq_rows *rows, size_t landed)
+{
+	struct nq_pipeline *pipeline = rows->pipeline;
+
+	if (rows->image == NULL)
+		return;
+
+	if (pipeline == NULL) {
+		nq_rows_count(rows, landed);
+		return;
+	}
+
+	if (landed - pipeline->reported < NQ_PIPELINE_ROWS && landed < rows->height)
+		return;
+	pipeline->reported = landed;
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->landed_rows = landed;
+	pthread_cond_signal(&pipeline->landed);
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+
+/* count the rows above `landed` not counted yet */
+static void
+nq_rows_count(struct nq_rows *rows, size_t landed)
+{
+	const uint8_t *p   = rows->image + rows->counted * rows->width;
+	const uint8_t *end = rows->image + landed * rows->width;
+
+	for (; end - p >= 4; p += 4) {
+		rows->counts[0][p[0]]++;
+		rows->counts[1][p[1]]++;
+		rows->counts[2][p[2]]++;
+		rows->counts[3][p[3]]++;
+	}
+	while (p < end)
+		rows->counts[0][*p++]++;
+	rows->counted = landed;
+}
+
+
+/*
+ * Stop counting rows once the loader returned.
+ *
+ * returns the histogram of the whole image, or NULL when it was not counted.
+ */
+static const unsigned int *
+nq_rows_end(struct nq_rows *rows)
+{
+	if (rows->pipeline != NULL)
+		nq_pipeline_finish(rows);
+
+	const uint8_t *image = rows->image;
+	rows->image = NULL;
+	if (image == NULL || rows->counted != rows->height)
+		return (NULL);
+	for (int v = 0; v < 256; v++) {
+		rows->histogram[v] = rows->counts[0][v] + rows->counts[1][v] +
+		    rows->counts[2][v] + rows->counts[3][v];
+	}
+	return (rows->histogram);
+}
+
+
+/*
+ * Start counting rows on a second thread when the image is large enough.
+ * Otherwise (also when the thread can't be started), the loader counts them.
+ */
+static void
+nq_pipeline_start(struct nq_rows *rows)
+{
+	pthread_mutex_lock(&nq_limits.mutex);
+	size_t pixels = nq_limits.pipeline_pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	if (pixels == 0 || rows->width * rows->height < pixels)
+		return;
+
+	struct nq_pipeline *pipeline = calloc(1, sizeof(struct nq_pipeline));
+	if (pipeline == NULL)
+		return;
+	pipeline->rows = rows;
+	if (pthread_mutex_init(&pipeline->mutex, NULL) != 0)
+		goto fail_mutex;
+	if (pthread_cond_init(&pipeline->landed, NULL) != 0)
+		goto fail_cond;
+	if (pthread_create(&pipeline->thread, NULL, nq_pipeline_consume, pipeline) != 0)
+		goto fail_thread;
+	rows->pipeline = pipeline;
+	nq_load_count(&nq_load_counters.stats.pipelined);
+	return;
+
+fail_thread:
+	pthread_cond_destroy(&pipeline->landed);
+fail_cond:
+	pthread_mutex_destroy(&pipeline->mutex);
+fail_mutex:
+	free(pipeline);
+}
+
+
+/* count the rows of a nq_pipeline as they land, as a pthread start routine */
+static void *
+nq_pipeline_consume(void *arg)
+{
+	struct nq_pipeline *pipeline = arg;
+	struct nq_rows *rows = pipeline->rows;
+
+	for (;;) {
+		pthread_mutex_lock(&pipeline->mutex);
+		while (pipeline->landed_rows == rows->counted && !pipeline->done)
+			pthread_cond_wait(&pipeline->landed, &pipeline->mutex);
+		size_t landed = pipeline->landed_rows;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		if (landed == rows->counted)
+			break; /* done */
+		nq_rows_count(rows, landed);
+	}
+	return (NULL);
+}
 
-	if (channels == 1) {
-		memcpy(image, img, img_len);
-	} else if (channels == 3 || channels == 4) {
-		for (
-			size_t dst_offset = 0, src_offset = 0;
-			dst_offset < img_width * img_height;
-			dst_offset++, src_offset += channels
-		) {
-			uint8_t r = img[src_offset];
-			uint8_t g = img[src_offset + 1];
-			uint8_t b = img[src_offset + 2];
-			// convert RGB to grayscale, ignoring alpha channel if present, using this:
-			// https://en.wikipedia.org/wiki/Grayscale#Colorimetric_(perceptual_luminance-preserving)_conversion_to_grayscale
-			image[dst_offset] = (uint8_t)(0.2126 * (float)r + 0.7152 * (float)g + 0.0722 * (float)b);
+
+/* stop the consumer of rows, once it counted every row landed */
+static void
+nq_pipeline_finish(struct nq_rows *rows)
+{
+	struct nq_pipeline *pipeline = rows->pipeline;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	pthread_cond_signal(&pipeline->landed);
+	pthread_mutex_unlock(&pipeline->mutex);
+	(void)pthread_join(pipeline->thread, NULL);
+
+	pthread_cond_destroy(&pipeline->landed);
+	pthread_mutex_destroy(&pipeline->mutex);
+	free(pipeline);
+	rows->pipeline = NULL;
+}
+
+
+/*
+ * The smallest of the 1/2, 1/4 and 1/8 libjpeg scaling factors bringing a
+ * width x height JPEG image under the pixel budget, or 1 to decode it at
+ * full size.
+ */
+static unsigned int
+nq_jpeg_scale(const struct nq_ctx *ctx, size_t width, size_t height)
+{
+	unsigned int scale = 1;
+
+	if (ctx->full_size)
+		return (1);
+
+	pthread_mutex_lock(&nq_limits.mutex);
+	size_t budget = nq_limits.jpeg_pixels;
+	pthread_mutex_unlock(&nq_limits.mutex);
+
+	if (budget == 0)
+		return (1);
+	while (scale < 8 && (uint64_t)(width / scale) * (height / scale) > (uint64_t)budget)
+		scale *= 2;
+	return (scale);
+}
+
+
+/*
+ * Reserve from the memory budget what decoding a width x height image should
+ * need: the quirc struct itself, its image and pixels buffers, and `extra`
+ * bytes used by the image loader. Depending on the budget settings, either
+ * wait for the reservation to fit or fail right away.
+ *
+ * returns 0 on success, -1 on error.
+ */
+static int
+nq_reserve(struct nq_ctx *ctx, size_t width, size_t height, size_t extra)
+{
+	size_t size = sizeof(struct quirc) + width * height + extra;
+	if (!QUIRC_PIXEL_ALIAS_IMAGE)
+		size += width * height * sizeof(quirc_pixel_t);
+
+	int ret = -1;
+	pthread_mutex_lock(&nq_budget.mutex);
+	for (;;) {
+		if (nq_budget.limit == 0 || nq_budget.used + size <= nq_budget.limit) {
+			nq_budget.used += size;
+			ctx->reserved  += size;
+			if (ctx->incremental)
+				nq_budget.incremental += size;
+			ret = 0;
+			break;
 		}
-	} else {
-		goto fail;
+		/*
+		 * Incremental decodes hold their reservation while idle between
+		 * jobs, so waiting on them could occupy every thread of the pool
+		 * their next job needs. They neither wait, nor are waited for: a
+		 * decode that would not fit beside them fails right away.
+		 */
+		if (!nq_budget.wait || ctx->incremental ||
+		    nq_budget.incremental > nq_budget.limit ||
+		    size > nq_budget.limit - nq_budget.incremental)
+			break;
+		pthread_cond_wait(&nq_budget.released, &nq_budget.mutex);
 	}
+	pthread_mutex_unlock(&nq_budget.mutex);
 
-	return 0;
+	if (ret == -1) {
+		ctx->err      = "memory budget exceeded";
+		ctx->err_code = "ERR_MEMORY_BUDGET";
+	}
+	return (ret);
+}
 
-fail:
-	return -1;
+
+/* give back to the memory budget everything reserved by ctx */
+static void
+nq_release(struct nq_ctx *ctx)
+{
+	if (ctx->reserved == 0)
+		return;
+
+	pthread_mutex_lock(&nq_budget.mutex);
+	nq_budget.used -= ctx->reserved;
+	if (ctx->incremental)
+		nq_budget.incremental -= ctx->reserved;
+	pthread_mutex_unlock(&nq_budget.mutex);
+	pthread_cond_broadcast(&nq_budget.released);
+
+	ctx->reserved = 0;
 }
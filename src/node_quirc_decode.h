@@ -10,12 +10,92 @@
 struct nq_code_list;
 struct nq_code;
 
-struct nq_code_list	*nq_decode(const uint8_t *img, size_t img_len, size_t width, size_t height);
+/* nq_decode() flags */
+#define	NQ_DECODE_JPEG_FAST	0x1 /* trade JPEG decoding accuracy for speed */
+#define	NQ_DECODE_BILEVEL	0x2 /* raw images are packed 1-bit rows, 1 being black */
+
+struct nq_code_list	*nq_decode(const uint8_t *img, size_t img_len, size_t width, size_t height, int flags);
 const char		*nq_code_list_err(const struct nq_code_list *list);
+const char		*nq_code_list_err_code(const struct nq_code_list *list);
 unsigned int		 nq_code_list_size(const struct nq_code_list *list);
 const struct nq_code	*nq_code_at(const struct nq_code_list *list, unsigned int index);
 void			 nq_code_list_free(struct nq_code_list *list);
 
+/*
+ * Decode count already sampled QR-code grids, the i-th one being sizes[i]
+ * cells across. cells holds the cell bitmap of every grid one after the
+ * other, each in the struct quirc_code cell_bitmap layout and
+ * NQ_GRID_BITMAP_LEN(sizes[i]) bytes long. A grid of an invalid size (out of
+ * NQ_GRID_MIN_SIZE to NQ_GRID_MAX_SIZE) has no bitmap in cells and yields an
+ * error.
+ */
+#define	NQ_GRID_MIN_SIZE	21  /* version 1 */
+#define	NQ_GRID_MAX_SIZE	177 /* version 40, QUIRC_MAX_GRID_SIZE */
+#define	NQ_GRID_BITMAP_LEN(size)	(((size_t)(size) * (size_t)(size) + 7) / 8)
+struct nq_code_list	*nq_decode_grids(unsigned int count, const int *sizes, const uint8_t *cells);
+
+/*
+ * Binary encoding of a nq_code list, all integers being little-endian:
+ *
+ *   header:   "NQRB" magic, uint32 code count
+ *   codes:    one NQ_BINARY_CODE_SIZE record per code (see below)
+ *   payloads: the data of every code, referenced by offset and length
+ *
+ * Each code record is made of the following uint32 / int32 fields:
+ *
+ *   flags, version, ecc_level, mask, mode, eci, four (x, y) corners from the
+ *   top left clockwise, payload offset (from the buffer start), payload
+ *   length.
+ *
+ * When the NQ_BINARY_FLAG_ERR flag is set the code could not be decoded and
+ * its payload is the error message.
+ */
+#define	NQ_BINARY_MAGIC		"NQRB"
+#define	NQ_BINARY_HEADER_SIZE	8
+#define	NQ_BINARY_CODE_SIZE	64
+#define	NQ_BINARY_FLAG_ERR	0x1
+
+uint8_t		*nq_code_list_binary(const struct nq_code_list *list, size_t *len);
+
+/*
+ * Decode like nq_decode(), but write the result in the binary format straight
+ * into the out_len bytes at out, without any other allocation.
+ *
+ * returns the code count on success, -1 on error setting err and err_code
+ * (which may be NULL).
+ */
+int	nq_decode_into(const uint8_t *img, size_t img_len, size_t width, size_t height, int flags,
+	    uint8_t *out, size_t out_len, const char **err, const char **err_code);
+
+/*
+ * Transcode the payload of every successfully decoded code in list to UTF-8,
+ * according to its ECI or, when it has none, its mode: Shift-JIS for KANJI,
+ * UTF-8 when valid or else ISO-8859-1 otherwise. Invalid input sequences are
+ * replaced by U+FFFD.
+ *
+ * returns 0 on success, -1 on error setting the list error.
+ */
+int	nq_code_list_text(struct nq_code_list *list);
+
+/* a QR-code position, see nq_locate() */
+struct nq_location {
+	struct {
+		int	x;
+		int	y;
+	} corners[4]; /* from the top left, clockwise */
+	int	size; /* grid size, in cells */
+};
+
+/*
+ * Find the QR-codes of an image like nq_decode() without reading their
+ * content, setting locations to a malloc(3)ed array.
+ *
+ * returns the code count on success, -1 on error setting err and err_code
+ * (which may be NULL).
+ */
+int	nq_locate(const uint8_t *img, size_t img_len, size_t width, size_t height, int flags,
+	    struct nq_location **locations, const char **err, const char **err_code);
+
 const char	*nq_code_err(const struct nq_code *code);
 int		 nq_code_version(const struct nq_code *code);
 const char	*nq_code_ecc_level_str(const struct nq_code *code);
@@ -24,5 +104,122 @@ const char	*nq_code_mode_str(const struct nq_code *code);
 const char	*nq_code_eci_str(const struct nq_code *code);
 const uint8_t	*nq_code_payload(const struct nq_code *code);
 size_t		 nq_code_payload_len(const struct nq_code *code);
+/* UTF-8 payload, only available after nq_code_list_text() */
+const char	*nq_code_text(const struct nq_code *code);
+size_t		 nq_code_text_len(const struct nq_code *code);
+
+/* image header information, see nq_probe() */
+struct nq_image_info {
+	const char	*format; /* "png", "jpeg", "pbm", "pgm", "ppm", "pam" or "bmp" */
+	uint32_t	 width;
+	uint32_t	 height;
+	int		 channels;
+};
+
+/*
+ * Read only the header of the image img, without decoding any pixel.
+ *
+ * returns 0 on success, -1 when img is not a (valid) image of a supported
+ * format.
+ */
+int	nq_probe(const uint8_t *img, size_t img_len, struct nq_image_info *info);
+
+/* an image file content, see nq_file_open() */
+struct nq_file {
+	uint8_t	*data;
+	size_t	 len;
+	int	 mapped; /* data is mmap(2)ed rather than malloc(3)ed */
+};
+
+/*
+ * Map the file at path in memory, or read it when it cannot be mapped.
+ *
+ * returns 0 on success, -1 on error setting errno and syscall to the name of
+ * the failed call.
+ */
+int	nq_file_open(const char *path, struct nq_file *file, const char **syscall);
+void	nq_file_close(struct nq_file *file);
+
+/*
+ * Hint the kernel that the file at path is going to be read, so that it
+ * starts reading it in the background. Errors are ignored.
+ */
+void	nq_file_prefetch(const char *path);
+
+/*
+ * Decode an image received in chunks: the pixels of PNG and JPEG images are
+ * decoded as their bytes are written, so that only the QR-code recognition is
+ * left once the last chunk arrived (PNM and BMP ones are converted at once by
+ * nq_incremental_end()). An incremental decode may move between threads,
+ * but must not be used by several of them at once. Its memory budget
+ * reservation, taken once the image dimensions are known, is held until
+ * nq_incremental_end() or nq_incremental_free().
+ */
+struct nq_incremental;
+
+/* returns NULL when out of memory */
+struct nq_incremental	*nq_incremental_new(int flags);
+/*
+ * Decode as much of the image as the len bytes at data (which are copied if
+ * needed) allow.
+ *
+ * returns 0 on success, -1 when the image can't be decoded, the error being
+ * reported by nq_incremental_end().
+ */
+int			 nq_incremental_write(struct nq_incremental *inc, const uint8_t *data, size_t len);
+/*
+ * returns the codes of the whole image like nq_decode(). The memory used by
+ * the decode is released, so that only nq_incremental_free() may follow.
+ */
+struct nq_code_list	*nq_incremental_end(struct nq_incremental *inc);
+void			 nq_incremental_free(struct nq_incremental *inc);
+
+/*
+ * Limit the memory used by concurrent nq_decode() calls to about `limit`
+ * bytes (0 meaning no limit). A call that would exceed the budget fails with
+ * the ERR_MEMORY_BUDGET error code, or blocks until enough memory is released
+ * when `wait` is non-zero. Incremental decodes never wait, and no decode waits
+ * for the memory they hold (see struct nq_incremental). While a limit is set,
+ * the quirc instances are not kept between decodes.
+ */
+void	nq_set_memory_budget(size_t limit, int wait);
+
+/*
+ * Reject images of more than max_pixels pixels (0 meaning no limit) with the
+ * ERR_IMAGE_TOO_LARGE error code, right after their header is read. Changing
+ * the limit drops the cached results (see nq_cache_configure()).
+ */
+void	nq_set_max_pixels(size_t max_pixels);
+
+/*
+ * Decode JPEG images of more than `pixels` pixels downscaled by the IDCT (by
+ * 1/2, 1/4 or 1/8) to fit, 0 meaning never. When no QR code is found in the
+ * downscaled image, it is decoded again at full size. Changing the budget
+ * drops the cached results (see nq_cache_configure()).
+ */
+void	nq_set_jpeg_pixel_budget(size_t pixels);
+
+/*
+ * Decode JPEG images having restart markers in horizontal bands on up to
+ * `threads` threads, 1 meaning serially (the default). Other JPEG images are
+ * always decoded serially.
+ */
+void	nq_set_jpeg_threads(unsigned int threads);
+
+/*
+ * Count the thresholding histogram of sequential PNG and JPEG images of at
+ * least `pixels` pixels on a second thread, while their rows are still being
+ * decoded, 0 meaning never (the default).
+ */
+void	nq_set_pipeline_pixels(size_t pixels);
+
+/* how many images took each optional loading path since the process started */
+struct nq_load_stats {
+	uint64_t	jpeg_fast; /* JPEG decoded with NQ_DECODE_JPEG_FAST */
+	uint64_t	jpeg_bands; /* JPEG decoded in bands, see nq_set_jpeg_threads() */
+	uint64_t	pipelined; /* see nq_set_pipeline_pixels() */
+};
+
+void	nq_load_stats(struct nq_load_stats *stats);
 
 #endif /* ndef NODE_QUIRC_DECODE_H */
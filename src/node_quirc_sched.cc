@@ -0,0 +1,240 @@
+/*
+ * node_quirc_sched.cc - node-quirc job scheduling
+ */
+
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+#include "node_quirc_sched.h"
+
+using Nan::HandleScope;
+using Nan::New;
+using Nan::Set;
+
+/* a job waiting for a thread */
+struct NodeQuircPending {
+	NodeQuircJob	*job;
+	uint64_t	 score; /* lowest first */
+};
+
+/* pending jobs, shared between the main thread and the worker threads */
+static struct {
+	uv_mutex_t				 mutex;
+	bool					 mutex_init;
+	uint64_t				 aging = 1000 * 1000 * 1000; /* in ns */
+	std::deque<struct NodeQuircPending>	 queues[NODE_QUIRC_PRIORITY_COUNT];
+	/* main thread only */
+	size_t					 depth;
+	size_t					 max_depth; /* 0 for no limit */
+} s_sched;
+
+/* completion batching state, only ever accessed from the main thread */
+static struct {
+	bool				 enabled;
+	uint64_t			 max_delay; /* in ms */
+	size_t				 max_size;
+	Nan::Callback			 dispatch;
+	Nan::AsyncResource		*resource;
+	uv_timer_t			 timer;
+	bool				 timer_init;
+	std::vector<NodeQuircJob *>	 pending;
+} s_batch;
+
+static NodeQuircJob	*NodeQuircDequeue(void);
+static void	NodeQuircExecute(uv_work_t *req);
+static void	NodeQuircExecuteComplete(uv_work_t *req, int status);
+static void	NodeQuircBatchTimeout(uv_timer_t *timer);
+static void	NodeQuircBatchFlush(void);
+
+
+bool
+NodeQuircQueueJob(NodeQuircJob *job, NodeQuircPriority priority)
+{
+	if (s_sched.max_depth > 0 && s_sched.depth >= s_sched.max_depth)
+		return false;
+
+	if (!s_sched.mutex_init) {
+		if (uv_mutex_init(&s_sched.mutex) != 0)
+			abort();
+		s_sched.mutex_init = true;
+	}
+
+	/*
+	 * Jobs are run by increasing score, i.e. by submission time where each
+	 * class of priority is worth `aging` of waiting. Since every class is
+	 * a FIFO, only their heads have to be compared when dequeuing.
+	 */
+	struct NodeQuircPending pending;
+	pending.job   = job;
+	pending.score = uv_hrtime() + (uint64_t)priority * s_sched.aging;
+
+	uv_mutex_lock(&s_sched.mutex);
+	s_sched.queues[priority].push_back(pending);
+	uv_mutex_unlock(&s_sched.mutex);
+
+	/*
+	 * Each submission queue one "slot" on the libuv thread pool, running
+	 * whatever job is the most urgent once a thread picks it up.
+	 */
+	uv_work_t *req = new uv_work_t;
+	req->data = NULL;
+	uv_queue_work(Nan::GetCurrentEventLoop(), req,
+	    NodeQuircExecute, NodeQuircExecuteComplete);
+
+	s_sched.depth++;
+	return true;
+}
+
+
+size_t
+NodeQuircQueueDepth(void)
+{
+	return (s_sched.depth);
+}
+
+
+void
+NodeQuircSetQueueLimit(size_t max_depth)
+{
+	s_sched.max_depth = max_depth;
+}
+
+
+void
+NodeQuircSetAging(uint64_t aging)
+{
+	s_sched.aging = aging * 1000 * 1000;
+}
+
+
+void
+NodeQuircBatchEnable(v8::Local<v8::Function> dispatch, uint64_t max_delay, size_t max_size)
+{
+	if (!s_batch.timer_init) {
+		uv_timer_init(Nan::GetCurrentEventLoop(), &s_batch.timer);
+		s_batch.timer_init = true;
+	}
+	if (s_batch.resource == NULL)
+		s_batch.resource = new Nan::AsyncResource("node-quirc:batch");
+
+	/* deliver what was batched under the previous settings first */
+	NodeQuircBatchFlush();
+
+	s_batch.dispatch.Reset(dispatch);
+	s_batch.max_delay = max_delay;
+	s_batch.max_size  = (max_size > 0 ? max_size : 1);
+	s_batch.enabled   = true;
+}
+
+
+void
+NodeQuircBatchDisable(void)
+{
+	NodeQuircBatchFlush();
+	s_batch.enabled = false;
+	s_batch.dispatch.Reset();
+}
+
+
+// pop the most urgent pending job, see NodeQuircQueueJob().
+static NodeQuircJob *
+NodeQuircDequeue(void)
+{
+	std::deque<struct NodeQuircPending> *best = NULL;
+
+	uv_mutex_lock(&s_sched.mutex);
+	for (std::deque<struct NodeQuircPending> &queue : s_sched.queues) {
+		if (queue.empty())
+			continue;
+		if (best == NULL || queue.front().score < best->front().score)
+			best = &queue;
+	}
+	/* there is always at least as many pending jobs as queued slots */
+	NodeQuircJob *job = best->front().job;
+	best->pop_front();
+	uv_mutex_unlock(&s_sched.mutex);
+
+	return (job);
+}
+
+
+// Executed inside the worker-thread.
+static void
+NodeQuircExecute(uv_work_t *req)
+{
+	NodeQuircJob *job = NodeQuircDequeue();
+
+	req->data = job;
+	job->Execute();
+}
+
+
+// Executed on the main thread once the job has been run. When batching, the
+// job is only recorded here so that no V8 work is done per completion.
+static void
+NodeQuircExecuteComplete(uv_work_t *req, int status)
+{
+	NodeQuircJob *job = static_cast<NodeQuircJob *>(req->data);
+
+	(void)status;
+	delete req;
+	if (!s_batch.enabled) {
+		/* the callback may queue a job, so make room first */
+		s_sched.depth--;
+		job->WorkComplete();
+		job->Destroy();
+		return;
+	}
+
+	s_batch.pending.push_back(job);
+	if (s_batch.pending.size() >= s_batch.max_size)
+		NodeQuircBatchFlush();
+	else if (!uv_is_active((uv_handle_t *)&s_batch.timer))
+		uv_timer_start(&s_batch.timer, NodeQuircBatchTimeout, s_batch.max_delay, 0);
+}
+
+
+static void
+NodeQuircBatchTimeout(uv_timer_t *timer)
+{
+	(void)timer;
+	NodeQuircBatchFlush();
+}
+
+
+// deliver every pending completion through a single dispatch(batch) call,
+// batch being a flat [callback, err, result, callback, err, result, ...]
+// array.
+static void
+NodeQuircBatchFlush(void)
+{
+	if (s_batch.timer_init)
+		uv_timer_stop(&s_batch.timer);
+	if (s_batch.pending.empty())
+		return;
+
+	std::vector<NodeQuircJob *> jobs;
+	jobs.swap(s_batch.pending);
+
+	HandleScope scope;
+	v8::Local<v8::Array> batch = New<v8::Array>((int)(jobs.size() * 3));
+	uint32_t index = 0;
+	for (NodeQuircJob *job : jobs) {
+		v8::Local<v8::Value> argv[] = {
+			Nan::Undefined(), /* err */
+			Nan::Undefined(), /* result */
+		};
+		(void)job->Results(argv);
+		Set(batch, index++, job->CallbackFunction());
+		Set(batch, index++, argv[0]);
+		Set(batch, index++, argv[1]);
+		job->Destroy();
+		s_sched.depth--;
+	}
+
+	v8::Local<v8::Value> argv[] = {
+		batch,
+	};
+	s_batch.resource->runInAsyncScope(Nan::GetCurrentContext()->Global(), *s_batch.dispatch, 1, argv);
+}
@@ -0,0 +1,80 @@
+#ifndef NODE_QUIRC_SCHED_H
+#define NODE_QUIRC_SCHED_H
+/*
+ * node_quirc_sched.h - node-quirc job scheduling
+ */
+
+#include <nan.h>
+
+/*
+ * Base class of every asynchronous job run by node-quirc.
+ *
+ * Instead of calling its callback directly, a job builds the callback
+ * arguments through Results() so that the scheduler may either deliver them
+ * right away or coalesce several completions into a single call into JS.
+ */
+class NodeQuircJob: public Nan::AsyncWorker
+{
+	public:
+
+	NodeQuircJob(Nan::Callback *callback, const char *resource_name):
+	    Nan::AsyncWorker(callback, resource_name)
+	{ }
+
+	// Build the callback arguments into argv and return their count (one
+	// for an error, two for a result). Called on the main thread.
+	virtual int Results(v8::Local<v8::Value> argv[2]) = 0;
+
+	// the JS function to call with Results()
+	v8::Local<v8::Function> CallbackFunction()
+	{
+		return callback->GetFunction();
+	}
+
+
+	protected:
+
+	void HandleOKCallback()
+	{
+		v8::Local<v8::Value> argv[2];
+		int argc = Results(argv);
+		callback->Call(argc, argv, async_resource);
+	}
+};
+
+/* job priority classes, from the most to the least urgent */
+enum NodeQuircPriority {
+	NODE_QUIRC_PRIORITY_INTERACTIVE = 0,
+	NODE_QUIRC_PRIORITY_NORMAL,
+	NODE_QUIRC_PRIORITY_BULK,
+	NODE_QUIRC_PRIORITY_COUNT, /* not a priority */
+};
+
+// Queue job on the libuv thread pool, see NodeQuircJob. Pending jobs are not
+// run in submission order: each time a thread becomes available it picks the
+// most urgent one, see NodeQuircSetAging().
+// Returns false when the queue is full, in which case the caller still owns
+// job, true otherwise.
+bool	NodeQuircQueueJob(NodeQuircJob *job, NodeQuircPriority priority);
+
+// Number of jobs queued, running or waiting for their completion to be
+// delivered.
+size_t	NodeQuircQueueDepth(void);
+
+// Set the maximum queue depth, 0 meaning no limit.
+void	NodeQuircSetQueueLimit(size_t max_depth);
+
+// Set the priority aging delay. A pending job is run before any job of a
+// more urgent class queued more than aging milliseconds per class of
+// difference after it, so that less urgent jobs are never starved.
+void	NodeQuircSetAging(uint64_t aging);
+
+// Enable completion batching: finished jobs are delivered together through
+// a single call to dispatch(batch) at most max_delay milliseconds after the
+// first one completed, or as soon as max_size of them are pending.
+void	NodeQuircBatchEnable(v8::Local<v8::Function> dispatch,
+	    uint64_t max_delay, size_t max_size);
+// Disable completion batching, flushing any pending completion.
+void	NodeQuircBatchDisable(void);
+
+#endif /* ndef NODE_QUIRC_SCHED_H */
@@ -1,8 +1,11 @@
 'use strict';
 
 const fs   = require("fs");
+const os   = require("os");
 const path = require("path");
 const util = require("util");
+const zlib = require("zlib");
+const { execFileSync } = require("child_process");
 const jpeg = require("jpeg-js");
 
 const chai   = require("chai");
@@ -45,6 +48,12 @@ const qr_eci = {
     ECI_UTF_8:       "UTF_8",
 };
 
+const priorities = {
+    PRIORITY_INTERACTIVE: "interactive",
+    PRIORITY_NORMAL:      "normal",
+    PRIORITY_BULK:        "bulk",
+};
+
 const extensions = ["png", "jpeg"];
 
 /* helpers for test data files */
@@ -56,6 +65,151 @@ function read_test_data(local_path) {
     return fs.readFileSync(test_data_path(local_path));
 }
 
+/*
+ * A PNG of the given color type made of raw 8-bit pixels, without gAMA. With a
+ * palette of [r, g, b] colors, pixels are indexes packed in depth bits.
+ */
+function encode_png(width, height, color_type, pixels, { depth = 8, palette } = {}) {
+    const crc_table = Array(256).fill(0).map((_, n) => {
+        let c = n;
+        for (let k = 0; k < 8; k++) {
+            c = (c & 1 ? 0xedb88320 ^ (c >>> 1) : c >>> 1);
+        }
+        return c >>> 0;
+    });
+    function chunk(type, data) {
+        const buf = Buffer.alloc(12 + data.length);
+        buf.writeUInt32BE(data.length, 0);
+        buf.write(type, 4, "ascii");
+        data.copy(buf, 8);
+        let crc = 0xffffffff;
+        for (const byte of buf.subarray(4, 8 + data.length)) {
+            crc = crc_table[(crc ^ byte) & 0xff] ^ (crc >>> 8);
+        }
+        buf.writeUInt32BE((crc ^ 0xffffffff) >>> 0, 8 + data.length);
+        return buf;
+    }
+    const channels = pixels.length / width / height;
+    const ihdr = Buffer.from([0, 0, 0, 0, 0, 0, 0, 0, depth, color_type, 0, 0, 0]);
+    ihdr.writeUInt32BE(width, 0);
+    ihdr.writeUInt32BE(height, 4);
+    const stride = Math.ceil(width * channels * depth / 8);
+    const raw = Buffer.alloc((stride + 1) * height);
+    for (let y = 0; y < height; y++) {
+        // filter type 0, then the row as it is
+        const row = y * width * channels;
+        const out = y * (stride + 1) + 1;
+        if (depth === 8) {
+            Buffer.from(pixels.subarray(row, row + width * channels)).copy(raw, out);
+            continue;
+        }
+        for (let x = 0; x < width; x++) {
+            raw[out + Math.floor(x * depth / 8)] |= pixels[row + x] << (8 - depth - x * depth % 8);
+        }
+    }
+    return Buffer.concat([
+        Buffer.from([0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a]),
+        chunk("IHDR", ihdr),
+        ...(palette ? [chunk("PLTE", Buffer.from([].concat(...palette)))] : []),
+        chunk("IDAT", zlib.deflateSync(raw)),
+        chunk("IEND", Buffer.alloc(0)),
+    ]);
+}
+
+/* a PGM, PPM or 24-bit BMP image file of the RGBA pixels from jpeg.decode() */
+function encode_uncompressed(format, { width, height, data }) {
+    if (format === "bmp") {
+        return encode_bmp({ width, height, data });
+    }
+    const channels = (format === "pgm" ? 1 : 3);
+    const header = Buffer.from(`P${channels === 1 ? 5 : 6}\n${width} ${height}\n255\n`);
+    const raster = Buffer.alloc(width * height * channels);
+    const first = (channels === 1 ? 1 : 0); // green is close enough to gray
+    for (let i = 0; i < width * height; i++) {
+        data.copy(raster, i * channels, i * 4 + first, i * 4 + first + channels);
+    }
+    return Buffer.concat([header, raster]);
+}
+
+/* a PGM image file of the green of the RGBA pixels, scaled to maxval */
+function encode_pgm({ width, height, data }, maxval) {
+    const bytes = (maxval > 255 ? 2 : 1);
+    const header = Buffer.from(`P5\n${width} ${height}\n${maxval}\n`);
+    const raster = Buffer.alloc(width * height * bytes);
+    for (let i = 0; i < width * height; i++) {
+        raster.writeUIntBE(Math.round(data[i * 4 + 1] * maxval / 255), i * bytes, bytes);
+    }
+    return Buffer.concat([header, raster]);
+}
+
+/*
+ * A BMP image file of the RGBA pixels: 24-bit by default, 32-bit BGRX with
+ * bitfields, or 8-bit with a gray palette (the green being the index). core
+ * selects the OS/2 BITMAPCOREHEADER, and top_down rows stored from the top.
+ */
+function encode_bmp({ width, height, data }, { bpp = 24, bitfields = false, core = false, top_down = false } = {}) {
+    const header = (core ? 12 : 40);
+    const masks = (bitfields ? 12 : 0);
+    const entry = (core ? 3 : 4);
+    const palette = (bpp === 8 ? 256 * entry : 0);
+    const offset = 14 + header + masks + palette;
+    const stride = Math.ceil(width * bpp / 32) * 4;
+    const img = Buffer.alloc(offset + stride * height);
+    img.write("BM", 0, "ascii");
+    img.writeUInt32LE(img.length, 2);
+    img.writeUInt32LE(offset, 10);      // raster offset
+    img.writeUInt32LE(header, 14);
+    if (core) {
+        img.writeUInt16LE(width, 18);
+        img.writeUInt16LE(height, 20);
+        img.writeUInt16LE(1, 22);       // planes
+        img.writeUInt16LE(bpp, 24);
+    } else {
+        img.writeInt32LE(width, 18);
+        img.writeInt32LE(top_down ? -height : height, 22);
+        img.writeUInt16LE(1, 26);       // planes
+        img.writeUInt16LE(bpp, 28);
+        img.writeUInt32LE(bitfields ? 3 : 0, 30); // BI_BITFIELDS or BI_RGB
+    }
+    if (bitfields) {
+        img.writeUInt32LE(0x00FF0000, 54);
+        img.writeUInt32LE(0x0000FF00, 58);
+        img.writeUInt32LE(0x000000FF, 62);
+    }
+    for (let i = 0; i < palette / entry; i++) {
+        img.fill(i, 14 + header + i * entry, 14 + header + i * entry + 3);
+    }
+    for (let y = 0; y < height; y++) {
+        const row = offset + (top_down ? y : height - 1 - y) * stride;
+        for (let x = 0; x < width; x++) {
+            const i = (y * width + x) * 4;
+            if (bpp === 8) {
+                img[row + x] = data[i + 1];
+            } else {
+                img[row + x * bpp / 8]     = data[i + 2];
+                img[row + x * bpp / 8 + 1] = data[i + 1];
+                img[row + x * bpp / 8 + 2] = data[i];
+            }
+        }
+    }
+    return img;
+}
+const uncompressed_formats = ["pgm", "ppm", "bmp"];
+
+/* a bilevel raw image of the RGBA pixels from jpeg.decode(), 1 being black */
+function encode_bilevel({ width, height, data }) {
+    const stride = Math.ceil(width / 8);
+    const bits = Buffer.alloc(stride * height);
+    for (let y = 0; y < height; y++) {
+        for (let x = 0; x < width; x++) {
+            if (data[(y * width + x) * 4 + 1] < 128) {
+                bits[y * stride + (x >> 3)] |= 0x80 >> (x & 7);
+            }
+        }
+    }
+    return { width, height, data: bits, format: "bilevel" };
+}
+
 describe("constants", function () {
     describe("QR-code versions", function () {
         it("should set VERSION_MIN to 1", function () {
@@ -89,6 +243,14 @@ describe("constants", function () {
             });
         }
     });
+
+    describe("decode priorities", function () {
+        for (const [key, value] of Object.entries(priorities)) {
+            it(`should set ${key} to ${value}`, function () {
+                expect(quirc.constants[key]).to.exist.and.to.eql(value);
+            });
+        }
+    });
 });
 
 describe("decode()", function () {
@@ -116,6 +278,267 @@ describe("decode()", function () {
                 quirc.decode(Buffer.from(""), "not a function");
             }).to.throw(TypeError, "callback must be a function");
         });
+        it("should throw when callback is null", function () {
+            expect(function () {
+                quirc.decode(Buffer.from(""), null);
+            }).to.throw(TypeError, "callback must be a function");
+        });
+        it("should return a Promise when options are given without callback", function () {
+            const p = quirc.decode(Buffer.from("data"), {});
+            expect(p).to.be.a("Promise");
+            p.catch((e) => { /* ignored */ });
+        });
+        it("should throw when options is not an object", function () {
+            expect(function () {
+                quirc.decode(Buffer.from(""), "not an object", function dummy() { });
+            }).to.throw(TypeError, "options must be an object");
+        });
+        it("should throw when priority is unknown", function () {
+            expect(function () {
+                quirc.decode(Buffer.from(""), { priority: "urgent" }, function dummy() { });
+            }).to.throw(TypeError, "unexpected priority value: urgent");
+        });
+    });
+
+    context("binary output", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+        });
+
+        it("should throw when output is unknown", function () {
+            expect(function () {
+                quirc.decode(hello_plus_world, { output: "xml" }, function dummy() { });
+            }).to.throw(TypeError, "unexpected output value: xml");
+        });
+        it("should yield a Buffer", function (done) {
+            quirc.decode(hello_plus_world, { output: "binary" }, function (err, buffer) {
+                expect(err).to.not.exist;
+                expect(buffer).to.be.an.instanceof(Buffer);
+                expect(buffer.toString("latin1", 0, 4)).to.eql("NQRB");
+                expect(buffer.readUInt32LE(4)).to.eql(2);
+                return done();
+            });
+        });
+        it("should be readable through BinaryResults", function (done) {
+            quirc.decode(hello_plus_world, { output: "binary" }, function (err, buffer) {
+                const codes = new quirc.BinaryResults(buffer);
+                expect(codes.length).to.eql(2);
+                expect(codes.err(0)).to.not.exist;
+                expect(codes.version(0)).to.eql(1);
+                expect(codes.ecc_level(0)).to.eql("H");
+                expect(codes.mask(0)).to.eql(1);
+                expect(codes.mode(0)).to.eql("BYTE");
+                expect(codes.eci(0)).to.eql("UTF_8");
+                expect(codes.corners(0)).to.have.length(4);
+                expect(codes.data(0).toString()).to.eql("Hello");
+                expect(codes.at(1).mask).to.eql(3);
+                expect(codes.at(1).data.toString()).to.eql("World");
+                expect([...codes]).to.have.length(2);
+                return done();
+            });
+        });
+        it("should read codes shaped like the objects output plus corners", function () {
+            return Promise.all([
+                quirc.decode(hello_plus_world, { output: "binary" }),
+                quirc.decode(hello_plus_world),
+            ]).then(([buffer, objects]) => {
+                const codes = new quirc.BinaryResults(buffer);
+                for (let i = 0; i < codes.length; i++) {
+                    const { corners, ...code } = codes.at(i);
+                    expect(code).to.eql(objects[i]);
+                    expect(corners).to.eql(codes.corners(i));
+                }
+            });
+        });
+        it("should yield an empty result when the image has no QR Code", function (done) {
+            quirc.decode(read_test_data("1x1.png"), { output: "binary" }, function (err, buffer) {
+                expect(err).to.not.exist;
+                expect(new quirc.BinaryResults(buffer).length).to.eql(0);
+                return done();
+            });
+        });
+    });
+
+    context("string encoding", function () {
+        it("should throw with the binary output", function () {
+            expect(function () {
+                quirc.decode(Buffer.from(""), { output: "binary", encoding: "string" }, () => {});
+            }).to.throw(TypeError, "string encoding requires the objects output");
+        });
+        it("should yield the data as strings", function (done) {
+            quirc.decode(read_test_data("Hello+World.png"), { encoding: "string" }, function (err, codes) {
+                expect(err).to.not.exist;
+                expect(codes).to.be.an('array').and.to.have.length(2);
+                expect(codes[0].data).to.eql("Hello");
+                expect(codes[1].data).to.eql("World");
+                return done();
+            });
+        });
+        it("should decode the data according to the ECI", function (done) {
+            const image = read_test_data("eci.png");
+            quirc.decode(image, function (err, raw) {
+                expect(err).to.not.exist;
+                quirc.decode(image, { encoding: "string" }, function (err, codes) {
+                    expect(err).to.not.exist;
+                    expect(codes[0].eci).to.eql("UTF_8");
+                    expect(codes[0].data).to.eql(raw[0].data.toString("utf8"));
+                    return done();
+                });
+            });
+        });
+    });
+
+    context("fast JPEG decoding", function () {
+        it("should throw with an unexpected jpeg value", function () {
+            expect(function () {
+                quirc.decode(Buffer.from(""), { jpeg: "turbo" }, () => {});
+            }).to.throw(TypeError, "unexpected jpeg value: turbo");
+        });
+        // see also the "loadStats()" tests.
+    });
+
+    context("caller-provided output buffer", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+        });
+
+        it("should write the codes into the buffer", function (done) {
+            const output = Buffer.alloc(4096);
+            const codes = new quirc.BinaryResults(output);
+            quirc.decode(hello_plus_world, { output }, function (err, count) {
+                expect(err).to.not.exist;
+                expect(count).to.eql(2);
+                expect(codes.length).to.eql(2);
+                expect(codes.data(0).toString()).to.eql("Hello");
+                expect(codes.data(1).toString()).to.eql("World");
+                return done();
+            });
+        });
+        it("should yield an Error when the buffer is too small", function (done) {
+            quirc.decode(hello_plus_world, { output: Buffer.alloc(16) }, function (err, count) {
+                expect(err).to.exist.and.to.be.an("error");
+                expect(err.message).to.eql("output buffer is too small");
+                expect(err.code).to.eql(quirc.constants.ERR_OUTPUT_TOO_SMALL);
+                return done();
+            });
+        });
+    });
+
+    context("priorities", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+        });
+
+        for (const priority of Object.values(priorities)) {
+            it(`should yield the QR Codes with ${priority} priority`, function (done) {
+                quirc.decode(hello_plus_world, { priority }, function (err, codes) {
+                    expect(err).to.not.exist;
+                    expect(codes).to.be.an('array').and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("Hello");
+                    expect(codes[1].data.toString()).to.eql("World");
+                    return done();
+                });
+            });
+        }
+        it("should run every decode of a mixed priorities burst", function () {
+            const decodes = Array(12).fill(0).map((_, i) => quirc.decode(
+                hello_plus_world,
+                { priority: Object.values(priorities)[i % 3] }
+            ));
+            return Promise.all(decodes).then((results) => {
+                for (const codes of results) {
+                    expect(codes).to.be.an('array').and.to.have.length(2);
+                }
+            });
+        });
+
+        context("when every thread of the pool is busy", function () {
+            const threads = Number(process.env.UV_THREADPOOL_SIZE) || 4;
+            let dir, fifos, blocked;
+            before(function () {
+                if (process.platform === "win32") {
+                    this.skip();
+                }
+                dir = fs.mkdtempSync(path.join(os.tmpdir(), "node-quirc-"));
+            });
+            after(function () {
+                if (dir) {
+                    fs.readdirSync(dir).forEach((name) => fs.unlinkSync(path.join(dir, name)));
+                    fs.rmdirSync(dir);
+                }
+            });
+            // occupy every thread with a decodeFile() blocked opening a
+            // FIFO. Being the most urgent and the first submitted, they are
+            // the first jobs run however late the threads pick them up.
+            beforeEach(function () {
+                fifos = Array(threads).fill(0).map((_, i) => path.join(dir, `fifo-${i}`));
+                fifos.forEach((fifo) => execFileSync("mkfifo", [fifo]));
+                blocked = fifos.map((fifo) => quirc.decodeFile(fifo, { priority: "interactive" }).catch(() => { }));
+            });
+            afterEach(function () {
+                return Promise.all(fifos.map(unblock)).then(() => Promise.all(blocked));
+            });
+            // let a thread blocked opening fifo go, once one is.
+            function unblock(fifo) {
+                return new Promise((resolve, reject) => {
+                    (function retry() {
+                        try {
+                            fs.closeSync(fs.openSync(fifo, fs.constants.O_WRONLY | fs.constants.O_NONBLOCK));
+                            fs.unlinkSync(fifo);
+                            return resolve();
+                        } catch (e) {
+                            if (e.code === "ENOENT") {
+                                return resolve(); // already unblocked
+                            } else if (e.code !== "ENXIO") {
+                                return reject(e);
+                            }
+                            setTimeout(retry, 1);
+                        }
+                    })();
+                });
+            }
+            // queue a decode, pushing name into order once it completes.
+            function queue(order, name, priority) {
+                return quirc.decode(hello_plus_world, { priority }).then(() => order.push(name));
+            }
+
+            it("should run interactive decodes before queued bulk ones", function () {
+                const order = [];
+                const decodes = [
+                    queue(order, "bulk 1", "bulk"),
+                    queue(order, "bulk 2", "bulk"),
+                    queue(order, "normal", "normal"),
+                    queue(order, "interactive", "interactive"),
+                ];
+                // a single available thread runs them one at a time.
+                return unblock(fifos[0]).then(() => Promise.all(decodes)).then(() => {
+                    expect(order).to.eql(["interactive", "normal", "bulk 1", "bulk 2"]);
+                });
+            });
+            context("with a short priorityAging", function () {
+                before(function () {
+                    quirc.configure({ priorityAging: 1 });
+                });
+                after(function () {
+                    quirc.configure({ priorityAging: 1000 });
+                });
+
+                it("should run bulk decodes that waited long enough first", function () {
+                    const order = [];
+                    const bulk = queue(order, "bulk", "bulk");
+                    // wait for more than two priorityAging
+                    return new Promise((resolve) => setTimeout(resolve, 20)).then(() => {
+                        const interactive = queue(order, "interactive", "interactive");
+                        return unblock(fifos[0]).then(() => Promise.all([bulk, interactive]));
+                    }).then(() => {
+                        expect(order).to.eql(["bulk", "interactive"]);
+                    });
+                });
+            });
+        });
     });
 
     context("when the buffer data is empty", function () {
@@ -138,6 +561,42 @@ describe("decode()", function () {
         });
     });
 
+    context("when the PNG data is truncated", function () {
+        const truncations = {
+            "after the signature": (png) => png.slice(0, 8),
+            "within the IHDR chunk": (png) => png.slice(0, 20),
+            "within the IDAT data": (png) => png.slice(0, png.length >> 1),
+            "before the IEND chunk": (png) => png.slice(0, png.length - 12),
+            "by one byte": (png) => png.slice(0, png.length - 1),
+        };
+        for (const [key, truncate] of Object.entries(truncations)) {
+            it(`should yield an Error when cut ${key}`, function (done) {
+                const image = truncate(read_test_data("big_image_with_two_qrcodes.png"));
+                quirc.decode(image, function (err, codes) {
+                    expect(err).to.exist.and.to.be.an("error");
+                    expect(err.message).to.eql("failed to load image");
+                    return done();
+                });
+            });
+        }
+    });
+
+    context("when the PNG data is followed by trailing bytes", function () {
+        it("should ignore them", function (done) {
+            const image = Buffer.concat([
+                read_test_data("Hello+World.png"),
+                Buffer.from("garbage".repeat(100)),
+            ]);
+            quirc.decode(image, function (err, codes) {
+                expect(err).to.not.exist;
+                expect(codes).to.be.an('array').and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("Hello");
+                expect(codes[1].data.toString()).to.eql("World");
+                return done();
+            });
+        });
+    });
+
     extensions.forEach(function (ext) {
         context(`${ext}`, function () {
             context("when the image file has no QR Code", function () {
@@ -385,6 +844,168 @@ describe("decode()", function () {
                 done();
             });
         });
+
+        it("should read QR codes from grayscale raw image data", function () {
+            const rgba = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+            const gray = Buffer.alloc(rgba.width * rgba.height);
+            for (let i = 0; i < gray.length; i++) {
+                gray[i] = rgba.data[i * 4 + 1]; // green is close enough
+            }
+            const image = { width: rgba.width, height: rgba.height, data: gray };
+            return quirc.decode(image).then((codes) => {
+                expect(codes).to.be.an("array").and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("from javascript");
+                expect(codes[1].data.toString()).to.eql("here comes qr!");
+            });
+        });
+
+        it("should read QR codes from bilevel raw image data", function () {
+            const rgba = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+            return quirc.decode(encode_bilevel(rgba)).then((codes) => {
+                expect(codes).to.be.an("array").and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("from javascript");
+                expect(codes[1].data.toString()).to.eql("here comes qr!");
+            });
+        });
+
+        it("should throw when a bilevel image has an unexpected length", function () {
+            const image = { width: 9, height: 2, data: Buffer.alloc(2), format: "bilevel" };
+            expect(function () {
+                quirc.decode(image, function dummy() { });
+            }).to.throw(Error, "unexpected bilevel image length: 2, expected 4");
+        });
+
+        it("should throw when the image format is unknown", function () {
+            const image = { width: 1, height: 1, data: Buffer.alloc(1), format: "cmyk" };
+            expect(function () {
+                quirc.decode(image, function dummy() { });
+            }).to.throw(Error, "unexpected format value for image: cmyk");
+        });
+    });
+
+    context("PNM and BMP images", function () {
+        let rgba;
+        before(function () {
+            rgba = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+        });
+
+        for (const format of uncompressed_formats) {
+            it(`should read QR codes from ${format} images`, function () {
+                return quirc.decode(encode_uncompressed(format, rgba)).then((codes) => {
+                    expect(codes).to.be.an("array").and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("from javascript");
+                    expect(codes[1].data.toString()).to.eql("here comes qr!");
+                });
+            });
+        }
+        it("should read QR codes from pbm images", function () {
+            const { width, height, data } = encode_bilevel(rgba);
+            const img = Buffer.concat([Buffer.from(`P4\n${width} ${height}\n`), data]);
+            return quirc.decode(img).then((codes) => {
+                expect(codes).to.be.an("array").and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("from javascript");
+                expect(codes[1].data.toString()).to.eql("here comes qr!");
+            });
+        });
+        const variants = {
+            "RGBA pam": ({ width, height, data }) => Buffer.concat([
+                Buffer.from(`P7\nWIDTH ${width}\nHEIGHT ${height}\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n`),
+                data,
+            ]),
+            "16-bit pgm": (rgba) => encode_pgm(rgba, 65535),
+            "maxval 15 pgm": (rgba) => encode_pgm(rgba, 15),
+            "maxval 1000 16-bit pgm": (rgba) => encode_pgm(rgba, 1000),
+            "palette bmp": (rgba) => encode_bmp(rgba, { bpp: 8 }),
+            "top-down bmp": (rgba) => encode_bmp(rgba, { top_down: true }),
+            "OS/2 palette bmp": (rgba) => encode_bmp(rgba, { bpp: 8, core: true }),
+            "OS/2 bmp": (rgba) => encode_bmp(rgba, { core: true }),
+            "BI_BITFIELDS bmp": (rgba) => encode_bmp(rgba, { bpp: 32, bitfields: true }),
+        };
+        for (const [name, encode] of Object.entries(variants)) {
+            it(`should read QR codes from ${name} images`, function () {
+                return quirc.decode(encode(rgba)).then((codes) => {
+                    expect(codes).to.be.an("array").and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("from javascript");
+                    expect(codes[1].data.toString()).to.eql("here comes qr!");
+                });
+            });
+        }
+
+        const white = { width: 8, height: 8, data: Buffer.alloc(8 * 8 * 4, 255) };
+        const malformed = {
+            "truncated": () => {
+                const img = encode_uncompressed("ppm", rgba);
+                return img.subarray(0, img.length - 1);
+            },
+            "a pnm with a truncated header": () => Buffer.from("P6\n2560"),
+            "a bmp with a truncated header": () => encode_bmp(white).subarray(0, 20),
+            "a pnm with a zero width": () => Buffer.concat([Buffer.from("P5\n0 8\n255\n"), Buffer.alloc(64)]),
+            "a bmp with a zero height": () => {
+                const img = encode_bmp(white);
+                img.writeInt32LE(0, 22);
+                return img;
+            },
+            "a pgm with a zero maxval": () => Buffer.concat([Buffer.from("P5\n8 8\n0\n"), Buffer.alloc(64)]),
+            "a pgm with a maxval above 65535": () => Buffer.concat([Buffer.from("P5\n8 8\n65536\n"), Buffer.alloc(128)]),
+            "a pgm whose header ends in a comment": () => Buffer.from("P5\n8 8\n# no maxval nor raster"),
+        };
+        for (const [name, encode] of Object.entries(malformed)) {
+            it(`should yield an Error when the image is ${name}`, function () {
+                return quirc.decode(encode()).then(() => {
+                    throw new Error("expected an error");
+                }, (err) => {
+                    expect(err.message).to.eql("failed to load image");
+                });
+            });
+        }
+    });
+
+    context("RGB PNG images", function () {
+        let rgba;
+        before(function () {
+            rgba = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+        });
+
+        for (const [color_type, channels] of [[2, 3], [6, 4]]) {
+            it(`should read QR codes from ${channels}-channel PNG images`, function () {
+                const pixels = Buffer.alloc(rgba.width * rgba.height * channels);
+                for (let i = 0; i < rgba.width * rgba.height; i++) {
+                    rgba.data.copy(pixels, i * channels, i * 4, i * 4 + channels);
+                }
+                const image = encode_png(rgba.width, rgba.height, color_type, pixels);
+                return quirc.decode(image).then((codes) => {
+                    expect(codes).to.be.an("array").and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("from javascript");
+                    expect(codes[1].data.toString()).to.eql("here comes qr!");
+                });
+            });
+        }
+    });
+
+    context("1-bit palette PNG images", function () {
+        let rgba;
+        before(function () {
+            rgba = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+        });
+
+        // gray 100 on gray 101, too close for the thresholding to tell them
+        // apart: only the 1-bit path, which knows which one is darker, can
+        // read them, whatever their order in the palette.
+        for (const dark of [0, 1]) {
+            it(`should read QR codes in two close grays, the darker being color ${dark}`, function () {
+                const indexes = Buffer.alloc(rgba.width * rgba.height);
+                for (let i = 0; i < indexes.length; i++) {
+                    indexes[i] = (rgba.data[i * 4 + 1] < 128 ? dark : 1 - dark);
+                }
+                const palette = (dark === 0 ? [[100, 100, 100], [101, 101, 101]] : [[101, 101, 101], [100, 100, 100]]);
+                const image = encode_png(rgba.width, rgba.height, 3, indexes, { depth: 1, palette });
+                return quirc.decode(image).then((codes) => {
+                    expect(codes).to.be.an("array").and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("from javascript");
+                    expect(codes[1].data.toString()).to.eql("here comes qr!");
+                });
+            });
+        }
     });
 
     context("regressions", function () {
@@ -410,3 +1031,878 @@ describe("decode()", function () {
         });
     });
 });
+
+describe("decodeFile()", function () {
+    it("should throw when path is not a string", function () {
+        expect(function () {
+            quirc.decodeFile(42, function dummy() { });
+        }).to.throw(TypeError, "path must be a string");
+    });
+    it("should yield an Error when the file does not exist", function (done) {
+        const missing = test_data_path("missing.png");
+        quirc.decodeFile(missing, function (err, codes) {
+            expect(err).to.exist.and.to.be.an("error");
+            expect(err.code).to.eql("ENOENT");
+            expect(err.path).to.eql(missing);
+            return done();
+        });
+    });
+    it("should yield an Error when the path is empty", function (done) {
+        quirc.decodeFile("", function (err, codes) {
+            expect(err).to.exist.and.to.be.an("error");
+            expect(err.code).to.eql("ENOENT");
+            return done();
+        });
+    });
+    it("should yield an Error when the file is not an image", function (done) {
+        quirc.decodeFile(__filename, function (err, codes) {
+            expect(err).to.exist.and.to.be.an("error");
+            expect(err.message).to.eql("failed to load image");
+            return done();
+        });
+    });
+    for (const ext of extensions) {
+        it(`should yield the QR Codes of a ${ext} file`, function () {
+            return quirc.decodeFile(test_data_path(`Hello+World.${ext}`)).then((codes) => {
+                expect(codes).to.be.an('array').and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("Hello");
+                expect(codes[1].data.toString()).to.eql("World");
+            });
+        });
+    }
+});
+
+describe("locate()", function () {
+    it("should throw when given an output option", function () {
+        expect(function () {
+            quirc.locate(Buffer.from(""), { output: "binary" }, function dummy() { });
+        }).to.throw(TypeError, "locate() only supports the priority and jpeg options");
+    });
+    it("should yield an Error when the image can't be loaded", function (done) {
+        quirc.locate(Buffer.from("Hello World"), function (err, codes) {
+            expect(err).to.exist.and.to.be.an("error");
+            expect(err.message).to.eql("failed to load image");
+            return done();
+        });
+    });
+    for (const ext of extensions) {
+        it(`should yield the position of every QR code in a ${ext} image`, function () {
+            const image = read_test_data(`big_image_with_two_qrcodes.${ext}`);
+            return Promise.all([
+                quirc.locate(image),
+                quirc.decode(image, { output: "binary" }),
+            ]).then(([locations, buffer]) => {
+                const codes = new quirc.BinaryResults(buffer);
+                expect(locations).to.be.an('array').and.to.have.length(2);
+                for (let i = 0; i < locations.length; i++) {
+                    expect(locations[i].size).to.eql(17 + 4 * codes.version(i));
+                    expect(locations[i].corners).to.eql(codes.corners(i));
+                }
+            });
+        });
+    }
+});
+
+describe("decodeGrids()", function () {
+    // the cell bitmaps of the Hello+World.png codes, as sampled by quirc.
+    const hello = {
+        size: 21,
+        cell_bitmap: Buffer.from(
+            "7fcc3fa80a764dddaea9db3574838ae05ff5075000e4a3ef84" +
+            "4af989dfc31402c4fe01b2c75f8f0cca9b5d52adcb4875ede9" +
+            "20bfff677301", "hex"),
+    };
+    const world = {
+        size: 21,
+        cell_bitmap: Buffer.from(
+            "7fdc3fc80a7679dd2ea5dbb57583b8e05ff507c800cc6d4110" +
+            "d1f5d1e0c3a4f58d2900bee0df7509d29e5d94a4eb68741d8d" +
+            "209af5a75f00", "hex"),
+    };
+    // mirror a grid along its diagonal, like a code seen from behind.
+    function flip({ size, cell_bitmap }) {
+        const flipped = Buffer.alloc(cell_bitmap.length);
+        for (let y = 0; y < size; y++) {
+            for (let x = 0; x < size; x++) {
+                const from = y * size + x, to = x * size + y;
+                if (cell_bitmap[from >> 3] & (1 << (from & 7))) {
+                    flipped[to >> 3] |= 1 << (to & 7);
+                }
+            }
+        }
+        return { size, cell_bitmap: flipped };
+    }
+
+    it("should throw when grids is not an array", function () {
+        expect(function () {
+            quirc.decodeGrids(hello, function dummy() { });
+        }).to.throw(TypeError, "grids must be an array");
+    });
+    it("should throw when a grid size is not a QR-code size", function () {
+        expect(function () {
+            quirc.decodeGrids([{ ...hello, size: 22 }], function dummy() { });
+        }).to.throw(TypeError, "unexpected grid size value: 22");
+    });
+    it("should throw when a cell_bitmap is too small", function () {
+        expect(function () {
+            quirc.decodeGrids([{ size: 25, cell_bitmap: hello.cell_bitmap }], function dummy() { });
+        }).to.throw(TypeError, "cell_bitmap must be a Uint8Array of at least 79 bytes");
+    });
+    it("should yield an empty array when given no grid", function () {
+        return quirc.decodeGrids([]).then((codes) => {
+            expect(codes).to.be.an('array').and.to.have.length(0);
+        });
+    });
+    it("should yield one code per grid, flipped or not", function () {
+        return quirc.decodeGrids([hello, flip(world)]).then((codes) => {
+            expect(codes).to.be.an('array').and.to.have.length(2);
+            expect(codes[0].data.toString()).to.eql("Hello");
+            expect(codes[1].data.toString()).to.eql("World");
+        });
+    });
+    it("should yield an err for a grid that can't be decoded", function () {
+        const garbage = { size: 21, cell_bitmap: Buffer.alloc(56, 0x55) };
+        return quirc.decodeGrids([garbage, hello], { encoding: "string" }).then((codes) => {
+            expect(codes).to.be.an('array').and.to.have.length(2);
+            expect(codes[0].err).to.be.a("string");
+            expect(codes[1].data).to.eql("Hello");
+        });
+    });
+    context("string encoding of other charsets", function () {
+        // version 1 grids encoded with qrcodegen, mask 0.
+        const grids = {
+            // 日本 in Shift-JIS, kanji mode.
+            kanji: "7fd43f080a7615dd2ea8dba575839ce05ff5072800f775c4c6" +
+                   "5594a1ab94dd32fe2e018ae8df440e1ae25d53b5cb5575bdd3" +
+                   "a0ddf5d74e00",
+            // e1 e2 e3, ECI ISO-8859-7.
+            greek:  "7fda3fc809766ddd2ea5db457583a0e05ff507d800f76fc487" +
+                    "88ba47445a21755d75015ed9df3a0eea1d5defa00b987545c4" +
+                    "a063f957b501",
+            // a3 f3 64 bc, ECI ISO-8859-2.
+            polish: "7fd43f080a7615dd2ea8dba575839ce05ff5072800f775c4a5" +
+                    "d515a3e30fdd05d62e0182d9dfc50e1a565d55bb0b1575b5c3" +
+                    "a09ef8f7c601",
+            // 41 93, ECI Shift-JIS: a truncated double-byte character.
+            truncated: "7fd43f080a7615dd2ea8dba575839ce05ff5072800f7754425" +
+                       "157ba75308de45a46e0182dcdfc40f3a525d57bbcb5574bdd3" +
+                       "a0dcf9d7ce01",
+            // 61 a1 62, ECI ISO-8859-6: a1 is not assigned.
+            unassigned: "7fda3fc809766ddd2ea5db457583a0e05ff507d800f76f4434" +
+                        "087e4b440e20653f750156dd5f3a0efa5d5defa60b187545c4" +
+                        "a063f9179501",
+        };
+        const expected = [
+            // [grid, mode, eci, data]
+            ["kanji",      "KANJI", undefined,    "日本"],
+            ["greek",      "BYTE",  "ISO_8859_7", "αβγ"],
+            ["polish",     "BYTE",  "ISO_8859_2", "Łódź"],
+            ["truncated",  "BYTE",  "SHIFT_JIS",  "A\ufffd"],
+            ["unassigned", "BYTE",  "ISO_8859_6", "a\ufffdb"],
+        ];
+        function grid(name) {
+            return { size: 21, cell_bitmap: Buffer.from(grids[name], "hex") };
+        }
+
+        for (const [name, mode, eci, data] of expected) {
+            it(`should convert the ${name} grid to UTF-8`, function () {
+                return quirc.decodeGrids([grid(name)], { encoding: "string" }).then((codes) => {
+                    expect(codes).to.be.an('array').and.to.have.length(1);
+                    expect(codes[0].err).to.not.exist;
+                    expect(codes[0].mode).to.eql(mode);
+                    expect(codes[0].eci).to.eql(eci);
+                    expect(codes[0].data).to.eql(data);
+                });
+            });
+        }
+        it("should convert codes of alternating charsets in one list", function () {
+            const names = ["kanji", "greek", "truncated", "greek", "polish", "kanji"];
+            return quirc.decodeGrids(names.map(grid), { encoding: "string" }).then((codes) => {
+                const data = new Map(expected.map((e) => [e[0], e[3]]));
+                expect(codes.map((c) => c.data)).to.eql(names.map((n) => data.get(n)));
+            });
+        });
+    });
+});
+
+describe("probe()", function () {
+    it("should throw when img is not a Buffer", function () {
+        expect(function () {
+            quirc.probe("Hello+World.png");
+        }).to.throw(TypeError, "img must be a Buffer");
+    });
+    it("should return null when img is not an image", function () {
+        expect(quirc.probe(Buffer.from("Hello World"))).to.be.null;
+    });
+    for (const ext of extensions) {
+        it(`should return the ${ext} image header`, function () {
+            const info = quirc.probe(read_test_data(`big_image_with_two_qrcodes.${ext}`));
+            const pixels = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+            expect(info.format).to.eql(ext);
+            expect(info.width).to.eql(pixels.width);
+            expect(info.height).to.eql(pixels.height);
+            expect(info.channels).to.be.within(1, 4);
+        });
+    }
+    for (const format of uncompressed_formats) {
+        it(`should return the ${format} image header`, function () {
+            const pixels = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+            const info = quirc.probe(encode_uncompressed(format, pixels));
+            expect(info).to.eql({
+                format,
+                width: pixels.width,
+                height: pixels.height,
+                channels: (format === "pgm" ? 1 : 3),
+            });
+        });
+    }
+});
+
+describe("decodeFiles()", function () {
+    it("should throw when paths is not an array of strings", function () {
+        expect(function () {
+            quirc.decodeFiles("Hello+World.png");
+        }).to.throw(TypeError, "paths must be an array of strings");
+    });
+    it("should throw when readahead is negative", function () {
+        expect(function () {
+            quirc.decodeFiles([], { readahead: -1 });
+        }).to.throw(TypeError, "unexpected readahead value: -1");
+    });
+    it("should yield the result of every file", function (done) {
+        const paths = [
+            test_data_path("Hello+World.png"),
+            test_data_path("missing.png"),
+            test_data_path("big_image_with_two_qrcodes.jpeg"),
+            test_data_path("Hello+World.jpeg"),
+            test_data_path("1x1.png"),
+        ];
+        const results = [];
+        quirc.decodeFiles(paths, { concurrency: 2, readahead: 1 })
+            .on("data", (result) => results.push(result))
+            .on("end", () => {
+                results.sort((a, b) => a.index - b.index);
+                expect(results.map((r) => r.index)).to.eql([0, 1, 2, 3, 4]);
+                expect(results[0].codes).to.have.length(2);
+                expect(results[1].err.code).to.eql("ENOENT");
+                expect(results[2].codes).to.have.length(2);
+                expect(results[3].codes).to.have.length(2);
+                expect(results[4].codes).to.have.length(0);
+                return done();
+            });
+    });
+});
+
+describe("createDecodeStream()", function () {
+    const { Readable, Writable, pipeline } = require("stream");
+
+    // pipe images through a decode stream, resolving with every result.
+    function decode_stream(images, options) {
+        const results = [];
+        return new Promise((resolve, reject) => {
+            pipeline(
+                Readable.from(images),
+                quirc.createDecodeStream(options),
+                new Writable({
+                    objectMode: true,
+                    write(result, encoding, callback) {
+                        results.push(result);
+                        return callback();
+                    },
+                }),
+                (err) => (err ? reject(err) : resolve(results))
+            );
+        });
+    }
+
+    describe("arguments", function () {
+        it("should throw when concurrency is zero", function () {
+            expect(function () {
+                quirc.createDecodeStream({ concurrency: 0 });
+            }).to.throw(TypeError, "unexpected concurrency value: 0");
+        });
+        it("should throw when ordered is not a boolean", function () {
+            expect(function () {
+                quirc.createDecodeStream({ ordered: "yes" });
+            }).to.throw(TypeError, "unexpected ordered value: yes");
+        });
+        it("should throw when given an output buffer", function () {
+            expect(function () {
+                quirc.createDecodeStream({ output: Buffer.alloc(1024) });
+            }).to.throw(TypeError, "output buffers are not supported by streams");
+        });
+    });
+
+    context("when ordered", function () {
+        it("should yield every result in input order", function () {
+            const images = [
+                read_test_data("Hello+World.png"),
+                Buffer.from("Hello World"),
+                read_test_data("big_image_with_two_qrcodes.png"),
+                read_test_data("1x1.jpeg"),
+                read_test_data("Hello+World.jpeg"),
+            ];
+            return decode_stream(images, { concurrency: 2 }).then((results) => {
+                expect(results.map((r) => r.index)).to.eql([0, 1, 2, 3, 4]);
+                expect(results[0].codes).to.have.length(2);
+                expect(results[1].err).to.be.an("error");
+                expect(results[1].err.message).to.eql("failed to load image");
+                expect(results[2].codes).to.have.length(2);
+                expect(results[3].codes).to.have.length(0);
+                expect(results[4].codes).to.have.length(2);
+            });
+        });
+    });
+
+    context("when not ordered", function () {
+        it("should yield every result", function () {
+            const images = Array(8).fill(read_test_data("Hello+World.png"));
+            return decode_stream(images, { ordered: false }).then((results) => {
+                const indexes = results.map((r) => r.index).sort((a, b) => a - b);
+                expect(indexes).to.eql([0, 1, 2, 3, 4, 5, 6, 7]);
+                for (const result of results) {
+                    expect(result.codes[0].data.toString()).to.eql("Hello");
+                }
+            });
+        });
+    });
+});
+
+describe("createIncremental()", function () {
+    // write img to a new incremental decoder in size-byte chunks, each one
+    // once the previous was handed over so that they are not concatenated.
+    function decode_incremental(img, size, options) {
+        const decoder = quirc.createIncremental(options);
+        let written = Promise.resolve();
+        for (let i = 0; i < img.length; i += size) {
+            const chunk = img.subarray(i, i + size);
+            written = written.then(() => new Promise((resolve) => decoder.write(chunk, resolve)));
+        }
+        return written.then(() => decoder.end());
+    }
+
+    describe("arguments", function () {
+        it("should throw when given an output buffer", function () {
+            expect(function () {
+                quirc.createIncremental({ output: Buffer.alloc(1024) });
+            }).to.throw(TypeError, "createIncremental() does not support output buffers");
+        });
+        it("should throw when chunk is not a Buffer", function () {
+            expect(function () {
+                quirc.createIncremental().write("Hello");
+            }).to.throw(TypeError, "chunk must be a Buffer or Uint8Array");
+        });
+        it("should throw when callback is not a function", function () {
+            expect(function () {
+                quirc.createIncremental().write(Buffer.from("Hello"), "callback");
+            }).to.throw(TypeError, "callback must be a function");
+        });
+        it("should throw when writing after end", function () {
+            const decoder = quirc.createIncremental();
+            decoder.end(function dummy() { });
+            expect(function () {
+                decoder.write(Buffer.from("Hello"));
+            }).to.throw(Error, "write after end");
+        });
+    });
+
+    it("should yield an Error when the image can't be loaded", function () {
+        return decode_incremental(Buffer.from("Hello World"), 4).then(() => {
+            throw new Error("expected an error");
+        }, (err) => {
+            expect(err.message).to.eql("failed to load image");
+        });
+    });
+    it("should yield an Error when the image is truncated", function () {
+        const img = read_test_data("Hello+World.png");
+        return decode_incremental(img.subarray(0, img.length / 2), 64).then(() => {
+            throw new Error("expected an error");
+        }, (err) => {
+            expect(err.message).to.eql("failed to load image");
+        });
+    });
+    for (const ext of extensions) {
+        for (const [file, size] of [
+            ["Hello+World", 1],
+            ["Hello+World", 7],
+            ["big_image_with_two_qrcodes", 97],
+            ["big_image_with_two_qrcodes", 4093],
+        ]) {
+            it(`should decode a ${ext} image written in ${size}-byte chunks`, function () {
+                const img = read_test_data(`${file}.${ext}`);
+                return Promise.all([
+                    decode_incremental(img, size),
+                    quirc.decode(img),
+                ]).then(([codes, expected]) => {
+                    expect(codes).to.have.length(2);
+                    expect(codes).to.eql(expected);
+                });
+            });
+        }
+    }
+    it("should call back every write once its chunk was handed over", function () {
+        const img = read_test_data("Hello+World.png");
+        const decoder = quirc.createIncremental();
+        const chunks = [img.subarray(0, 100), Buffer.alloc(0), img.subarray(100)];
+        const written = chunks.map((chunk) => new Promise((resolve) => decoder.write(chunk, resolve)));
+        return Promise.all(written).then(() => decoder.end()).then((codes) => {
+            expect(codes).to.have.length(2);
+            expect(codes[0].data.toString()).to.eql("Hello");
+        });
+    });
+    it("should decode a bmp image written in 4096-byte chunks", function () {
+        const pixels = jpeg.decode(read_test_data("big_image_with_two_qrcodes.jpeg"));
+        const img = encode_uncompressed("bmp", pixels);
+        return Promise.all([
+            decode_incremental(img, 4096),
+            quirc.decode(img),
+        ]).then(([codes, expected]) => {
+            expect(codes).to.have.length(2);
+            expect(codes).to.eql(expected);
+        });
+    });
+    it("should honor the decode options", function () {
+        const img = read_test_data("Hello+World.jpeg");
+        return decode_incremental(img, 512, { output: "binary" }).then((buffer) => {
+            const codes = new quirc.BinaryResults(buffer);
+            expect(codes.length).to.eql(2);
+            expect(codes.data(0).toString()).to.eql("Hello");
+            expect(codes.data(1).toString()).to.eql("World");
+        });
+    });
+
+    context("when the memory budget only fits one decode", function () {
+        before(function () {
+            quirc.configure({ memoryBudget: 16 * 1024 * 1024 });
+        });
+        after(function () {
+            quirc.configure({ memoryBudget: 0 });
+        });
+
+        it("should release its memory once ended", function () {
+            const img = read_test_data("big_image_with_two_qrcodes.png");
+            // keep the decoder alive until the regular decode is done
+            const decoder = quirc.createIncremental();
+            decoder.write(img);
+            return decoder.end().then((codes) => {
+                expect(codes).to.have.length(2);
+                return quirc.decode(img);
+            }).then((codes) => {
+                expect(codes).to.have.length(2);
+                expect(decoder.ended).to.be.true;
+            });
+        });
+    });
+
+    context("when decodes wait for the memory budget", function () {
+        before(function () {
+            quirc.configure({ memoryBudget: 16 * 1024 * 1024, memoryBudgetWait: true });
+        });
+        after(function () {
+            quirc.configure({ memoryBudget: 0, memoryBudgetWait: false });
+        });
+
+        it("should not make them wait for an idle incremental decoder", function () {
+            const img = read_test_data("big_image_with_two_qrcodes.png");
+            const half = img.length >> 1;
+            const decoder = quirc.createIncremental();
+            const written = new Promise((resolve) => decoder.write(img.subarray(0, half), resolve));
+            return written.then(() => {
+                // more than the libuv thread pool size: had they waited, the
+                // decoder's next write could never run.
+                const decodes = Array(8).fill(0).map(() => quirc.decode(img).then(() => {
+                    throw new Error("expected an error");
+                }, (err) => {
+                    expect(err.code).to.eql(quirc.constants.ERR_MEMORY_BUDGET);
+                }));
+                return Promise.all(decodes.concat(quirc.decode(read_test_data("Hello+World.png"))));
+            }).then((results) => {
+                expect(results[8]).to.have.length(2);
+                decoder.write(img.subarray(half));
+                return decoder.end();
+            }).then((codes) => {
+                expect(codes).to.have.length(2);
+                return quirc.decode(img);
+            }).then((codes) => {
+                expect(codes).to.have.length(2);
+            });
+        });
+        it("should not make an incremental decoder wait", function () {
+            const img = read_test_data("big_image_with_two_qrcodes.png");
+            const first = quirc.createIncremental();
+            const second = quirc.createIncremental();
+            const written = new Promise((resolve) => first.write(img.subarray(0, img.length >> 1), resolve));
+            return written.then(() => second.write(img).end()).then(() => {
+                throw new Error("expected an error");
+            }, (err) => {
+                expect(err.code).to.eql(quirc.constants.ERR_MEMORY_BUDGET);
+                first.write(img.subarray(img.length >> 1));
+                return first.end();
+            }).then((codes) => {
+                expect(codes).to.have.length(2);
+            });
+        });
+    });
+});
+
+describe("loadStats()", function () {
+    // Optional loading paths, enabled by decode() options or configure()
+    // settings (the second one turning them off again). Each must yield the
+    // same results as the default one for every image, and be counted by the
+    // loadStats() stat for the taken ones (all of them by default).
+    const paths = [
+        {
+            name: "fast JPEG decoding",
+            stat: "jpegFast",
+            options: { jpeg: "fast" },
+            images: ["Hello+World.jpeg", "big_image_with_two_qrcodes.jpeg"],
+        },
+        {
+            name: "JPEG decoding on several threads",
+            stat: "jpegBands",
+            settings: [{ jpegThreads: 4 }, { jpegThreads: 1 }],
+            images: ["restart.jpeg", "Hello+World.jpeg", "big_image_with_two_qrcodes.jpeg"],
+            // the others have no restart markers
+            taken: ["restart.jpeg"],
+        },
+        {
+            name: "histogram counting while loading",
+            stat: "pipelined",
+            settings: [{ pipelinePixels: 1 }, { pipelinePixels: 0 }],
+            images: extensions.map((ext) => `big_image_with_two_qrcodes.${ext}`),
+        },
+    ];
+
+    it("should count every path", function () {
+        expect(quirc.loadStats()).to.have.all.keys(paths.map((p) => p.stat));
+    });
+    for (const { name, stat, options, settings, images, taken } of paths) {
+        context(`with ${name}`, function () {
+            for (const file of images) {
+                const expected = (taken || images).includes(file) ? 1 : 0;
+                it(`should yield the default results for ${file}`, function () {
+                    const image = read_test_data(file);
+                    const before = quirc.loadStats()[stat];
+                    if (settings) {
+                        quirc.configure(settings[0]);
+                    }
+                    // the settings are read by the decode's thread
+                    const decoded = quirc.decode(image, { output: "binary", ...options }).finally(() => {
+                        if (settings) {
+                            quirc.configure(settings[1]);
+                        }
+                    });
+                    return decoded.then((results) => {
+                        expect(quirc.loadStats()[stat] - before).to.eql(expected);
+                        return quirc.decode(image, { output: "binary" }).then((reference) => {
+                            expect(results).to.eql(reference);
+                            expect(new quirc.BinaryResults(results).length).to.eql(2);
+                        });
+                    });
+                });
+            }
+        });
+    }
+});
+
+describe("configure()", function () {
+    describe("arguments", function () {
+        it("should throw when options is not an object", function () {
+            expect(function () {
+                quirc.configure("batch");
+            }).to.throw(TypeError, "options must be an object");
+        });
+        it("should throw when batch is not an object or false", function () {
+            expect(function () {
+                quirc.configure({ batch: 42 });
+            }).to.throw(TypeError, "batch must be an object or false");
+        });
+        it("should throw when priorityAging is negative", function () {
+            expect(function () {
+                quirc.configure({ priorityAging: -1 });
+            }).to.throw(TypeError, "unexpected priorityAging value: -1");
+        });
+        it("should throw when maxQueueDepth is not an integer", function () {
+            expect(function () {
+                quirc.configure({ maxQueueDepth: 1.5 });
+            }).to.throw(TypeError, "unexpected maxQueueDepth value: 1.5");
+        });
+        it("should throw when maxPixels is negative", function () {
+            expect(function () {
+                quirc.configure({ maxPixels: -1 });
+            }).to.throw(TypeError, "unexpected maxPixels value: -1");
+        });
+        it("should throw when jpegPixelBudget is not an integer", function () {
+            expect(function () {
+                quirc.configure({ jpegPixelBudget: 0.5 });
+            }).to.throw(TypeError, "unexpected jpegPixelBudget value: 0.5");
+        });
+        it("should throw when jpegThreads is zero", function () {
+            expect(function () {
+                quirc.configure({ jpegThreads: 0 });
+            }).to.throw(TypeError, "unexpected jpegThreads value: 0");
+        });
+        it("should throw when pipelinePixels is negative", function () {
+            expect(function () {
+                quirc.configure({ pipelinePixels: -1 });
+            }).to.throw(TypeError, "unexpected pipelinePixels value: -1");
+        });
+        it("should throw when cache.maxEntries is zero", function () {
+            expect(function () {
+                quirc.configure({ cache: { maxEntries: 0 } });
+            }).to.throw(TypeError, "unexpected cache.maxEntries value: 0");
+        });
+        it("should throw when batch.maxSize is zero", function () {
+            expect(function () {
+                quirc.configure({ batch: { maxSize: 0 } });
+            }).to.throw(TypeError, "unexpected batch.maxSize value: 0");
+        });
+    });
+
+    context("when the queue depth is limited", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+            quirc.configure({ maxQueueDepth: 2 });
+        });
+        after(function () {
+            quirc.configure({ maxQueueDepth: 0 });
+        });
+
+        it("should reject decodes once the queue is full", function () {
+            const decodes = Array(5).fill(0).map(() => quirc.decode(hello_plus_world).then(
+                (codes) => codes,
+                (err) => err
+            ));
+            expect(quirc.queueDepth()).to.eql(2);
+            return Promise.all(decodes).then((results) => {
+                const rejected = results.filter((r) => r instanceof Error);
+                expect(rejected).to.have.length(3);
+                for (const err of rejected) {
+                    expect(err.message).to.eql("decode queue is full");
+                    expect(err.code).to.eql(quirc.constants.ERR_QUEUE_FULL);
+                }
+                expect(quirc.queueDepth()).to.eql(0);
+            });
+        });
+    });
+
+    context("when the image has too many pixels", function () {
+        before(function () {
+            quirc.configure({ maxPixels: 1000 * 1000 });
+        });
+        after(function () {
+            quirc.configure({ maxPixels: 0 });
+        });
+
+        for (const ext of extensions) {
+            it(`should yield an Error for a ${ext} image`, function (done) {
+                const image = read_test_data(`big_image_with_two_qrcodes.${ext}`);
+                quirc.decode(image, function (err, codes) {
+                    expect(err).to.exist.and.to.be.an("error");
+                    expect(err.message).to.eql("image is too large");
+                    expect(err.code).to.eql(quirc.constants.ERR_IMAGE_TOO_LARGE);
+                    return done();
+                });
+            });
+        }
+        it("should decode smaller images", function () {
+            return quirc.decode(read_test_data("Hello+World.png")).then((codes) => {
+                expect(codes).to.have.length(2);
+            });
+        });
+    });
+
+    context("when large JPEG images are downscaled", function () {
+        // Hello+World.jpeg upscaled 8 times, large enough to be downscaled
+        let big_hello_plus_world;
+        before(function () {
+            const small = jpeg.decode(read_test_data("Hello+World.jpeg"));
+            const scale = 8, width = small.width * scale, height = small.height * scale;
+            const data = Buffer.alloc(width * height * 4);
+            for (let y = 0; y < height; y++) {
+                for (let x = 0; x < width; x++) {
+                    const from = (Math.floor(y / scale) * small.width + Math.floor(x / scale)) * 4;
+                    small.data.copy(data, (y * width + x) * 4, from, from + 4);
+                }
+            }
+            big_hello_plus_world = jpeg.encode({ data, width, height }, 90).data;
+            quirc.configure({ jpegPixelBudget: 100 * 1000 });
+        });
+        after(function () {
+            quirc.configure({ jpegPixelBudget: 0 });
+        });
+
+        it("should report the corners in full size coordinates", function () {
+            return Promise.all([
+                quirc.decode(big_hello_plus_world, { output: "binary" }),
+                quirc.locate(read_test_data("Hello+World.jpeg")),
+            ]).then(([buffer, small]) => {
+                const codes = new quirc.BinaryResults(buffer);
+                expect(codes.length).to.eql(2);
+                expect(codes.data(0).toString()).to.eql("Hello");
+                expect(codes.data(1).toString()).to.eql("World");
+                for (let i = 0; i < 2; i++) {
+                    codes.corners(i).forEach(({ x, y }, j) => {
+                        expect(x).to.be.closeTo(small[i].corners[j].x * 8, 16);
+                        expect(y).to.be.closeTo(small[i].corners[j].y * 8, 16);
+                    });
+                }
+            });
+        });
+        it("should locate codes in the downscaled image", function () {
+            return quirc.locate(big_hello_plus_world).then((locations) => {
+                expect(locations).to.have.length(2);
+                // 1/4 downscaled coordinates, scaled back
+                for (const { corners } of locations) {
+                    for (const { x, y } of corners) {
+                        expect(x % 4).to.eql(0);
+                        expect(y % 4).to.eql(0);
+                    }
+                }
+            });
+        });
+        it("should fall back to full size when downscaled codes can't be read", function () {
+            const image = read_test_data("big_image_with_two_qrcodes.jpeg");
+            return quirc.decode(image, { output: "binary" }).then((buffer) => {
+                const codes = new quirc.BinaryResults(buffer);
+                expect(codes.length).to.eql(2);
+                expect(codes.data(0).toString()).to.eql("from javascript");
+                expect(codes.data(1).toString()).to.eql("here comes qr!");
+                // a 1/8 downscaled decode only yields multiples of 8
+                const corners = codes.corners(0).concat(codes.corners(1));
+                expect(corners.some(({ x, y }) => x % 8 !== 0 || y % 8 !== 0)).to.be.true;
+            });
+        });
+        it("should not serve results cached at another budget", function () {
+            quirc.configure({ cache: { maxEntries: 2 } });
+            return quirc.decode(big_hello_plus_world).then(() => {
+                quirc.configure({ jpegPixelBudget: 0 });
+                const before = quirc.cacheStats();
+                return quirc.decode(big_hello_plus_world).then(() => before);
+            }).then((before) => {
+                expect(before.entries).to.eql(0);
+                expect(quirc.cacheStats().misses - before.misses).to.eql(1);
+            }).finally(() => {
+                quirc.configure({ cache: false, jpegPixelBudget: 100 * 1000 });
+            });
+        });
+        it("should not serve results cached before maxPixels was lowered", function () {
+            quirc.configure({ cache: { maxEntries: 2 } });
+            return quirc.decode(big_hello_plus_world).then(() => {
+                quirc.configure({ maxPixels: 1000 });
+                return quirc.decode(big_hello_plus_world);
+            }).then(() => {
+                throw new Error("expected an error");
+            }, (err) => {
+                expect(err.code).to.eql(quirc.constants.ERR_IMAGE_TOO_LARGE);
+            }).finally(() => {
+                quirc.configure({ cache: false, maxPixels: 0 });
+            });
+        });
+    });
+
+    context("when the memory budget is too small", function () {
+        let big_image_with_two_qrcodes;
+        before(function () {
+            big_image_with_two_qrcodes = read_test_data("big_image_with_two_qrcodes.png");
+            quirc.configure({ memoryBudget: 1024 });
+        });
+        after(function () {
+            quirc.configure({ memoryBudget: 0 });
+        });
+
+        it("should yield an Error", function (done) {
+            quirc.decode(big_image_with_two_qrcodes, function (err, codes) {
+                expect(err).to.exist.and.to.be.an("error");
+                expect(err.message).to.eql("memory budget exceeded");
+                expect(err.code).to.eql(quirc.constants.ERR_MEMORY_BUDGET);
+                return done();
+            });
+        });
+    });
+
+    context("when the memory budget is large enough", function () {
+        let big_image_with_two_qrcodes;
+        before(function () {
+            big_image_with_two_qrcodes = read_test_data("big_image_with_two_qrcodes.png");
+            quirc.configure({ memoryBudget: 64 * 1024 * 1024, memoryBudgetWait: true });
+        });
+        after(function () {
+            quirc.configure({ memoryBudget: 0, memoryBudgetWait: false });
+        });
+
+        it("should yield every result", function () {
+            const decodes = Array(4).fill(0).map(() => quirc.decode(big_image_with_two_qrcodes));
+            return Promise.all(decodes).then((results) => {
+                for (const codes of results) {
+                    expect(codes).to.be.an('array').and.to.have.length(2);
+                }
+            });
+        });
+    });
+
+    context("when the result cache is enabled", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+            quirc.configure({ cache: { maxEntries: 2 } });
+        });
+        after(function () {
+            quirc.configure({ cache: false });
+        });
+
+        it("should yield the cached results", function () {
+            const before = quirc.cacheStats();
+            return quirc.decode(hello_plus_world).then(() => {
+                return quirc.decode(hello_plus_world);
+            }).then((codes) => {
+                expect(codes).to.be.an('array').and.to.have.length(2);
+                expect(codes[0].data.toString()).to.eql("Hello");
+                expect(codes[1].data.toString()).to.eql("World");
+                const stats = quirc.cacheStats();
+                expect(stats.hits - before.hits).to.eql(1);
+                expect(stats.misses - before.misses).to.eql(1);
+                expect(stats.entries).to.eql(1);
+            });
+        });
+        it("should evict the least recently used results", function () {
+            const images = ["1x1.png", "eci.png", "flipped.png"].map(read_test_data);
+            return images.reduce(
+                (p, img) => p.then(() => quirc.decode(img)),
+                Promise.resolve()
+            ).then(() => {
+                expect(quirc.cacheStats().entries).to.eql(2);
+            });
+        });
+    });
+
+    context("when completion batching is enabled", function () {
+        let hello_plus_world;
+        before(function () {
+            hello_plus_world = read_test_data("Hello+World.png");
+            quirc.configure({ batch: { maxDelay: 5, maxSize: 4 } });
+        });
+        after(function () {
+            quirc.configure({ batch: false });
+        });
+
+        it("should yield every result", function () {
+            const decodes = Array(10).fill(0).map(() => quirc.decode(hello_plus_world));
+            return Promise.all(decodes).then((results) => {
+                for (const codes of results) {
+                    expect(codes).to.be.an('array').and.to.have.length(2);
+                    expect(codes[0].data.toString()).to.eql("Hello");
+                    expect(codes[1].data.toString()).to.eql("World");
+                }
+            });
+        });
+        it("should yield errors", function (done) {
+            quirc.decode(Buffer.from("Hello World"), function (err, codes) {
+                expect(err).to.exist.and.to.be.an("error");
+                expect(err.message).to.eql("failed to load image");
+                return done();
+            });
+        });
+    });
+});